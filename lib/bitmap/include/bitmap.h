@@ -91,9 +91,23 @@ typedef struct                       /**** Bitmap information structure ****/
  */
 
 extern GLubyte *LoadDIBitmap(const char *filename, BITMAPINFO **info);
+extern GLubyte *LoadDIBitmapRGBA(const char *filename, BITMAPINFO **info);
 extern int     SaveDIBitmap(const char *filename, BITMAPINFO *info,
                             GLubyte *bits);
 
+/*
+ * Kernels for converting pixels from BGR, fastest last.  By default the
+ * fastest one the CPU can run is used.
+ */
+
+#  define BITMAP_KERNEL_AUTO   0
+#  define BITMAP_KERNEL_SCALAR 1
+#  define BITMAP_KERNEL_SSSE3  2
+#  define BITMAP_KERNEL_AVX2   3
+
+extern int        BitmapUseKernel(int kernel);
+extern const char *BitmapKernelName(int kernel);
+
 #  ifdef __cplusplus
 }
 #  endif /* __cplusplus */
@@ -2,179 +2,470 @@
  * Windows BMP file functions for OpenGL.
  *
  * Written by Michael Sweet.
+ *
+ * The whole file is read with a single fread(), the header fields are taken
+ * from that buffer, and the pixels are converted from BGR as they are copied
+ * out of it.  The conversion uses SSSE3 or AVX2 shuffles when the CPU has them,
+ * which is checked at run time, so no special compiler options are needed.
  */
 
 #include "include/bitmap.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#  define BITMAP_X86
+#  include <immintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#    define TARGET_SSSE3
+#    define TARGET_AVX2
+#  else
+#    define TARGET_SSSE3 __attribute__((target("ssse3")))
+#    define TARGET_AVX2  __attribute__((target("avx2")))
+#  endif
+#endif
+
 /*
- * Functions for reading and writing 16- and 32-bit little-endian integers.
+ * Functions for reading 16- and 32-bit little-endian integers from memory.
  */
 
-static unsigned short read_word(FILE *fp);
-static unsigned int   read_dword(FILE *fp);
-static int            read_long(FILE *fp);
+static unsigned short get_word(const GLubyte *p);
+static unsigned int   get_dword(const GLubyte *p);
+static int            get_long(const GLubyte *p);
+
+static GLubyte *load_bitmap(const char *filename, BITMAPINFO **info, int rgba);
 
 /*
- * 'LoadDIBitmap()' - Load a DIB/BMP file from disk.
+ * Pixel conversion kernels.  Each converts n BGR pixels from src into RGB or
+ * RGBA pixels in dst.  For RGB, dst may be lower down in the same buffer,
+ * since each pixel is read before anything is written over it.  The
+ * vector kernels read and write a few bytes past the pixels they convert, so
+ * they leave enough pixels at the end of a row for the next kernel down to
+ * finish off.
+ */
+
+static void
+bgr_to_rgb_scalar(const GLubyte *src, /* I - BGR pixels */
+                  GLubyte       *dst, /* O - RGB pixels */
+                  int           n)    /* I - Number of pixels */
+{
+    for (; n > 0; n --, src += 3, dst += 3)
+    {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+    }
+}
+
+static void
+bgr_to_rgba_scalar(const GLubyte *src, /* I - BGR pixels */
+                   GLubyte       *dst, /* O - RGBA pixels */
+                   int           n)    /* I - Number of pixels */
+{
+    for (; n > 0; n --, src += 3, dst += 4)
+    {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        dst[3] = 255;
+    }
+}
+
+#ifdef BITMAP_X86
+/* 5 pixels at a time, each time reading and writing 16 bytes but using 15 */
+static TARGET_SSSE3 void
+bgr_to_rgb_ssse3(const GLubyte *src, GLubyte *dst, int n)
+{
+    const __m128i swap = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+
+    for (; n >= 6; n -= 5, src += 15, dst += 15)
+        _mm_storeu_si128((__m128i *)dst,
+                         _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), swap));
+    bgr_to_rgb_scalar(src, dst, n);
+}
+
+/* 4 pixels at a time, reading 16 bytes but using 12 */
+static TARGET_SSSE3 void
+bgr_to_rgba_ssse3(const GLubyte *src, GLubyte *dst, int n)
+{
+    const __m128i expand = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+
+    for (; n >= 6; n -= 4, src += 12, dst += 16)
+        _mm_storeu_si128((__m128i *)dst,
+                         _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), expand),
+                                      alpha));
+    bgr_to_rgba_scalar(src, dst, n);
+}
+
+/*
+ * AVX2 byte shuffles can't cross between the two 128-bit lanes, so each lane
+ * is loaded separately, from where its pixels start.
+ */
+static TARGET_AVX2 __m256i
+load_lanes(const GLubyte *lo, const GLubyte *hi)
+{
+    return (_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)lo)),
+                                    _mm_loadu_si128((const __m128i *)hi), 1));
+}
+
+/* 10 pixels at a time, 5 in each lane */
+static TARGET_AVX2 void
+bgr_to_rgb_avx2(const GLubyte *src, GLubyte *dst, int n)
+{
+    const __m256i swap = _mm256_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15,
+                                          2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+    __m256i v;
+
+    for (; n >= 11; n -= 10, src += 30, dst += 30)
+    {
+        v = _mm256_shuffle_epi8(load_lanes(src, src + 15), swap);
+        _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i *)(dst + 15), _mm256_extracti128_si256(v, 1));
+    }
+    bgr_to_rgb_ssse3(src, dst, n);
+}
+
+/* 8 pixels at a time, 4 in each lane */
+static TARGET_AVX2 void
+bgr_to_rgba_avx2(const GLubyte *src, GLubyte *dst, int n)
+{
+    const __m256i expand = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+                                            2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+
+    for (; n >= 10; n -= 8, src += 24, dst += 32)
+        _mm256_storeu_si256((__m256i *)dst,
+                            _mm256_or_si256(_mm256_shuffle_epi8(load_lanes(src, src + 12), expand),
+                                            alpha));
+    bgr_to_rgba_ssse3(src, dst, n);
+}
+#endif /* BITMAP_X86 */
+
+
+/*
+ * 'best_kernel()' - Find the fastest kernel this CPU can run.
+ */
+
+static int
+best_kernel(void)
+{
+#ifdef BITMAP_X86
+    int ssse3, avx2 = 0;
+#  ifdef _MSC_VER
+    int regs[4], max_leaf;
+
+    __cpuid(regs, 0);
+    max_leaf = regs[0];
+    __cpuid(regs, 1);
+    ssse3 = (regs[2] >> 9) & 1;
+    /* AVX2 also needs the OS to save the YMM registers (OSXSAVE, AVX and XCR0) */
+    if (max_leaf >= 7 && ((regs[2] >> 27) & 3) == 3 && (_xgetbv(0) & 6) == 6)
+    {
+        __cpuidex(regs, 7, 0);
+        avx2 = (regs[1] >> 5) & 1;
+    }
+#  else
+    __builtin_cpu_init();
+    ssse3 = __builtin_cpu_supports("ssse3");
+    avx2 = __builtin_cpu_supports("avx2");
+#  endif
+    if (avx2)
+        return (BITMAP_KERNEL_AVX2);
+    if (ssse3)
+        return (BITMAP_KERNEL_SSSE3);
+#endif /* BITMAP_X86 */
+    return (BITMAP_KERNEL_SCALAR);
+}
+
+static int forced_kernel = BITMAP_KERNEL_AUTO;
+
+
+/*
+ * 'BitmapUseKernel()' - Choose the pixel conversion kernel, e.g., to compare
+ *                       them.  BITMAP_KERNEL_AUTO picks the fastest, which is
+ *                       the default.  Asking for a kernel the CPU can't run
+ *                       gets the fastest one it can.
  *
- * Returns a pointer to the bitmap if successful, NULL otherwise...
+ * Returns the kernel that will be used.
  */
 
-GLubyte *                          /* O - Bitmap data */
-LoadDIBitmap(const char *filename, /* I - File to load */
-             BITMAPINFO **info)    /* O - Bitmap information */
+int                           /* O - Kernel now in use */
+BitmapUseKernel(int kernel)   /* I - BITMAP_KERNEL_* */
 {
-    FILE             *fp;          /* Open file pointer */
-    GLubyte          *bits;        /* Bitmap pixel bits */
-    GLubyte          *ptr;         /* Pointer into bitmap */
-    GLubyte          temp;         /* Temporary variable to swap red and blue */
-    int              x, y;         /* X and Y position in image */
-    int              length;       /* Line length */
-    int              bitsize;      /* Size of bitmap */
-    int              infosize;     /* Size of header information */
-    BITMAPFILEHEADER header;       /* File header */
+    int best = best_kernel();
+
+    forced_kernel = (kernel == BITMAP_KERNEL_AUTO || kernel > best) ? BITMAP_KERNEL_AUTO : kernel;
+    return (forced_kernel == BITMAP_KERNEL_AUTO ? best : forced_kernel);
+}
+
+
+/*
+ * 'BitmapKernelName()' - Get a kernel's name, for messages.
+ */
+
+const char *
+BitmapKernelName(int kernel)
+{
+    switch (kernel)
+    {
+        case BITMAP_KERNEL_SCALAR : return ("scalar");
+        case BITMAP_KERNEL_SSSE3 :  return ("SSSE3");
+        case BITMAP_KERNEL_AVX2 :   return ("AVX2");
+        default :                   return ("auto");
+    }
+}
+
+
+/*
+ * 'convert_row()' - Convert one row of BGR pixels with the chosen kernel.
+ */
 
+static void
+convert_row(const GLubyte *src, /* I - BGR pixels */
+            GLubyte       *dst, /* O - RGB or RGBA pixels */
+            int           n,    /* I - Number of pixels */
+            int           rgba, /* I - Non-zero for RGBA output */
+            int           kernel) /* I - BITMAP_KERNEL_* */
+{
+    switch (kernel)
+    {
+#ifdef BITMAP_X86
+        case BITMAP_KERNEL_AVX2 :
+            if (rgba) bgr_to_rgba_avx2(src, dst, n);
+            else bgr_to_rgb_avx2(src, dst, n);
+            break;
+        case BITMAP_KERNEL_SSSE3 :
+            if (rgba) bgr_to_rgba_ssse3(src, dst, n);
+            else bgr_to_rgb_ssse3(src, dst, n);
+            break;
+#endif /* BITMAP_X86 */
+        default :
+            if (rgba) bgr_to_rgba_scalar(src, dst, n);
+            else bgr_to_rgb_scalar(src, dst, n);
+            break;
+    }
+}
+
+
+/*
+ * 'read_file()' - Read a whole file into memory with one fread().
+ */
+
+static GLubyte *             /* O - File contents, or NULL */
+read_file(const char *filename, /* I - File to read */
+          long       *size)  /* O - Size of the file */
+{
+    FILE    *fp;             /* Open file pointer */
+    GLubyte *data;           /* File contents */
 
-    /* Try opening the file; use "rb" mode to read this *binary* file. */
     if ((fp = fopen(filename, "rb")) == NULL)
         return (NULL);
 
-    /* Read the file header and any following bitmap information... */
-    header.bfType      = read_word(fp);
-    header.bfSize      = read_dword(fp);
-    header.bfReserved1 = read_word(fp);
-    header.bfReserved2 = read_word(fp);
-    header.bfOffBits   = read_dword(fp);
+    if (fseek(fp, 0, SEEK_END) != 0 || (*size = ftell(fp)) <= 0 || fseek(fp, 0, SEEK_SET) != 0)
+    {
+        fclose(fp);
+        return (NULL);
+    }
 
-    if (header.bfType != 0x4D42) /* Check for BM reversed... */
+    if ((data = (GLubyte *)malloc(*size)) != NULL &&
+        (long)fread(data, 1, *size, fp) < *size)
+    {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(fp);
+    return (data);
+}
+
+
+/*
+ * 'load_bitmap()' - Load a BMP file, converting 24-bit pixels to RGB (with
+ *                   each row still padded to 4 bytes, as in the file) or to
+ *                   tightly packed RGBA.  RGB pixels are converted within the
+ *                   buffer the file was read into, moving them down over the
+ *                   header, so that only one image sized buffer is touched.
+ */
+
+static GLubyte *                   /* O - Bitmap data */
+load_bitmap(const char *filename,  /* I - File to load */
+            BITMAPINFO **info,     /* O - Bitmap information */
+            int        rgba)       /* I - Non-zero for RGBA output */
+{
+    GLubyte          *file;        /* The whole file */
+    long             filesize;     /* Size of the file */
+    GLubyte          *bits;        /* Bitmap pixel bits */
+    int              y;            /* Row in image */
+    int              rows;         /* Number of rows */
+    int              length;       /* Line length in the file */
+    int              outlength;    /* Line length in the result */
+    int              bitsize;      /* Size of bitmap in the file */
+    int              colorsize;    /* Size of the colormap */
+    int              kernel;       /* Pixel conversion kernel */
+    BITMAPFILEHEADER header;       /* File header */
+
+
+    if ((file = read_file(filename, &filesize)) == NULL)
+        return (NULL);
+
+    /* Read the file header and the bitmap information from the buffer... */
+    if (filesize < 54 || get_word(file) != 0x4D42) /* Check for BM reversed... */
     {
         /* Not a bitmap file - return NULL... */
-        fclose(fp);
+        free(file);
         return (NULL);
     }
 
-    infosize = header.bfOffBits - 18;
+    header.bfType      = get_word(file);
+    header.bfSize      = get_dword(file + 2);
+    header.bfReserved1 = get_word(file + 6);
+    header.bfReserved2 = get_word(file + 8);
+    header.bfOffBits   = get_dword(file + 10);
+
     if ((*info = (BITMAPINFO *)malloc(sizeof(BITMAPINFO))) == NULL)
     {
         /* Couldn't allocate memory for bitmap info - return NULL... */
-        fclose(fp);
+        free(file);
         return (NULL);
     }
 
-    (*info)->bmiHeader.biSize          = read_dword(fp);
-    long tmpWidth = read_long(fp);
-    long tmpHeight = read_long(fp);
-    (*info)->bmiHeader.biWidth         = tmpWidth;
-    (*info)->bmiHeader.biHeight        = tmpHeight;
-    (*info)->bmiHeader.biPlanes        = read_word(fp);
-    (*info)->bmiHeader.biBitCount      = read_word(fp);
-    (*info)->bmiHeader.biCompression   = read_dword(fp);
-    (*info)->bmiHeader.biSizeImage     = read_dword(fp);
-    (*info)->bmiHeader.biXPelsPerMeter = read_long(fp);
-    (*info)->bmiHeader.biYPelsPerMeter = read_long(fp);
-    (*info)->bmiHeader.biClrUsed       = read_dword(fp);
-    (*info)->bmiHeader.biClrImportant  = read_dword(fp);
-
-    if (infosize > 40)
-        if (fread((*info)->bmiColors, infosize - 40, 1, fp) < 1)
-        {
-            /* Couldn't read the bitmap header - return NULL... */
-            free(*info);
-            fclose(fp);
-            return (NULL);
-        }
+    (*info)->bmiHeader.biSize          = get_dword(file + 14);
+    (*info)->bmiHeader.biWidth         = get_long(file + 18);
+    (*info)->bmiHeader.biHeight        = get_long(file + 22);
+    (*info)->bmiHeader.biPlanes        = get_word(file + 26);
+    (*info)->bmiHeader.biBitCount      = get_word(file + 28);
+    (*info)->bmiHeader.biCompression   = get_dword(file + 30);
+    (*info)->bmiHeader.biSizeImage     = get_dword(file + 34);
+    (*info)->bmiHeader.biXPelsPerMeter = get_long(file + 38);
+    (*info)->bmiHeader.biYPelsPerMeter = get_long(file + 42);
+    (*info)->bmiHeader.biClrUsed       = get_dword(file + 46);
+    (*info)->bmiHeader.biClrImportant  = get_dword(file + 50);
+
+    /* Any colormap sits between the header and the bitmap */
+    colorsize = (int)header.bfOffBits - 54;
+    if (colorsize > (int)sizeof((*info)->bmiColors))
+        colorsize = sizeof((*info)->bmiColors);
+    if (colorsize > 0)
+        memcpy((*info)->bmiColors, file + 54, colorsize);
 
-    /* Now that we have all the header info read in, allocate memory for *
-     * the bitmap and read *it* in...                                    */
     if ((bitsize = (*info)->bmiHeader.biSizeImage) == 0)
         bitsize = ((*info)->bmiHeader.biWidth *
                    (*info)->bmiHeader.biBitCount + 7) / 8 *
                      abs((*info)->bmiHeader.biHeight);
 
-    if ((bits = (GLubyte *)malloc(bitsize)) == NULL)
+    length = ((*info)->bmiHeader.biWidth * 3 + 3) & ~3;
+    rows   = abs((*info)->bmiHeader.biHeight);
+
+    if (header.bfOffBits < 54 || bitsize < 0 || (long)header.bfOffBits + bitsize > filesize ||
+        (rgba && ((*info)->bmiHeader.biBitCount != 24 || (*info)->bmiHeader.biCompression != BI_RGB ||
+                  (*info)->bmiHeader.biWidth <= 0 || (long)length * rows > bitsize)))
     {
-        /* Couldn't allocate memory - return NULL! */
+        /* Couldn't read bitmap - free memory and return NULL! */
         free(*info);
-        fclose(fp);
+        free(file);
         return (NULL);
     }
 
-    if ((int)fread(bits, 1, bitsize, fp) < bitsize)
+    outlength = rgba ? (*info)->bmiHeader.biWidth * 4 : length;
+    if (!rgba)
+        bits = file;
+    else if ((bits = (GLubyte *)malloc(outlength * rows)) == NULL)
     {
-        /* Couldn't read bitmap - free memory and return NULL! */
+        /* Couldn't allocate memory - return NULL! */
         free(*info);
-        free(bits);
-        fclose(fp);
+        free(file);
         return (NULL);
     }
 
-    /* Swap red and blue */
-    length = ((*info)->bmiHeader.biWidth * 3 + 3) & ~3;
-    for (y = 0; y < (*info)->bmiHeader.biHeight; y ++)
-        for (ptr = bits + y * length, x = (*info)->bmiHeader.biWidth;
-             x > 0;
-             x --, ptr += 3)
+    if ((*info)->bmiHeader.biBitCount != 24 || (long)length * rows > bitsize)
+        memmove(bits, file + header.bfOffBits, bitsize); /* Nothing to swap */
+    else
+    {
+        /* Move the rows down, swapping red and blue, and keeping any padding */
+        kernel = forced_kernel == BITMAP_KERNEL_AUTO ? best_kernel() : forced_kernel;
+        for (y = 0; y < rows; y ++)
         {
-            temp   = ptr[0];
-            ptr[0] = ptr[2];
-            ptr[2] = temp;
+            convert_row(file + header.bfOffBits + y * length, bits + y * outlength,
+                        (*info)->bmiHeader.biWidth, rgba, kernel);
+            if (!rgba)
+                memmove(bits + y * length + (*info)->bmiHeader.biWidth * 3,
+                        file + header.bfOffBits + y * length + (*info)->bmiHeader.biWidth * 3,
+                        length - (*info)->bmiHeader.biWidth * 3);
         }
+        if (!rgba)
+            memmove(bits + rows * length, file + header.bfOffBits + rows * length,
+                    bitsize - rows * length);
+    }
 
     /* OK, everything went fine - return the allocated bitmap... */
-    fclose(fp);
+    if (rgba)
+        free(file);
     return (bits);
 }
 
+
 /*
- * 'read_word()' - Read a 16-bit unsigned integer.
+ * 'LoadDIBitmap()' - Load a DIB/BMP file from disk.
+ *
+ * Returns a pointer to the bitmap if successful, NULL otherwise...
  */
 
-static unsigned short     /* O - 16-bit unsigned integer */
-read_word(FILE *fp)       /* I - File to read from */
+GLubyte *                          /* O - Bitmap data */
+LoadDIBitmap(const char *filename, /* I - File to load */
+             BITMAPINFO **info)    /* O - Bitmap information */
 {
-    unsigned char b0, b1; /* Bytes from file */
+    return (load_bitmap(filename, info, 0));
+}
 
-    b0 = getc(fp);
-    b1 = getc(fp);
 
-    return ((b1 << 8) | b0);
+/*
+ * 'LoadDIBitmapRGBA()' - Load a 24-bit DIB/BMP file from disk as tightly
+ *                        packed RGBA rows, with alpha 255, ready for OpenGL.
+ *
+ * Returns a pointer to the bitmap if successful, NULL otherwise (including
+ * for files that aren't uncompressed 24-bit bitmaps)...
+ */
+
+GLubyte *                              /* O - Bitmap data */
+LoadDIBitmapRGBA(const char *filename, /* I - File to load */
+                 BITMAPINFO **info)    /* O - Bitmap information */
+{
+    return (load_bitmap(filename, info, 1));
 }
 
 
 /*
- * 'read_dword()' - Read a 32-bit unsigned integer.
+ * 'get_word()' - Get a 16-bit unsigned integer.
  */
 
-static unsigned int               /* O - 32-bit unsigned integer */
-read_dword(FILE *fp)              /* I - File to read from */
+static unsigned short     /* O - 16-bit unsigned integer */
+get_word(const GLubyte *p) /* I - Bytes to read */
 {
-    unsigned char b0, b1, b2, b3; /* Bytes from file */
+    return ((p[1] << 8) | p[0]);
+}
+
 
-    b0 = getc(fp);
-    b1 = getc(fp);
-    b2 = getc(fp);
-    b3 = getc(fp);
+/*
+ * 'get_dword()' - Get a 32-bit unsigned integer.
+ */
 
-    return ((((((b3 << 8) | b2) << 8) | b1) << 8) | b0);
+static unsigned int               /* O - 32-bit unsigned integer */
+get_dword(const GLubyte *p)       /* I - Bytes to read */
+{
+    return ((((((unsigned int)p[3] << 8) | p[2]) << 8) | p[1]) << 8) | p[0];
 }
 
 
 /*
- * 'read_long()' - Read a 32-bit signed integer.
+ * 'get_long()' - Get a 32-bit signed integer.
  */
 
 static int                        /* O - 32-bit signed integer */
-read_long(FILE *fp)               /* I - File to read from */
+get_long(const GLubyte *p)        /* I - Bytes to read */
 {
-    unsigned char b0, b1, b2, b3; /* Bytes from file */
-
-    b0 = getc(fp);
-    b1 = getc(fp);
-    b2 = getc(fp);
-    b3 = getc(fp);
-
-    return ((int)(((((b3 << 8) | b2) << 8) | b1) << 8) | b0);
+    return ((int)get_dword(p));
 }
@@ -0,0 +1,100 @@
+#version 140
+#extension GL_ARB_uniform_buffer_object : require
+// Adds one light to each pixel of its volume, from the G-buffer (see
+// deferred.h in src).  The lighting, and the shadows, are the same as in
+// fStart.glsl.
+flat in int light;
+
+uniform mat4 Projection;
+uniform vec2 PixelSize;  // In normalized device coordinates
+
+uniform sampler2D gDepth, gDiffuse, gAmbient, gSpecular, gNormal;
+uniform samplerBuffer lightTexture;
+
+// Only the shadows are used (see fStart.glsl)
+layout(std140) uniform Lights {
+    vec4 ClusterScale;
+    vec4 ClusterSize;
+    mat4 ShadowMatrices[3];
+    vec4 ShadowCubeRange;
+};
+
+const float lightDirectional = 2.0, lightSpot = 3.0;  // See lightType
+
+// The shadow maps, in the order of ShadowMatrices
+uniform samplerCube pointShadowMap;
+uniform sampler2DShadow directionalShadowMap, spotShadowMap;
+
+// How much of a light with the given shadow map reaches pos (in eye
+// coordinates), from 0 in its shadow to 1
+float shadowFactor(int map, vec3 pos)
+{
+    vec4 coord = ShadowMatrices[map] * vec4(pos, 1.0);
+    if (map == 1)
+        return shadow2D(directionalShadowMap, coord.xyz).r;
+    if (map == 2)
+        return shadow2DProj(spotShadowMap, coord).r;
+
+    // The cube map holds the depth in each face's view, so compare the
+    // distance along the face's axis with the nearest one there
+    float n = ShadowCubeRange.x, f = ShadowCubeRange.y;
+    float axisDistance = max(abs(coord.x), max(abs(coord.y), abs(coord.z)));
+    float depth = textureCube(pointShadowMap, coord.xyz).r * 2.0 - 1.0;
+    float nearest = 2.0 * f * n / (f + n - depth * (f - n));
+    return axisDistance <= nearest * 1.02 + 0.005 ? 1.0 : 0.0;
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, pixel, 0).x;
+    if (depth == 1.0)
+        discard;  // Nothing was drawn here
+
+    // Back from the depth to eye coordinates, undoing the projection (a frustum)
+    vec3 ndc = vec3(gl_FragCoord.xy * PixelSize - 1.0, 2.0 * depth - 1.0);
+    vec3 pos;
+    pos.z = -Projection[3][2] / (ndc.z + Projection[2][2]);
+    pos.x = -pos.z * (ndc.x + Projection[2][0]) / Projection[0][0];
+    pos.y = -pos.z * (ndc.y + Projection[2][1]) / Projection[1][1];
+
+    vec3 E = normalize(-pos);
+    vec3 N = texelFetch(gNormal, pixel, 0).xyz;
+    vec4 specularShine = texelFetch(gSpecular, pixel, 0);
+
+    vec4 lightPosition = texelFetch(lightTexture, light);
+    vec4 lightColor = texelFetch(lightTexture, light + 1);
+
+    // The vector to the light from the fragment
+    vec3 Lvec = lightPosition.xyz;
+    float reduction = 1.0;
+    if (lightPosition.w != lightDirectional) {
+        Lvec -= pos;
+        // Distance light reduction, which is cut off at the light's range
+        float d = length(Lvec);
+        if (d > lightColor.w)
+            discard;
+        reduction = 1.0 / (1.0 + (0.1 * d) + (0.1 * d * d));
+    }
+    vec3 L = normalize(Lvec);
+
+    if (lightPosition.w == lightSpot) {
+        vec4 spot = texelFetch(lightTexture, light + 2);
+        if (dot(L, spot.xyz) < spot.w)
+            discard;
+    }
+
+    vec3 H = normalize(L + E);
+    float Kd = max(dot(L, N), 0.0);
+    float Ks = dot(L, N) < 0.0 ? 0.0 : pow(max(dot(N, H), 0.0), specularShine.w);
+
+    float lit = 1.0;  // Out of shadow
+    int map = int(texelFetch(lightTexture, light + 3).x);
+    if (map >= 0)
+        lit = shadowFactor(map, pos);
+
+    // Ambient, diffuse and specular, already multiplied by the texture except for specular
+    vec3 color = texelFetch(gAmbient, pixel, 0).rgb + lit * (Kd * texelFetch(gDiffuse, pixel, 0).rgb
+                 + Ks * specularShine.rgb);
+    gl_FragColor = vec4(color * lightColor.rgb * reduction, 0.0);
+}
@@ -0,0 +1,6 @@
+#version 140
+// Nothing but the depth is written (see shadows.h in src).
+
+void main()
+{
+}
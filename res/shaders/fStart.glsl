@@ -1,112 +1,172 @@
+#version 140
+#extension GL_ARB_uniform_buffer_object : require
+#extension GL_EXT_texture_array : enable
+// Built with some of GBUFFER, TEXTURE_ARRAY, SPOT_LIGHTS, UNTEXTURED and
+// SHADOWS defined, leaving out what a draw doesn't need (see shadervariants.h in src)
+
 varying vec2 texCoord;  // The third coordinate is always 0.0 and is discarded
-varying vec3 normal;
-varying vec4 position;
+varying vec3 normal;    // In eye coordinates
+varying vec4 position;  // Likewise
 
 varying vec4 vPosition;
-uniform vec3 AmbientProduct, DiffuseProduct, SpecularProduct;
-uniform mat4 ModelView;
-uniform float Shininess;
-
-// Everything lights needed
-uniform vec4 LightPosition1, LightPosition2, LightPosition3;
-uniform vec3 LightColor1, LightColor2, LightColor3;
-uniform float LightBrightness1, LightBrightness2, LightBrightness3;
-uniform vec4 LightDirection;
+// The material, per instance (see vStart.glsl)
+varying vec3 ambientProduct, diffuseProduct, specularProduct;
+varying float shininess;
+
+// How to find a fragment's cluster of lights, and its place in the shadow
+// maps, set once per frame (see lightsBlock in shaderprogram.h, and
+// lightclusters.h and shadows.h in src)
+layout(std140) uniform Lights {
+    vec4 ClusterScale; // Tiles per pixel across and up, then the slice scale and bias
+    vec4 ClusterSize;  // Tiles across and up, and slices
+    mat4 ShadowMatrices[3]; // From eye coordinates to each shadow map's
+    vec4 ShadowCubeRange;   // The near and far planes of the point light's cube map
+};
+
+// Four texels per light: its position (or direction, if w is directional)
+// and type, its colour and range, its spotlight direction and cutoff, and
+// the shadow map it casts in x, or -1
+uniform samplerBuffer lightTexture;
+uniform usamplerBuffer clusterTexture;    // Where each cluster's lights start in lightIndexTexture, and how many
+uniform usamplerBuffer lightIndexTexture;
+
+const float lightDirectional = 2.0, lightSpot = 3.0; // See lightType
+
+#ifdef SHADOWS
+// The shadow maps, in the order of ShadowMatrices
+uniform samplerCube pointShadowMap;
+uniform sampler2DShadow directionalShadowMap, spotShadowMap;
+
+// How much of a light with the given shadow map reaches pos (in eye
+// coordinates), from 0 in its shadow to 1
+float shadowFactor(int map, vec3 pos)
+{
+    vec4 coord = ShadowMatrices[map] * vec4(pos, 1.0);
+    if (map == 1)
+        return shadow2D(directionalShadowMap, coord.xyz).r;
+    if (map == 2)
+        return shadow2DProj(spotShadowMap, coord).r;
+
+    // The cube map holds the depth in each face's view, so compare the
+    // distance along the face's axis with the nearest one there
+    float n = ShadowCubeRange.x, f = ShadowCubeRange.y;
+    float axisDistance = max(abs(coord.x), max(abs(coord.y), abs(coord.z)));
+    float depth = textureCube(pointShadowMap, coord.xyz).r * 2.0 - 1.0;
+    float nearest = 2.0 * f * n / (f + n - depth * (f - n));
+    return axisDistance <= nearest * 1.02 + 0.005 ? 1.0 : 0.0;
+}
+#endif
 
 // Textures
-uniform float texScale;
+varying float texScale;
 uniform sampler2D texture;
 
-void main()
-{
-
-    vec3 pos = (ModelView * position).xyz;
+// With --texture-array most textures are a layer of textureArray, or a tile
+// in one (see texturearray.h in src)
+uniform sampler2DArray textureArray;
+uniform float textureArraySize; // The width and height of each layer
+varying vec2 texLayer; // The layer, or -1 to use texture, and the first level loaded
+varying vec3 texTile;  // The tile's corner and size as fractions of the layer, size 1 for a whole layer
 
-    // The vector to the light from the vertex
-    vec3 Lvec = LightPosition1.xyz - pos;
-    vec3 Lvec2 = LightPosition2.xyz;
-    vec3 Lvec3 = LightPosition3.xyz - pos;
+vec4 textureColor(vec2 uv)
+{
+#if defined(UNTEXTURED)
+    return vec4(1.0);  // Only used for the placeholder texture, which is plain white
+#elif !defined(TEXTURE_ARRAY)
+    return texture2D(texture, uv);
+#else
+    if (texLayer.x < 0.0)
+        return texture2D(texture, uv);
+    bool wholeLayer = texTile.z > 0.99;
+    if (wholeLayer && texLayer.y < 0.5)
+        return texture2DArray(textureArray, vec3(uv, texLayer.x));
+
+    // Choose the level from the unwrapped coordinates, out of those the tile has
+    // and that have loaded
+    float tileTexels = texTile.z * textureArraySize;
+    vec2 dx = dFdx(uv) * tileTexels, dy = dFdy(uv) * tileTexels;
+    float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-12));
+    lod = clamp(lod, texLayer.y, log2(tileTexels));
+
+    vec2 st = uv;
+    if (!wholeLayer) {
+        // Wrap by hand, half a texel inside the tile so filtering stays off its neighbours
+        float inset = 0.5 * exp2(ceil(lod)) / textureArraySize;
+        st = texTile.xy + clamp(fract(uv) * texTile.z, inset, texTile.z - inset);
+    }
 
-    //normalize
-    vec3 L = normalize(Lvec);
-    vec3 L2 = normalize(Lvec2);
-    vec3 L3 = normalize(Lvec3);
+    // The hardware's choice of level jumps where the tile wraps, so bias it to ours
+    vec2 sx = dFdx(st) * textureArraySize, sy = dFdy(st) * textureArraySize;
+    float hardwareLod = 0.5 * log2(max(max(dot(sx, sx), dot(sy, sy)), 1e-12));
+    return texture2DArray(textureArray, vec3(st, texLayer.x), lod - hardwareLod);
+#endif
+}
 
+void main()
+{
+#ifdef GBUFFER
+    // What the lights need, for them to be added later (see deferred.h in src)
+    vec4 tex = textureColor(texCoord * texScale);
+    gl_FragData[0] = vec4(0.1 * tex.rgb, tex.a);  // The global ambient, as below
+    gl_FragData[1] = vec4(tex.rgb * diffuseProduct, 0.0);
+    gl_FragData[2] = vec4(tex.rgb * ambientProduct, 0.0);
+    gl_FragData[3] = vec4(specularProduct, shininess);
+    gl_FragData[4] = vec4(normalize(normal), 0.0);
+#else
+    vec3 pos = position.xyz;
     vec3 E = normalize(-pos);
+    vec3 N = normalize(normal);
 
-    vec3 H = normalize(L + E);
-    vec3 H2 = normalize(L2 + E);
-    vec3 H3 = normalize(L3 + E);
-
-    // Ambient Calculation
-    vec3 ambient = AmbientProduct * (LightColor1 * LightBrightness1);
-    vec3 ambient2 = AmbientProduct * (LightColor2 * LightBrightness2);
-    vec3 ambient3 = AmbientProduct * (LightColor3 * LightBrightness3);
-
-    vec3 N = normalize((ModelView * vec4(normal, 0.0)).xyz);
-
-    // Diffuse Calculation
-    float Kd = max(dot(L, N), 0.0);
-    float Kd2 = max(dot(L2, N), 0.0);
-    float Kd3 = max(dot(L3, N), 0.0);
-    vec3 diffuse = Kd * DiffuseProduct * (LightColor1 * LightBrightness1);
-    vec3 diffuse2 = Kd2 * DiffuseProduct * (LightColor2 * LightBrightness2);
-    vec3 diffuse3 = Kd3 * DiffuseProduct * (LightColor3 * LightBrightness3);
-
-    // Specular Calculation
-    float Ks = pow(max(dot(N, H), 0.0), Shininess);
-    float Ks2 = pow(max(dot(N, H2), 0.0), Shininess);
-    float Ks3 = pow(max(dot(N, H3), 0.0), Shininess);
-    vec3 specular = Ks * (SpecularProduct) * (LightColor1 * LightBrightness1);
-    vec3 specular2 = Ks2 * (SpecularProduct) * (LightColor2 * LightBrightness2);
-    vec3 specular3 = Ks3 * (SpecularProduct) * (LightColor3 * LightBrightness3);
-    if(dot(L, N) < 0.0)
-    {
-        specular = vec3(0.0, 0.0, 0.0);
-    }
-    if(dot(L2, N) < 0.0)
-    {
-        specular2 = vec3(0.0, 0.0, 0.0);
-    }
-    if(dot(L3, N) < 0.0)
-    {
-        specular3 = vec3(0.0, 0.0, 0.0);
-    }
+    // The cluster this fragment is in
+    ivec3 cell = ivec3(floor(vec3(gl_FragCoord.xy * ClusterScale.xy, log(-pos.z) * ClusterScale.z - ClusterScale.w)));
+    cell = clamp(cell, ivec3(0), ivec3(ClusterSize.xyz) - 1);
+    int cluster = (cell.z * int(ClusterSize.y) + cell.y) * int(ClusterSize.x) + cell.x;
+    uvec2 lights = texelFetch(clusterTexture, cluster).xy;
 
     // globalAmbient is independent of distance from the light source
-    vec3 globalAmbient = vec3(0.1, 0.1, 0.1);
-
-    // Distance light reduction for light 1
-    float d = length(Lvec);
-    float b = 0.1;
-    float c = 0.1;
-    float reduction = 1.0 / (1.0 + (b * d) + (c * d * d));
-
-    // Colour for FragColor
-    vec4 color;
-    color.rgb = globalAmbient + (( diffuse +  ambient) * reduction) + diffuse2 + ambient2;
-	color.a = 1.0;
-
-
-    vec3 dL = normalize(LightDirection.xyz);
-    vec4 color3;
-    if(dot(L3, dL) < 0.5)
-    {
-        ambient3 = vec3(0.0, 0.0, 0.0);
-        diffuse3 = vec3(0.0, 0.0, 0.0);
-        specular3 = vec3(0.0, 0.0, 0.0);
+    vec3 color = vec3(0.1, 0.1, 0.1);
+    vec3 specular = vec3(0.0);
+
+    for (uint i = 0u; i < lights.y; i++) {
+        int light = 4 * int(texelFetch(lightIndexTexture, int(lights.x + i)).x);
+        vec4 lightPosition = texelFetch(lightTexture, light);
+        vec4 lightColor = texelFetch(lightTexture, light + 1);
+
+        // The vector to the light from the fragment
+        vec3 Lvec = lightPosition.xyz;
+        float reduction = 1.0;
+        if (lightPosition.w != lightDirectional) {
+            Lvec -= pos;
+            // Distance light reduction, which is cut off at the light's range
+            float d = length(Lvec);
+            if (d > lightColor.w) continue;
+            reduction = 1.0 / (1.0 + (0.1 * d) + (0.1 * d * d));
+        }
+        vec3 L = normalize(Lvec);
+
+#ifdef SPOT_LIGHTS
+        if (lightPosition.w == lightSpot) {
+            vec4 spot = texelFetch(lightTexture, light + 2);
+            if (dot(L, spot.xyz) < spot.w) continue;
+        }
+#endif
+
+        vec3 H = normalize(L + E);
+        float Kd = max(dot(L, N), 0.0);
+        float Ks = dot(L, N) < 0.0 ? 0.0 : pow(max(dot(N, H), 0.0), shininess);
+
+        float lit = 1.0; // Out of shadow
+#ifdef SHADOWS
+        int map = int(texelFetch(lightTexture, light + 3).x);
+        if (map >= 0)
+            lit = shadowFactor(map, pos);
+#endif
+
+        // Ambient, diffuse and specular
+        color += (ambientProduct + lit * Kd * diffuseProduct) * lightColor.rgb * reduction;
+        specular += lit * Ks * specularProduct * lightColor.rgb * reduction;
     }
 
-    // Distance light reduction for light 3
-    float d3 = length(Lvec3);
-    float b3 = 0.1;
-    float c3 = 0.1;
-    float reduction3 = 1.0 / (1.0 + (b3 * d3) + (c3 * d3 * d3));
-    color3.rgb = (diffuse3 + ambient3) * reduction3;
-	color3.a = 1.0;
-
-    color = color + color3;
-
     /*Part H
     * https://stackoverflow.com/questions/35917678/opengl-lighting-specular-higlight-is-colored
     */
@@ -114,6 +174,6 @@ void main()
     /*
     * Part B for changing texture scale
     */
-    gl_FragColor = color * texture2D( texture, texCoord * texScale) + vec4((specular * reduction), 0.0)
-                  + vec4(specular2, 0.0) + vec4((specular3 * reduction3), 0.0);
+    gl_FragColor = vec4(color, 1.0) * textureColor(texCoord * texScale) + vec4(specular, 0.0);
+#endif
 }
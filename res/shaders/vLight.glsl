@@ -0,0 +1,28 @@
+#version 140
+// Light volumes for deferred shading (see deferred.h in src), one instance
+// per light.
+attribute vec3 vPosition;  // A corner of a cube from -1 to 1
+
+uniform mat4 Projection;
+uniform int FirstLight;  // In lightOrder, of this draw's first instance
+
+uniform samplerBuffer lightTexture;  // See fStart.glsl
+uniform usamplerBuffer lightOrder;
+
+flat out int light;  // Its first texel in lightTexture
+
+const float lightDirectional = 2.0;  // See lightType
+
+void main()
+{
+    light = 4 * int(texelFetch(lightOrder, FirstLight + gl_InstanceID).x);
+    vec4 lightPosition = texelFetch(lightTexture, light);
+
+    // Directional lights cover the screen, with the cube's z = 1 face
+    if (lightPosition.w == lightDirectional) {
+        gl_Position = vec4(vPosition.xy, 0.0, 1.0);
+    } else {
+        float range = texelFetch(lightTexture, light + 1).w;
+        gl_Position = Projection * vec4(lightPosition.xyz + range * vPosition, 1.0);
+    }
+}
@@ -0,0 +1,10 @@
+#version 140
+// Depth only, for the shadow maps (see shadows.h in src).
+attribute vec3 vPosition;
+
+uniform mat4 ModelViewProjection;  // From the mesh's stored positions to the light's view
+
+void main()
+{
+    gl_Position = ModelViewProjection * vec4(vPosition, 1.0);
+}
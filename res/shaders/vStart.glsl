@@ -1,19 +1,47 @@
+#version 140
 attribute vec3 vPosition;
-attribute vec3 vNormal;
+attribute vec2 vNormal;  // Octahedral encoded - see vertexformat.h
 attribute vec2 vTexCoord;
 
+// Per-instance attributes (see drawBatches in scene-start.cpp)
+attribute mat4 iModelView;
+attribute vec3 iAmbientProduct, iDiffuseProduct, iSpecularProduct;
+attribute vec2 iShineTexScale;
+attribute vec2 iTexLayer;  // See fStart.glsl
+attribute vec3 iTexTile;
+
 varying vec2 texCoord;
-varying vec4 position;
-varying vec3 normal;
+varying vec4 position;  // In eye coordinates
+varying vec3 normal;    // Likewise
+varying vec3 ambientProduct, diffuseProduct, specularProduct;
+varying float shininess, texScale;
+varying vec2 texLayer;
+varying vec3 texTile;
 
-uniform mat4 ModelView;
 uniform mat4 Projection;
 
+vec3 octDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * sign(n.xy);
+    return normalize(n);
+}
+
 void main()
 {
-    position = vec4(vPosition, 1.0);
+    position = iModelView * vec4(vPosition, 1.0);
 
-    normal = vNormal;
+    normal = (iModelView * vec4(octDecode(vNormal), 0.0)).xyz;
     texCoord = vTexCoord;
-    gl_Position = Projection * ModelView * vec4(vPosition, 1.0);
+
+    ambientProduct = iAmbientProduct;
+    diffuseProduct = iDiffuseProduct;
+    specularProduct = iSpecularProduct;
+    shininess = iShineTexScale.x;
+    texScale = iShineTexScale.y;
+    texLayer = iTexLayer;
+    texTile = iTexTile;
+
+    gl_Position = Projection * position;
 }
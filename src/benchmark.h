@@ -0,0 +1,143 @@
+// Headless benchmark (benchmark.h)
+//
+// The window, and the random starting scene, make runs hard to compare and
+// impossible on a machine without a display.  --bench instead draws into an
+// offscreen framebuffer, with a GL context from EGL rather than GLUT (Mesa's
+// surfaceless platform if it's there, so no display server or GPU is needed
+// and llvmpipe will do, else a pbuffer on the default display).  The scene
+// comes from a fixed seed, and once everything in it has loaded the camera
+// flies the same path for a fixed number of frames, each finished with
+// glFinish so that its time includes the GPU's.  The flight is timed once
+// with each pipeline, forward then deferred (see deferred.h), and the frame
+// time statistics of both are printed as JSON (see runBenchmark).
+//
+// EGL is only used if the build found it (HAVE_EGL, see CMakeLists.txt).
+
+#ifdef HAVE_EGL
+#define EGL_NO_X11               // Keep X11's macros out of the way
+#define MESA_EGL_NO_X11_HEADERS  // Likewise, for older Mesa headers
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+bool benchmarking = false;  // Set by --bench
+int benchObjects = 100;     // Set with --bench-objects, as well as the ground and lights
+int benchLights = 0;        // Set with --bench-lights, as well as the usual three
+int benchFrames = 300;      // Set with --bench-frames
+unsigned benchSeed = 1;     // Set with --bench-seed
+
+#ifdef HAVE_EGL
+static EGLDisplay openEglDisplay(bool *surfaceless) {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    EGLint major, minor;
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    if (getPlatformDisplay != NULL && extensions != NULL && strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+        EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        if (display != EGL_NO_DISPLAY && eglInitialize(display, &major, &minor)) {
+            *surfaceless = true;
+            return display;
+        }
+    }
+#endif
+    EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) return EGL_NO_DISPLAY;
+    *surfaceless = false;
+    return display;
+}
+#endif
+
+// Make a GL context current, with a width x height framebuffer bound to draw
+// into, without opening a window.  Returns false if that isn't possible.
+bool makeOffscreenContext(int width, int height) {
+#ifndef HAVE_EGL
+    return false;
+#else
+    bool surfaceless;
+    EGLDisplay display = openEglDisplay(&surfaceless);
+    if (display == EGL_NO_DISPLAY || !eglBindAPI(EGL_OPENGL_API)) return false;
+
+    const EGLint configAttribs[] = {EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+                                    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+    EGLConfig config = NULL;
+    EGLint nConfigs = 0;
+    if (!eglChooseConfig(display, configAttribs, &config, 1, &nConfigs) || nConfigs == 0) {
+        if (!surfaceless) return false;
+        config = NULL; // The surfaceless platform doesn't need one (EGL_KHR_no_config_context)
+    }
+
+    // The same as the window asks GLUT for
+    const EGLint contextAttribs[] = {EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 2,
+                                     EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (context == EGL_NO_CONTEXT) return false;
+
+    EGLSurface surface = EGL_NO_SURFACE;
+    if (!surfaceless) { // Never drawn to, but some drivers need a surface to make a context current
+        const EGLint surfaceAttribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+        surface = eglCreatePbufferSurface(display, config, surfaceAttribs);
+    }
+    if (!eglMakeCurrent(display, surface, surface, context)) return false;
+
+#ifndef __APPLE__
+    glewInit(); // Only the GL functions matter here, so a missing GLX display is fine
+#endif
+
+    GLuint framebuffer, renderbuffers[2];
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glGenRenderbuffers(2, renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+    return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+#endif
+}
+
+// The results of timing one pipeline.
+typedef struct {
+    const char *pipeline;
+    std::vector<double> frameMs;
+    int nTriangles, nDraws, nCulled, nHidden; // In the last frame
+} benchmarkRun;
+
+// The given percentile (nearest rank) of some sorted frame times.
+static double sortedPercentile(const std::vector<double> &sorted, double percent) {
+    int rank = (int) ceil(percent / 100.0 * sorted.size());
+    return sorted[std::max(rank, 1) - 1];
+}
+
+// Print the benchmark's results, as one JSON object with each run's under
+// "pipelines".
+void printBenchmarkJson(const std::vector<benchmarkRun> &runs, double loadMs, int nObjects, int nLights) {
+    printf("{\n");
+    printf("  \"renderer\": \"%s\",\n", (const char *) glGetString(GL_RENDERER));
+    printf("  \"version\": \"%s\",\n", (const char *) glGetString(GL_VERSION));
+    printf("  \"width\": %d, \"height\": %d,\n", windowWidth, windowHeight);
+    printf("  \"seed\": %u, \"objects\": %d, \"lights\": %d, \"frames\": %d,\n", benchSeed, nObjects, nLights,
+           benchFrames);
+    printf("  \"load_ms\": %.1f,\n", loadMs);
+    printf("  \"pipelines\": {\n");
+    for (size_t i = 0; i < runs.size(); i++) {
+        std::vector<double> frameMs = runs[i].frameMs;
+        std::sort(frameMs.begin(), frameMs.end());
+        double totalMs = 0.0;
+        for (size_t j = 0; j < frameMs.size(); j++) totalMs += frameMs[j];
+        double meanMs = totalMs / frameMs.size();
+
+        printf("    \"%s\": {\n", runs[i].pipeline);
+        printf("      \"frame_ms\": {\"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, "
+               "\"max\": %.3f},\n", meanMs, frameMs.front(), sortedPercentile(frameMs, 50),
+               sortedPercentile(frameMs, 95), sortedPercentile(frameMs, 99), frameMs.back());
+        printf("      \"frames_per_second\": %.2f,\n", 1000.0 / meanMs);
+        printf("      \"last_frame\": {\"triangles\": %d, \"draws\": %d, \"culled\": %d, \"hidden\": %d}\n",
+               runs[i].nTriangles, runs[i].nDraws, runs[i].nCulled, runs[i].nHidden);
+        printf("    }%s\n", i + 1 < runs.size() ? "," : "");
+    }
+    printf("  }\n");
+    printf("}\n");
+}
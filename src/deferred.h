@@ -0,0 +1,238 @@
+// Deferred shading (deferred.h)
+//
+// With --deferred, objects aren't lit as they're drawn.  Instead the scene
+// shaders are built with GBUFFER defined (see fStart.glsl), and write what
+// lighting needs for each pixel into a G-buffer: several floating point
+// targets and a depth texture.  Then each light is drawn as a volume covering
+// the pixels it can reach, and the lighting shaders (vLight.glsl and
+// fLight.glsl) add its light to gBufferLit from the G-buffer, so each light
+// costs only the pixels it covers however many objects there are.  Finally
+// gBufferLit is copied to screenFramebuffer.
+//
+// The targets, all RGBA16F since the material terms can go over 1:
+//   - gBufferLit: the global ambient (0.1 x the texture), which the lights
+//     are added to, and the texture's alpha.
+//   - gBufferDiffuse and gBufferAmbient: the texture x the object's diffuse
+//     and ambient products (i.e., x its rgb and brightness, see drawMesh).
+//   - gBufferSpecular: the specular product, and the shininess in w.
+//   - gBufferNormal: the normal, in eye coordinates.
+// Positions are worked back out of the depth and the projection.
+//
+// A point or spot light's volume is a cube around its range (see lightRange),
+// drawn by its back faces, with depth clamping, so it still covers its pixels
+// when the camera is inside it or its far side is past the far plane.  The
+// depth test is off rather than testing against the G-buffer's depth, since
+// that depth is also being read.  Directional lights reach everything, so
+// they're drawn as the whole screen.  Each sort of volume is one instanced
+// draw, with the lights in the order given by lightOrderTexture.
+
+bool useDeferred = false; // Set by --deferred
+
+enum { gBufferLit, gBufferDiffuse, gBufferAmbient, gBufferSpecular, gBufferNormal, numGBufferTargets };
+
+// The lighting shaders read the G-buffer on the units from here, one per
+// target but with the depth in place of gBufferLit, and the light order on the
+// unit after them (units up to 4 are the object textures and the lights).
+const GLenum gBufferTextureUnit = GL_TEXTURE5;
+const GLenum lightOrderTextureUnit = gBufferTextureUnit + numGBufferTargets;
+
+typedef struct {
+    GLuint framebuffer;         // All the targets and the depth, for drawing the objects
+    GLuint lightingFramebuffer; // Just gBufferLit, for the lights to add to
+    GLuint targets[numGBufferTargets];
+    GLuint depth;
+    int width, height;          // 0 until made
+} gBufferInfo;
+
+typedef struct {
+    GLuint id;
+    GLint projection, pixelSize, firstLight;
+} lightingShader;
+
+lightingShader lightShader;
+gBufferInfo gBuffer;
+GLuint screenFramebuffer; // Where frames end up: the window's, or --bench's offscreen one
+
+GLuint lightVolumeVao, lightVolumeBuffer;
+GLuint lightOrderBuffer, lightOrderTexture;
+std::vector<GLuint> lightOrder;    // Directional lights, then the others that can be seen
+GLsizei numDirectionalVolumes = 0; // At the start of lightOrder
+GLsizei numLocalVolumes = 0;       // After them
+
+// A cube from -1 to 1, wound anticlockwise from outside.  Its first face,
+// z = 1, doubles as a quad over the whole screen.
+const GLfloat lightVolumeCube[36][3] = {
+    {-1, -1, 1}, {1, -1, 1}, {1, 1, 1}, {-1, -1, 1}, {1, 1, 1}, {-1, 1, 1},
+    {-1, -1, -1}, {-1, 1, -1}, {1, 1, -1}, {-1, -1, -1}, {1, 1, -1}, {1, -1, -1},
+    {1, -1, -1}, {1, 1, -1}, {1, 1, 1}, {1, -1, -1}, {1, 1, 1}, {1, -1, 1},
+    {-1, -1, -1}, {-1, -1, 1}, {-1, 1, 1}, {-1, -1, -1}, {-1, 1, 1}, {-1, 1, -1},
+    {-1, 1, -1}, {-1, 1, 1}, {1, 1, 1}, {-1, 1, -1}, {1, 1, 1}, {1, 1, -1},
+    {-1, -1, -1}, {1, -1, -1}, {1, -1, 1}, {-1, -1, -1}, {1, -1, 1}, {-1, -1, 1}};
+
+static void bindLightingAttributes(GLuint program) {
+    glBindAttribLocation(program, 0, "vPosition");
+}
+
+// Build the lighting shaders and the light volumes.  Called from init, with
+// the framebuffer frames should end up in bound.
+void makeDeferred() {
+    GLint framebuffer;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+    screenFramebuffer = framebuffer;
+
+    lightShader.id = buildProgram("res/shaders/vLight.glsl", "res/shaders/fLight.glsl", NULL,
+                                  bindLightingAttributes);
+    lightShader.projection = glGetUniformLocation(lightShader.id, "Projection");
+    lightShader.pixelSize = glGetUniformLocation(lightShader.id, "PixelSize");
+    lightShader.firstLight = glGetUniformLocation(lightShader.id, "FirstLight");
+    glUseProgram(lightShader.id);
+    const char *samplers[numGBufferTargets] = {"gDepth", "gDiffuse", "gAmbient", "gSpecular", "gNormal"};
+    for (int target = 0; target < numGBufferTargets; target++)
+        glUniform1i(glGetUniformLocation(lightShader.id, samplers[target]), gBufferTextureUnit - GL_TEXTURE0 + target);
+    glUniform1i(glGetUniformLocation(lightShader.id, "lightTexture"), lightTextureUnit - GL_TEXTURE0);
+    glUniform1i(glGetUniformLocation(lightShader.id, "lightOrder"), lightOrderTextureUnit - GL_TEXTURE0);
+
+    glActiveTexture(lightOrderTextureUnit);
+    lightOrderTexture = makeBufferTexture(&lightOrderBuffer, GL_R32UI);
+    glActiveTexture(GL_TEXTURE0);
+
+#ifdef __APPLE__
+    glGenVertexArraysAPPLE(1, &lightVolumeVao);
+    glBindVertexArrayAPPLE(lightVolumeVao);
+#else
+    glGenVertexArrays(1, &lightVolumeVao);
+    glBindVertexArray(lightVolumeVao);
+#endif
+    glGenBuffers(1, &lightVolumeBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, lightVolumeBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(lightVolumeCube), lightVolumeCube, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+    glEnableVertexAttribArray(0);
+    CheckError();
+}
+
+static GLuint makeGBufferTexture(GLenum internalFormat, GLenum format, GLenum type, int width, int height) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    return texture;
+}
+
+// (Re)make the G-buffer at the given size, and bind what the lighting shaders
+// read to their units.
+static void makeGBuffer(int width, int height) {
+    if (gBuffer.width > 0) {
+        glDeleteFramebuffers(1, &gBuffer.framebuffer);
+        glDeleteFramebuffers(1, &gBuffer.lightingFramebuffer);
+        glDeleteTextures(numGBufferTargets, gBuffer.targets);
+        glDeleteTextures(1, &gBuffer.depth);
+    }
+    gBuffer.width = width;
+    gBuffer.height = height;
+
+    GLenum drawBuffers[numGBufferTargets];
+    glActiveTexture(gBufferTextureUnit);
+    glGenFramebuffers(1, &gBuffer.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, gBuffer.framebuffer);
+    for (int target = 0; target < numGBufferTargets; target++) {
+        gBuffer.targets[target] = makeGBufferTexture(GL_RGBA16F, GL_RGBA, GL_FLOAT, width, height);
+        drawBuffers[target] = GL_COLOR_ATTACHMENT0 + target;
+        glFramebufferTexture2D(GL_FRAMEBUFFER, drawBuffers[target], GL_TEXTURE_2D, gBuffer.targets[target], 0);
+    }
+    gBuffer.depth = makeGBufferTexture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, width, height);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, gBuffer.depth, 0);
+    glDrawBuffers(numGBufferTargets, drawBuffers);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        printf("Error - the G-buffer isn't complete, so --deferred isn't supported here\n");
+        exit(1);
+    }
+
+    glGenFramebuffers(1, &gBuffer.lightingFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, gBuffer.lightingFramebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gBuffer.targets[gBufferLit], 0);
+
+    // gBufferLit is only written to, so the depth goes on its unit
+    for (int target = 0; target < numGBufferTargets; target++) {
+        glActiveTexture(gBufferTextureUnit + target);
+        glBindTexture(GL_TEXTURE_2D, target == gBufferLit ? gBuffer.depth : gBuffer.targets[target]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    CheckError();
+}
+
+// Draw the objects into the G-buffer from here on, until shadeGBuffer.
+void beginGBufferPass(int width, int height) {
+    if (gBuffer.width != width || gBuffer.height != height) makeGBuffer(width, height);
+    glBindFramebuffer(GL_FRAMEBUFFER, gBuffer.framebuffer);
+}
+
+// Put frameLights in the order they're drawn, leaving out those that can't be
+// seen, and upload it.  frameLights must already be uploaded (see
+// uploadLights).
+void orderLightVolumes(const mat4 &projection) {
+    setClusterDepthRange(projection); // Used by lightClusterBounds
+    lightOrder.clear();
+    for (size_t i = 0; i < frameLights.size(); i++)
+        if (frameLights[i].position[3] == lightDirectional) lightOrder.push_back(i);
+    numDirectionalVolumes = lightOrder.size();
+    for (size_t i = 0; i < frameLights.size(); i++) {
+        int lo[3], hi[3];
+        if (frameLights[i].position[3] != lightDirectional && lightClusterBounds(frameLights[i], projection, lo, hi))
+            lightOrder.push_back(i);
+    }
+    numLocalVolumes = lightOrder.size() - numDirectionalVolumes;
+
+    glBindBuffer(GL_TEXTURE_BUFFER, lightOrderBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(GLuint) * std::max(lightOrder.size(), (size_t) 1),
+                 lightOrder.empty() ? NULL : lightOrder.data(), GL_STREAM_DRAW);
+    CheckError();
+}
+
+// Add each light in lightOrder to gBufferLit, then copy it to
+// screenFramebuffer.  Leaves the state as the objects expect it, and returns
+// the number of draws.
+int shadeGBuffer(const mat4 &projection) {
+    glBindFramebuffer(GL_FRAMEBUFFER, gBuffer.lightingFramebuffer);
+    glUseProgram(lightShader.id);
+    glUniformMatrix4fv(lightShader.projection, 1, GL_TRUE, projection);
+    glUniform2f(lightShader.pixelSize, 2.0 / gBuffer.width, 2.0 / gBuffer.height);
+#ifdef __APPLE__
+    glBindVertexArrayAPPLE(lightVolumeVao);
+#else
+    glBindVertexArray(lightVolumeVao);
+#endif
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+
+    int nDraws = 0;
+    if (numDirectionalVolumes > 0) {
+        glUniform1i(lightShader.firstLight, 0);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 6, numDirectionalVolumes);
+        nDraws++;
+    }
+    if (numLocalVolumes > 0) {
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_FRONT);
+        glEnable(GL_DEPTH_CLAMP);
+        glUniform1i(lightShader.firstLight, numDirectionalVolumes);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 36, numLocalVolumes);
+        nDraws++;
+        glDisable(GL_DEPTH_CLAMP);
+        glDisable(GL_CULL_FACE);
+    }
+
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, gBuffer.lightingFramebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, screenFramebuffer);
+    glBlitFramebuffer(0, 0, gBuffer.width, gBuffer.height, 0, 0, gBuffer.width, gBuffer.height,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+    CheckError();
+    return nDraws;
+}
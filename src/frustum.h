@@ -0,0 +1,93 @@
+// View frustum culling (frustum.h)
+//
+// The six planes of the view frustum are pulled straight out of the
+// projection * view matrix (Gribb and Hartmann's method), so they are in world
+// coordinates.  Objects are first tested as bounding spheres, four at a time
+// with SSE where it's available, then any sphere that straddles a plane gets a
+// second, tighter test with its transformed bounding box.
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define FRUSTUM_SSE
+#endif
+
+// Each plane is (a, b, c, d) with a*x + b*y + c*z + d >= 0 on the inside, and
+// (a, b, c) of unit length so that the left hand side is a distance.
+typedef struct {
+    vec4 planes[6];
+} frustum;
+
+enum cullResult { cullOutside = 0, cullIntersecting = 1, cullInside = 2 };
+
+frustum frustumFromMatrix(const mat4 &m) {
+    frustum f;
+    for (int i = 0; i < 3; i++) {
+        f.planes[i * 2] = m[3] + m[i];     // Left, bottom, near
+        f.planes[i * 2 + 1] = m[3] - m[i]; // Right, top, far
+    }
+    for (int i = 0; i < 6; i++)
+        f.planes[i] /= length(vec3(f.planes[i].x, f.planes[i].y, f.planes[i].z));
+    return f;
+}
+
+// Test n spheres, given as separate arrays of centre coordinates and radii,
+// writing a cullResult for each.  The arrays must have room for n rounded up
+// to a multiple of 4 (the extra entries are read but their results discarded).
+void cullSpheres(const frustum &f, const float *x, const float *y, const float *z,
+                 const float *r, int n, GLubyte *results) {
+    int i = 0;
+#ifdef FRUSTUM_SSE
+    for (; i < n; i += 4) {
+        __m128 cx = _mm_loadu_ps(x + i), cy = _mm_loadu_ps(y + i), cz = _mm_loadu_ps(z + i);
+        __m128 radius = _mm_loadu_ps(r + i);
+        __m128 negRadius = _mm_sub_ps(_mm_setzero_ps(), radius);
+        __m128 outside = _mm_setzero_ps(), intersecting = _mm_setzero_ps();
+        for (int p = 0; p < 6; p++) {
+            const vec4 &plane = f.planes[p];
+            __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(plane.x)),
+                                                _mm_mul_ps(cy, _mm_set1_ps(plane.y))),
+                                     _mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(plane.z)),
+                                                _mm_set1_ps(plane.w)));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, negRadius));
+            intersecting = _mm_or_ps(intersecting, _mm_cmplt_ps(dist, radius));
+        }
+        int outsideBits = _mm_movemask_ps(outside), intersectingBits = _mm_movemask_ps(intersecting);
+        for (int j = 0; j < 4 && i + j < n; j++)
+            results[i + j] = (outsideBits >> j) & 1 ? cullOutside
+                             : (intersectingBits >> j) & 1 ? cullIntersecting : cullInside;
+    }
+#endif
+    for (; i < n; i++) {
+        results[i] = cullInside;
+        for (int p = 0; p < 6; p++) {
+            const vec4 &plane = f.planes[p];
+            float dist = plane.x * x[i] + plane.y * y[i] + plane.z * z[i] + plane.w;
+            if (dist < -r[i]) {
+                results[i] = cullOutside;
+                break;
+            }
+            if (dist < r[i]) results[i] = cullIntersecting;
+        }
+    }
+}
+
+// Test a model space box transformed by model.  Returns true if it's entirely
+// outside one of the planes.
+bool boxOutsideFrustum(const frustum &f, const mat4 &model, const vec3 &boxMin, const vec3 &boxMax) {
+    vec4 centre = model * vec4((boxMin + boxMax) * 0.5, 1.0);
+    vec3 halfSize = (boxMax - boxMin) * 0.5;
+
+    // The world space box around the transformed box
+    vec3 extent;
+    for (int i = 0; i < 3; i++)
+        extent[i] = fabs(model[i][0]) * halfSize.x + fabs(model[i][1]) * halfSize.y
+                    + fabs(model[i][2]) * halfSize.z;
+
+    for (int p = 0; p < 6; p++) {
+        const vec4 &plane = f.planes[p];
+        float dist = plane.x * centre.x + plane.y * centre.y + plane.z * centre.z + plane.w;
+        float reach = fabs(plane.x) * extent.x + fabs(plane.y) * extent.y + fabs(plane.z) * extent.z;
+        if (dist < -reach) return true;
+    }
+    return false;
+}
@@ -0,0 +1,92 @@
+// Shared geometry buffers (geometrypool.h)
+//
+// Rather than a VAO and a pair of buffers of its own, each mesh gets a range of
+// one large vertex buffer (one per vertex format) and a range of one large
+// index buffer (one for GLushort indices and one for GLuint, so the meshes
+// that can keep their indices small do), with a VAO for each pair.  Then the
+// whole frame can be drawn with few changes of buffers, and runs of instances
+// that share the buffers and a texture go to the GPU in a single
+// glMultiDrawElementsIndirect (see drawBatches).
+//
+// Space is handed out by rangeAllocator, a first fit free list that merges
+// neighbouring ranges as they're freed, so meshes can be evicted and loaded
+// again in any order.  When a buffer runs out of room it's grown, copying the
+// old contents across on the GPU.  The buffers' whole size counts against the
+// mesh budget, so they're only grown past it once there's nothing left in them
+// to evict (see allocatePoolVertices in scene-start.cpp).
+
+#include <map>
+
+typedef struct {
+    GLuint capacity;                     // In elements, e.g., vertices
+    std::map<GLuint, GLuint> freeRanges; // Start -> length.  Never two touching.
+} rangeAllocator;
+
+void initRanges(rangeAllocator *ranges, GLuint capacity) {
+    ranges->capacity = capacity;
+    ranges->freeRanges.clear();
+    ranges->freeRanges[0] = capacity;
+}
+
+// Take length elements from the first free range big enough.  Returns false
+// if there isn't one, in which case the caller grows the allocator.
+bool allocateRange(rangeAllocator *ranges, GLuint length, GLuint *start) {
+    for (std::map<GLuint, GLuint>::iterator it = ranges->freeRanges.begin(); it != ranges->freeRanges.end(); ++it) {
+        if (it->second < length) continue;
+        *start = it->first;
+        GLuint remaining = it->second - length;
+        ranges->freeRanges.erase(it);
+        if (remaining > 0) ranges->freeRanges[*start + length] = remaining;
+        return true;
+    }
+    return false;
+}
+
+void freeRange(rangeAllocator *ranges, GLuint start, GLuint length) {
+    if (length == 0) return;
+    std::map<GLuint, GLuint> &free = ranges->freeRanges;
+    std::map<GLuint, GLuint>::iterator next = free.lower_bound(start);
+    if (next != free.end() && start + length == next->first) { // Merge with the range after
+        length += next->second;
+        next = free.erase(next);
+    }
+    if (next != free.begin()) { // Merge with the range before
+        std::map<GLuint, GLuint>::iterator prev = next;
+        --prev;
+        if (prev->first + prev->second == start) {
+            prev->second += length;
+            return;
+        }
+    }
+    free[start] = length;
+}
+
+// Add the elements from the old capacity up to newCapacity as free space.
+void growRanges(rangeAllocator *ranges, GLuint newCapacity) {
+    GLuint oldCapacity = ranges->capacity;
+    ranges->capacity = newCapacity;
+    freeRange(ranges, oldCapacity, newCapacity - oldCapacity);
+}
+
+// Replace a buffer with a bigger one holding the same first oldBytes.
+// Returns the new buffer; the old one is deleted.
+GLuint growBuffer(GLuint buffer, size_t oldBytes, size_t newBytes) {
+    GLuint bigger;
+    glGenBuffers(1, &bigger);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, bigger);
+    glBufferData(GL_COPY_WRITE_BUFFER, newBytes, NULL, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldBytes);
+    glDeleteBuffers(1, &buffer);
+    CheckError();
+    return bigger;
+}
+
+// One DrawElementsIndirectCommand, in the layout glMultiDrawElementsIndirect reads.
+typedef struct {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+} drawIndirectCommand;
@@ -77,13 +77,18 @@ void aiInit() {
     aiAttachLogStream(&stream);
 }
 
-// Load a mesh by number from the models-textures directory via the Open Asset Importer
-aiMesh *loadMesh(int meshNumber) {
+// The post-processing applied to every model.  This is also part of the key for
+// the baked mesh cache (see meshcache.h), so changing it rebakes all models.
+const unsigned int meshPostProcessFlags = aiProcessPreset_TargetRealtime_Quality
+                                          | aiProcess_ConvertToLeftHanded;
+
+// Import a model's scene by number from the models-textures directory via the
+// Open Asset Importer.  Returns NULL if the file can't be read.
+const aiScene *importMeshScene(int meshNumber) {
     char filename[256];
-    sprintf(filename, "%s/model%d.x", dataDir, meshNumber);
-    const aiScene *scene = aiImportFile(filename, aiProcessPreset_TargetRealtime_Quality
-                                                  | aiProcess_ConvertToLeftHanded);
-    return scene->mMeshes[0];
+    if (snprintf(filename, sizeof(filename), "%s/model%d.x", dataDir, meshNumber) >= (int) sizeof(filename))
+        return NULL;
+    return aiImportFile(filename, meshPostProcessFlags);
 }
 
 
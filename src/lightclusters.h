@@ -0,0 +1,198 @@
+// Clustered lights (lightclusters.h)
+//
+// Any object can be a light (see lightType), and there can be any number of
+// them.  Rather than every fragment working through every light, the view
+// frustum is cut into clusters: clusterTilesX x clusterTilesY tiles across
+// the screen, each cut into clusterSlices slices, spaced exponentially in
+// depth so that near clusters aren't stretched thin.  Each frame, every light
+// is given to the clusters that its sphere of influence might reach (see
+// assignLightsToClusters), and the fragment shader only loops over the lights
+// in the cluster it falls into.  So the cost goes with how many lights reach
+// each part of the scene rather than how many there are altogether.
+//
+// The lights and the clusters go to the shader in buffer textures, which
+// hold as many as needed (unlike a uniform block):
+//   - lightTexture: lightData for each light, as four RGBA32F texels.
+//   - clusterTexture: for each cluster, an RG32UI texel holding where its
+//     lights start in lightIndexTexture and how many there are.
+//   - lightIndexTexture: R32UI light numbers, the clusters' lists one after
+//     another.
+//
+// The lights fall off as 1 / (1 + 0.1 d + 0.1 d^2) as they always have, which
+// never quite reaches zero, so each light reaches as far as where it drops
+// below lightCutoff of full brightness.  Directional lights reach everywhere,
+// and are in every cluster.
+
+enum lightType { lightNone, lightPoint, lightDirectional, lightSpot };
+
+const int clusterTilesX = 16, clusterTilesY = 8, clusterSlices = 24;
+const int numClusters = clusterTilesX * clusterTilesY * clusterSlices;
+const float lightCutoff = 1.0 / 256.0; // Less than a step of an 8 bit colour
+const float spotCosCutoff = 0.5;       // Spotlights light 60 degrees either side of their direction
+
+// One light, in eye coordinates, as four texels of lightTexture.
+typedef struct {
+    GLfloat position[4];  // For directional lights, the direction towards the light.  w is the lightType.
+    GLfloat color[4];     // Multiplied by the brightness.  w is the range.
+    GLfloat direction[4]; // Which way a spotlight points, normalized.  w is the cosine of the cutoff angle.
+    GLfloat shadow[4];    // x is the shadow map it casts, or -1 (see shadows.h)
+} lightData;
+
+std::vector<lightData> frameLights; // Filled in each frame by display
+
+GLuint lightBuffer, clusterBuffer, lightIndexBuffer;
+GLuint lightTexture, clusterTexture, lightIndexTexture;
+const GLenum lightTextureUnit = GL_TEXTURE2; // Units 0 and 1 are the object textures (see fStart.glsl)
+const GLenum clusterTextureUnit = GL_TEXTURE3;
+const GLenum lightIndexTextureUnit = GL_TEXTURE4;
+
+GLuint clusterRanges[numClusters][2]; // Where each cluster's lights start in clusterLightIndices, and how many
+std::vector<GLuint> clusterLightIndices;
+
+// The depth range of the clusters, from the projection, and how slices are
+// found from depth: floor(log(depth) * sliceScale - sliceBias).
+float clusterNear, clusterFar, sliceScale, sliceBias;
+
+// How far a light of the given brightness (its brightest colour component)
+// reaches before it's dimmer than lightCutoff.
+float lightRange(float brightness) {
+    // Solve 1 + 0.1 d + 0.1 d^2 = brightness / lightCutoff
+    float c = 1.0 - brightness / lightCutoff;
+    if (c >= 0.0) return 0.0; // Never bright enough to see
+    return (-0.1 + sqrt(0.01 - 0.4 * c)) / 0.2;
+}
+
+static GLuint makeBufferTexture(GLuint *buffer, GLenum format) {
+    GLuint texture;
+    glGenBuffers(1, buffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, *buffer);
+    glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW); // Never empty, so always valid
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_BUFFER, texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, format, *buffer);
+    CheckError();
+    return texture;
+}
+
+// Make the buffer textures, and bind them to their units for good.
+void makeLightClusters() {
+    glActiveTexture(lightTextureUnit);
+    lightTexture = makeBufferTexture(&lightBuffer, GL_RGBA32F);
+    glActiveTexture(clusterTextureUnit);
+    clusterTexture = makeBufferTexture(&clusterBuffer, GL_RG32UI);
+    glActiveTexture(lightIndexTextureUnit);
+    lightIndexTexture = makeBufferTexture(&lightIndexBuffer, GL_R32UI);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+static int clusterSlice(float depth) {
+    int slice = (int) floor(log(depth) * sliceScale - sliceBias);
+    return std::max(0, std::min(slice, clusterSlices - 1));
+}
+
+static int clusterTile(float ndc, int nTiles) {
+    int tile = (int) floor((ndc * 0.5 + 0.5) * nTiles);
+    return std::max(0, std::min(tile, nTiles - 1));
+}
+
+// The clusters a light might reach: x, y and slice from lo to hi inclusive.
+// Returns false if it can't reach any.
+static bool lightClusterBounds(const lightData &light, const mat4 &projection, int lo[3], int hi[3]) {
+    lo[0] = lo[1] = lo[2] = 0;
+    hi[0] = clusterTilesX - 1;
+    hi[1] = clusterTilesY - 1;
+    hi[2] = clusterSlices - 1;
+    if (light.position[3] == lightDirectional) return true;
+
+    float radius = light.color[3];
+    vec3 centre(light.position[0], light.position[1], light.position[2]);
+    float nearest = -centre.z - radius, farthest = -centre.z + radius; // As depths
+    if (radius <= 0.0 || farthest < clusterNear || nearest > clusterFar) return false;
+    lo[2] = clusterSlice(std::max(nearest, clusterNear));
+    hi[2] = clusterSlice(farthest);
+    if (nearest <= clusterNear) return true; // Crosses the near plane, so could be anywhere on screen
+
+    // The corners of the sphere's bounding box are all in front, so bound its projection
+    float ndcMin[2] = {1e30, 1e30}, ndcMax[2] = {-1e30, -1e30};
+    for (int corner = 0; corner < 8; corner++) {
+        vec4 clip = projection * vec4(centre.x + (corner & 1 ? radius : -radius),
+                                      centre.y + (corner & 2 ? radius : -radius),
+                                      centre.z + (corner & 4 ? radius : -radius), 1.0);
+        for (int axis = 0; axis < 2; axis++) {
+            ndcMin[axis] = std::min(ndcMin[axis], clip[axis] / clip.w);
+            ndcMax[axis] = std::max(ndcMax[axis], clip[axis] / clip.w);
+        }
+    }
+    if (ndcMax[0] < -1.0 || ndcMin[0] > 1.0 || ndcMax[1] < -1.0 || ndcMin[1] > 1.0) return false;
+    lo[0] = clusterTile(ndcMin[0], clusterTilesX);
+    hi[0] = clusterTile(ndcMax[0], clusterTilesX);
+    lo[1] = clusterTile(ndcMin[1], clusterTilesY);
+    hi[1] = clusterTile(ndcMax[1], clusterTilesY);
+    return true;
+}
+
+// Set the clusters' depth range from the projection, which must be a frustum.
+void setClusterDepthRange(const mat4 &projection) {
+    // The near and far distances, back out of the projection (see Frustum in mat.h)
+    clusterNear = projection[2][3] / (projection[2][2] - 1.0);
+    clusterFar = projection[2][3] / (projection[2][2] + 1.0);
+    sliceScale = clusterSlices / log(clusterFar / clusterNear);
+    sliceBias = log(clusterNear) * sliceScale;
+}
+
+// Give each of frameLights to the clusters it might reach, filling in
+// clusterRanges and clusterLightIndices.  The projection must be a frustum.
+void assignLightsToClusters(const mat4 &projection) {
+    setClusterDepthRange(projection);
+
+    // Count the lights in each cluster, then set where each cluster's list starts
+    std::vector<int> bounds(frameLights.size() * 6);
+    memset(clusterRanges, 0, sizeof(clusterRanges));
+    for (size_t i = 0; i < frameLights.size(); i++) {
+        int *lo = &bounds[i * 6], *hi = lo + 3;
+        if (!lightClusterBounds(frameLights[i], projection, lo, hi)) {
+            lo[0] = 1; // Empty
+            hi[0] = 0;
+            continue;
+        }
+        for (int z = lo[2]; z <= hi[2]; z++)
+            for (int y = lo[1]; y <= hi[1]; y++)
+                for (int x = lo[0]; x <= hi[0]; x++)
+                    clusterRanges[(z * clusterTilesY + y) * clusterTilesX + x][1]++;
+    }
+    GLuint total = 0;
+    for (int cluster = 0; cluster < numClusters; cluster++) {
+        clusterRanges[cluster][0] = total;
+        total += clusterRanges[cluster][1];
+        clusterRanges[cluster][1] = 0; // Counted again as they're filled in
+    }
+
+    clusterLightIndices.resize(std::max(total, 1u));
+    for (size_t i = 0; i < frameLights.size(); i++) {
+        const int *lo = &bounds[i * 6], *hi = lo + 3;
+        for (int z = lo[2]; z <= hi[2]; z++)
+            for (int y = lo[1]; y <= hi[1]; y++)
+                for (int x = lo[0]; x <= hi[0]; x++) {
+                    GLuint *range = clusterRanges[(z * clusterTilesY + y) * clusterTilesX + x];
+                    clusterLightIndices[range[0] + range[1]++] = i;
+                }
+    }
+}
+
+// Upload frameLights, replacing last frame's.
+void uploadLights() {
+    glBindBuffer(GL_TEXTURE_BUFFER, lightBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(lightData) * std::max(frameLights.size(), (size_t) 1),
+                 frameLights.empty() ? NULL : frameLights.data(), GL_STREAM_DRAW);
+    CheckError();
+}
+
+// Upload the clusters, likewise.
+void uploadLightClusters() {
+    glBindBuffer(GL_TEXTURE_BUFFER, clusterBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(clusterRanges), clusterRanges, GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, lightIndexBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(GLuint) * clusterLightIndices.size(), clusterLightIndices.data(),
+                 GL_STREAM_DRAW);
+    CheckError();
+}
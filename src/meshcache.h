@@ -0,0 +1,571 @@
+// Baked mesh cache (meshcache.h)
+//
+// Assimp takes hundreds of milliseconds to parse and post-process the larger .x
+// models, so the first time a model is used its processed vertices, indices and
+// bounds are written to a binary file in cacheDir.  Later runs memory-map that
+// file and hand the data straight to glBufferData.  Running the program with
+// --bake fills the cache for every model up front.  Models are read with the
+// fast parser in xparser.h where possible, and with Assimp otherwise.
+//
+// Meshes big enough to be worth it also get simplified levels of detail (see
+// meshsimplify.h), stored as extra index lists into the same vertices.
+//
+// A cache file is only used if its version and post-processing flags match, and
+// its source file is unchanged: the size and modification time are checked
+// first, and only if those differ is the source file rehashed.
+
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+char cacheDir[256] = "res/cache"; // Where baked meshes are stored
+
+const char meshCacheMagic[4] = {'G', 'M', 'S', 'H'};
+const GLuint meshCacheVersion = 3; // Increase whenever the file layout changes
+
+// The start of every cache file.  The vertices follow immediately, in the
+// packed layout given by vertexFormat (see vertexformat.h), then the triangle
+// indices for each level of detail in turn, as GLushorts or GLuints.
+typedef struct {
+    char magic[4];
+    GLuint version;
+    GLuint postProcessFlags;
+    GLuint nVertices;
+    GLuint nIndices;      // For the full detail mesh, i.e., lodIndexCount[0]
+    GLuint vertexFormat;  // snorm16Positions or floatPositions
+    GLuint indexSize;     // 2 for meshes with fewer than 65536 vertices, otherwise 4
+    GLuint nLods;         // Including the full detail mesh
+    unsigned long long sourceHash;  // FNV-1a hash of the .x file
+    unsigned long long sourceSize;
+    long long sourceModTime;
+    GLfloat boundsMin[3], boundsMax[3]; // Axis aligned bounding box
+    GLfloat centre[3], radius;          // Bounding sphere
+    GLfloat posOffset[3], posScale;     // Model position = stored position * posScale + posOffset
+    GLuint lodIndexCount[maxMeshLods];
+    GLfloat lodError[maxMeshLods];      // How far each level strays from the full mesh
+} meshCacheHeader;
+
+const GLubyte *meshCacheVertices(const meshCacheHeader *header) {
+    return (const GLubyte *) (header + 1);
+}
+
+const GLubyte *meshCacheIndices(const meshCacheHeader *header) {
+    return meshCacheVertices(header) + vertexSize(header->vertexFormat) * header->nVertices;
+}
+
+size_t meshCacheFileSize(const meshCacheHeader *header) {
+    size_t size = sizeof(meshCacheHeader) + vertexSize(header->vertexFormat) * header->nVertices;
+    for (GLuint i = 0; i < header->nLods; i++)
+        size += (size_t) header->indexSize * header->lodIndexCount[i];
+    return size;
+}
+
+//------Memory mapped files-----------------------------------------------------
+
+typedef struct {
+    const GLubyte *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#endif
+} mappedFile;
+
+// Map a whole file read-only.  Returns false if it doesn't exist or is empty.
+bool mapFile(const char *fileName, mappedFile *mf) {
+    mf->data = NULL;
+    mf->size = 0;
+#ifdef _WIN32
+    mf->file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                           FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (mf->file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(mf->file, &size);
+    mf->mapping = size.QuadPart > 0 ? CreateFileMappingA(mf->file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    if (mf->mapping == NULL) {
+        CloseHandle(mf->file);
+        return false;
+    }
+    mf->data = (const GLubyte *) MapViewOfFile(mf->mapping, FILE_MAP_READ, 0, 0, 0);
+    mf->size = (size_t) size.QuadPart;
+    if (mf->data == NULL) {
+        CloseHandle(mf->mapping);
+        CloseHandle(mf->file);
+        return false;
+    }
+#else
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps its own reference to the file
+    if (addr == MAP_FAILED) return false;
+
+    mf->data = (const GLubyte *) addr;
+    mf->size = st.st_size;
+#endif
+    return true;
+}
+
+void unmapFile(mappedFile *mf) {
+    if (mf->data == NULL) return;
+#ifdef _WIN32
+    UnmapViewOfFile(mf->data);
+    CloseHandle(mf->mapping);
+    CloseHandle(mf->file);
+#else
+    munmap((void *) mf->data, mf->size);
+#endif
+    mf->data = NULL;
+}
+
+//------Hashing and file identity-----------------------------------------------
+
+unsigned long long hashBytes(const GLubyte *bytes, size_t n) {
+    unsigned long long hash = 14695981039346656037ULL; // 64-bit FNV-1a
+    for (size_t i = 0; i < n; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Hash a whole file, or return 0 if it can't be read.
+unsigned long long hashFile(const char *fileName) {
+    mappedFile mf;
+    if (!mapFile(fileName, &mf)) return 0;
+    unsigned long long hash = hashBytes(mf.data, mf.size);
+    unmapFile(&mf);
+    return hash;
+}
+
+// Get a file's size and modification time, returning false if it doesn't exist.
+bool fileSizeAndModTime(const char *fileName, unsigned long long *size, long long *modTime) {
+    struct stat st;
+    if (stat(fileName, &st) != 0) return false;
+    *size = st.st_size;
+    *modTime = st.st_mtime;
+    return true;
+}
+
+// These fill a fileName of 256 chars, and fail if the path won't fit.
+static void meshSourceFileName(int meshNumber, char *fileName) {
+    if (snprintf(fileName, 256, "%s/model%d.x", dataDir, meshNumber) >= 256)
+        fail("Error - the models-textures path is too long:", dataDir);
+}
+
+static void meshCacheFileName(int meshNumber, char *fileName) {
+    if (snprintf(fileName, 256, "%s/model%d.mesh", cacheDir, meshNumber) >= 256)
+        fail("Error - the cache path is too long:", cacheDir);
+}
+
+//------Baking------------------------------------------------------------------
+
+// Write a file via a temporary file and a rename, so that a half written
+// file is never mistaken for a complete one.
+bool writeFileAtomically(const char *fileName, const GLubyte *data, size_t size) {
+#ifdef _WIN32
+    _mkdir(cacheDir);
+#else
+    mkdir(cacheDir, 0755);
+#endif
+    char tmpName[300];
+    sprintf(tmpName, "%s.tmp", fileName);
+
+    FILE *fp = fopen(tmpName, "wb");
+    if (fp == NULL) return false;
+    bool ok = fwrite(data, 1, size, fp) == size;
+    ok = (fclose(fp) == 0) && ok;
+
+#ifdef _WIN32
+    remove(fileName); // rename won't replace an existing file on Windows
+#endif
+    if (!ok || rename(tmpName, fileName) != 0) {
+        remove(tmpName);
+        return false;
+    }
+    return true;
+}
+
+// Import a model with Assimp, as a fallback for files the fast parser can't handle.
+bool importMeshData(int meshNumber, meshData &data) {
+    const aiScene *scene = importMeshScene(meshNumber);
+    if (scene == NULL) return false;
+    if (scene->mNumMeshes == 0) {
+        aiReleaseImport(scene);
+        return false;
+    }
+    aiMesh *mesh = scene->mMeshes[0];
+
+    const GLfloat *positions = (const GLfloat *) mesh->mVertices, *normals = (const GLfloat *) mesh->mNormals;
+    data.positions.assign(positions, positions + mesh->mNumVertices * 3);
+    data.normals.assign(normals, normals + mesh->mNumVertices * 3);
+    data.texCoords.clear();
+    // mTextureCoords[0] has space for up to 3 dimensions, but we only need 2.
+    if (mesh->mTextureCoords[0])
+        for (GLuint i = 0; i < mesh->mNumVertices; i++) {
+            data.texCoords.push_back(mesh->mTextureCoords[0][i].x);
+            data.texCoords.push_back(mesh->mTextureCoords[0][i].y);
+        }
+    data.indices.resize(mesh->mNumFaces * 3);
+    for (GLuint i = 0; i < mesh->mNumFaces; i++)
+        for (int j = 0; j < 3; j++)
+            data.indices[i * 3 + j] = mesh->mFaces[i].mIndices[j];
+
+    aiReleaseImport(scene);
+    return true;
+}
+
+// Read a model with the fast parser, returning false if it can't handle the file.
+bool parseMeshFile(int meshNumber, meshData &data) {
+    char sourceName[256];
+    meshSourceFileName(meshNumber, sourceName);
+
+    mappedFile mf;
+    if (!mapFile(sourceName, &mf)) return false;
+    bool parsed = parseXFile((const char *) mf.data, mf.size, data);
+    unmapFile(&mf);
+    return parsed;
+}
+
+// Read a model with the fast parser, or with Assimp if the parser can't
+// handle it.  Returns false if neither can.
+bool readMeshData(int meshNumber, meshData &data) {
+    return parseMeshFile(meshNumber, data) || importMeshData(meshNumber, data);
+}
+
+// Read a model and convert it to the cached layout in blob.  Returns false if
+// the model can't be read.
+bool buildMeshBlob(int meshNumber, std::vector<GLubyte> &blob) {
+    char sourceName[256];
+    meshSourceFileName(meshNumber, sourceName);
+
+    meshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    if (!fileSizeAndModTime(sourceName, &header.sourceSize, &header.sourceModTime))
+        return false;
+
+    meshData mesh;
+    if (!readMeshData(meshNumber, mesh)) return false;
+    GLuint nVertices = mesh.positions.size() / 3;
+    const GLfloat *positions = mesh.positions.data();
+
+    memcpy(header.magic, meshCacheMagic, sizeof(header.magic));
+    header.version = meshCacheVersion;
+    header.postProcessFlags = meshPostProcessFlags;
+    header.nVertices = nVertices;
+    header.nIndices = mesh.indices.size();
+    header.nLods = 1;
+    header.lodIndexCount[0] = header.nIndices;
+    header.lodError[0] = 0.0;
+    header.indexSize = nVertices < 65536 ? sizeof(GLushort) : sizeof(GLuint);
+    header.sourceHash = hashFile(sourceName);
+
+    // The bounds come first, since the position quantization depends on them
+    vec3 lo(1e30, 1e30, 1e30), hi(-1e30, -1e30, -1e30);
+    for (GLuint i = 0; i < nVertices; i++)
+        for (int j = 0; j < 3; j++) {
+            lo[j] = std::min(lo[j], positions[i * 3 + j]);
+            hi[j] = std::max(hi[j], positions[i * 3 + j]);
+        }
+
+    // The sphere is centred on the box, which is quick and close enough for culling
+    vec3 centre = (lo + hi) * 0.5;
+    float radius2 = 0.0;
+    for (GLuint i = 0; i < nVertices; i++) {
+        vec3 d = vec3(positions[i * 3], positions[i * 3 + 1], positions[i * 3 + 2]) - centre;
+        radius2 = std::max(radius2, dot(d, d));
+    }
+
+    // One scale for all axes, so normals aren't skewed when it's undone
+    vec3 halfSize = (hi - lo) * 0.5;
+    float posScale = std::max(halfSize.x, std::max(halfSize.y, halfSize.z));
+    if (posScale <= 0.0) posScale = 1.0;
+
+    // Use 16 bit positions unless more than 1% of the edges are so short that
+    // quantizing would merge or badly distort them.
+    float quantStep = posScale / 32767.0;
+    GLuint nShortEdges = 0;
+    for (GLuint i = 0; i < header.nIndices; i += 3)
+        for (int j = 0; j < 3; j++) {
+            const GLfloat *a = positions + mesh.indices[i + j] * 3;
+            const GLfloat *b = positions + mesh.indices[i + (j + 1) % 3] * 3;
+            float len = length(vec3(a[0] - b[0], a[1] - b[1], a[2] - b[2]));
+            if (len > 0.0 && len < 2.0 * quantStep) nShortEdges++;
+        }
+    header.vertexFormat = nShortEdges * 100 > header.nIndices ? floatPositions : snorm16Positions;
+
+    for (int j = 0; j < 3; j++) {
+        header.boundsMin[j] = lo[j];
+        header.boundsMax[j] = hi[j];
+        header.centre[j] = centre[j];
+        header.posOffset[j] = header.vertexFormat == floatPositions ? 0.0 : centre[j];
+    }
+    header.radius = sqrt(radius2);
+    header.posScale = header.vertexFormat == floatPositions ? 1.0 : posScale;
+
+    // Simplify the triangles into the lower levels of detail
+    std::vector<meshLod> lods;
+    simplifyMesh(positions, nVertices, mesh.indices.data(), header.nIndices, lods);
+    for (size_t i = 0; i < lods.size(); i++) {
+        header.lodIndexCount[header.nLods] = lods[i].indices.size();
+        header.lodError[header.nLods] = lods[i].error;
+        header.nLods++;
+    }
+
+    blob.resize(meshCacheFileSize(&header));
+    GLubyte *verts = blob.data() + sizeof(meshCacheHeader);
+    size_t stride = vertexSize(header.vertexFormat);
+    bool hasTexCoords = !mesh.texCoords.empty();
+    for (GLuint i = 0; i < nVertices; i++) {
+        const GLfloat *p = positions + i * 3;
+        vec3 n(mesh.normals[i * 3], mesh.normals[i * 3 + 1], mesh.normals[i * 3 + 2]);
+        float u = hasTexCoords ? mesh.texCoords[i * 2] : 0.0;
+        float v = hasTexCoords ? mesh.texCoords[i * 2 + 1] : 0.0;
+
+        if (header.vertexFormat == floatPositions) {
+            packedVertexFloat *vert = (packedVertexFloat *) (verts + i * stride);
+            for (int j = 0; j < 3; j++) vert->position[j] = p[j];
+            packOctahedral(n, vert->normal);
+            vert->texCoord[0] = packHalf(u);
+            vert->texCoord[1] = packHalf(v);
+        } else {
+            packedVertex *vert = (packedVertex *) (verts + i * stride);
+            for (int j = 0; j < 3; j++)
+                vert->position[j] = packSnorm16((p[j] - header.posOffset[j]) / header.posScale);
+            vert->position[3] = 0;
+            packOctahedral(n, vert->normal);
+            vert->texCoord[0] = packHalf(u);
+            vert->texCoord[1] = packHalf(v);
+        }
+    }
+
+    GLubyte *indices = verts + stride * header.nVertices;
+    for (GLuint lod = 0; lod < header.nLods; lod++) {
+        const GLuint *lodIndices = lod == 0 ? mesh.indices.data() : lods[lod - 1].indices.data();
+        for (GLuint i = 0; i < header.lodIndexCount[lod]; i++) {
+            if (header.indexSize == sizeof(GLushort))
+                ((GLushort *) indices)[i] = lodIndices[i];
+            else
+                ((GLuint *) indices)[i] = lodIndices[i];
+        }
+        indices += (size_t) header.indexSize * header.lodIndexCount[lod];
+    }
+
+    memcpy(blob.data(), &header, sizeof(header));
+    return true;
+}
+
+// Bake a model into the cache.  If the cache can't be written the result is
+// still returned in blob, so the caller can use it directly.
+bool bakeMesh(int meshNumber, std::vector<GLubyte> &blob) {
+    if (!buildMeshBlob(meshNumber, blob)) return false;
+
+    char cacheName[256];
+    meshCacheFileName(meshNumber, cacheName);
+    if (!writeFileAtomically(cacheName, blob.data(), blob.size()))
+        printf("Warning - couldn't write the mesh cache file %s\n", cacheName);
+    return true;
+}
+
+// Map a model's cache file, returning false if it is missing or out of date.
+bool mapBakedMesh(int meshNumber, mappedFile *mf) {
+    char cacheName[256], sourceName[256];
+    meshCacheFileName(meshNumber, cacheName);
+    meshSourceFileName(meshNumber, sourceName);
+
+    if (!mapFile(cacheName, mf)) return false;
+
+    const meshCacheHeader *header = (const meshCacheHeader *) mf->data;
+    unsigned long long sourceSize;
+    long long sourceModTime;
+    bool valid = mf->size >= sizeof(meshCacheHeader)
+                 && memcmp(header->magic, meshCacheMagic, sizeof(header->magic)) == 0
+                 && header->version == meshCacheVersion
+                 && header->postProcessFlags == meshPostProcessFlags
+                 && header->vertexFormat <= floatPositions
+                 && (header->indexSize == sizeof(GLushort) || header->indexSize == sizeof(GLuint))
+                 && header->nLods >= 1 && header->nLods <= maxMeshLods
+                 && mf->size == meshCacheFileSize(header)
+                 && fileSizeAndModTime(sourceName, &sourceSize, &sourceModTime)
+                 && sourceSize == header->sourceSize;
+
+    // A touched but otherwise identical source file doesn't need a rebake
+    if (valid && sourceModTime != header->sourceModTime)
+        valid = hashFile(sourceName) == header->sourceHash;
+
+    if (!valid) unmapFile(mf);
+    return valid;
+}
+
+// Read just the header of a model's cache file, without checking it's up to
+// date.  Good enough for sizing a placeholder while the real mesh loads.
+bool peekBakedMeshHeader(int meshNumber, meshCacheHeader *header) {
+    char cacheName[256];
+    meshCacheFileName(meshNumber, cacheName);
+    FILE *fp = fopen(cacheName, "rb");
+    if (fp == NULL) return false;
+    bool ok = fread(header, sizeof(meshCacheHeader), 1, fp) == 1
+              && memcmp(header->magic, meshCacheMagic, sizeof(header->magic)) == 0
+              && header->version == meshCacheVersion;
+    fclose(fp);
+    return ok;
+}
+
+static void bakeMeshIfNeeded(int meshNumber) {
+    mappedFile mf;
+    if (mapBakedMesh(meshNumber, &mf)) {
+        unmapFile(&mf);
+        printf("model%d: already baked\n", meshNumber);
+        return;
+    }
+
+    std::vector<GLubyte> blob;
+    int startTime = glutGet(GLUT_ELAPSED_TIME);
+    if (!bakeMesh(meshNumber, blob))
+        printf("model%d: failed to import\n", meshNumber);
+    else {
+        const meshCacheHeader *header = (const meshCacheHeader *) blob.data();
+        char lodTriangles[128] = "";
+        for (GLuint i = 1; i < header->nLods; i++)
+            sprintf(lodTriangles + strlen(lodTriangles), " %u", header->lodIndexCount[i] / 3);
+        printf("model%d: baked %zu bytes in %d ms, %u triangles, LODs:%s\n", meshNumber,
+               blob.size(), glutGet(GLUT_ELAPSED_TIME) - startTime, header->nIndices / 3,
+               header->nLods > 1 ? lodTriangles : " none");
+    }
+}
+
+// Bake every model that isn't already in the cache (for --bake), using all
+// of the worker threads.
+void bakeAllMeshes() {
+    for (int i = 0; i < numMeshes; i++) {
+        char sourceName[256];
+        meshSourceFileName(i, sourceName);
+        FILE *fp = fopen(sourceName, "rb");
+        if (fp == NULL) continue; // Not every model number is used
+        fclose(fp);
+
+        queueWork([i] { bakeMeshIfNeeded(i); });
+    }
+    waitForWorkers();
+}
+
+//------Loader benchmark--------------------------------------------------------
+
+// A mesh's triangles by value, each as its corners' positions, normals and
+// texture coordinates, starting from the corner with the smallest position.
+// Sorted by position, so that meshes differing only in vertex numbering, the
+// order of the triangles and which corner each starts at come out the same.
+static std::vector<std::vector<GLfloat> > triangleValues(const meshData &mesh) {
+    std::vector<std::vector<GLfloat> > triangles(mesh.indices.size() / 3);
+    for (size_t t = 0; t < triangles.size(); t++) {
+        const GLuint *c = &mesh.indices[t * 3];
+        int first = 0;
+        for (int j = 1; j < 3; j++)
+            if (std::lexicographical_compare(&mesh.positions[c[j] * 3], &mesh.positions[c[j] * 3 + 3],
+                                             &mesh.positions[c[first] * 3], &mesh.positions[c[first] * 3 + 3]))
+                first = j;
+        for (int j = 0; j < 3; j++) {
+            GLuint v = c[(first + j) % 3];
+            triangles[t].insert(triangles[t].end(), &mesh.positions[v * 3], &mesh.positions[v * 3 + 3]);
+        }
+        for (int j = 0; j < 3; j++) {
+            GLuint v = c[(first + j) % 3];
+            triangles[t].insert(triangles[t].end(), &mesh.normals[v * 3], &mesh.normals[v * 3 + 3]);
+            if (!mesh.texCoords.empty())
+                triangles[t].insert(triangles[t].end(), &mesh.texCoords[v * 2], &mesh.texCoords[v * 2 + 2]);
+        }
+    }
+    std::sort(triangles.begin(), triangles.end(),
+              [](const std::vector<GLfloat> &a, const std::vector<GLfloat> &b) {
+                  return std::lexicographical_compare(a.begin(), a.begin() + 9, b.begin(), b.begin() + 9);
+              });
+    return triangles;
+}
+
+// Whether two meshes have the same triangles, allowing for rounding (Assimp
+// flips v twice, which isn't always exact).
+static bool sameTriangles(const meshData &a, const meshData &b) {
+    std::vector<std::vector<GLfloat> > ta = triangleValues(a), tb = triangleValues(b);
+    if (ta.size() != tb.size()) return false;
+    for (size_t t = 0; t < ta.size(); t++) {
+        if (ta[t].size() != tb[t].size()) return false;
+        for (size_t i = 0; i < ta[t].size(); i++)
+            if (fabs(ta[t][i] - tb[t][i]) > 1e-5) return false;
+    }
+    return true;
+}
+
+// Time one way of reading a model, taking the best of a few runs.
+template <typename Loader> static double timeMeshLoader(Loader load, meshData &data, bool *ok) {
+    const int runs = 3;
+    double best = 1e30;
+    for (int run = 0; run < runs; run++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        *ok = load(data);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+        if (!*ok) break;
+    }
+    return best;
+}
+
+// Read every model with both the fast parser and Assimp (for --bench-loaders),
+// checking they give the same triangles and printing how long each took.
+void benchmarkMeshLoaders() {
+    printf("%-8s %10s %10s %8s %9s %9s  %s\n", "model", "fast ms", "Assimp ms", "speedup", "vertices",
+           "triangles", "result");
+    double fastTotal = 0.0, assimpTotal = 0.0;
+    int nModels = 0, nMatching = 0;
+    for (int i = 0; i < numMeshes; i++) {
+        char sourceName[256];
+        meshSourceFileName(i, sourceName);
+        FILE *fp = fopen(sourceName, "rb");
+        if (fp == NULL) continue; // Not every model number is used
+        fclose(fp);
+
+        meshData fast, assimp;
+        bool fastOk, assimpOk;
+        double fastMs = timeMeshLoader([i](meshData &data) { return parseMeshFile(i, data); }, fast, &fastOk);
+        double assimpMs = timeMeshLoader([i](meshData &data) { return importMeshData(i, data); }, assimp,
+                                         &assimpOk);
+
+        char name[16];
+        sprintf(name, "model%d", i);
+        if (!assimpOk) {
+            printf("%-8s %38s\n", name, "Assimp can't import it");
+            continue;
+        }
+        if (!fastOk) {
+            printf("%-8s %10s %10.2f %8s %9zu %9zu  Assimp only\n", name, "-", assimpMs, "-",
+                   assimp.positions.size() / 3, assimp.indices.size() / 3);
+            continue;
+        }
+
+        bool same = sameTriangles(fast, assimp);
+        printf("%-8s %10.2f %10.2f %7.1fx %9zu %9zu  %s\n", name, fastMs, assimpMs, assimpMs / fastMs,
+               fast.positions.size() / 3, fast.indices.size() / 3, same ? "same" : "DIFFERENT");
+        fastTotal += fastMs;
+        assimpTotal += assimpMs;
+        nModels++;
+        if (same) nMatching++;
+    }
+    if (nModels > 0)
+        printf("%-8s %10.2f %10.2f %7.1fx  %d of %d models the same\n", "total", fastTotal, assimpTotal,
+               assimpTotal / fastTotal, nMatching, nModels);
+}
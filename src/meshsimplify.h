@@ -0,0 +1,227 @@
+// Mesh simplification for levels of detail (meshsimplify.h)
+//
+// Uses Garland and Heckbert's quadric error metric: each vertex accumulates
+// the planes of the triangles around it, and the edge whose collapse moves the
+// mesh least far from those planes is collapsed first, over and over.  A
+// collapse always moves one end of an edge onto the other, so every level of
+// detail indexes into the same vertices as the full mesh.  Vertices that share
+// a position (i.e., along texture or normal seams) are treated as one, so
+// simplifying never opens cracks.
+
+#include <queue>
+#include <unordered_map>
+
+const int maxMeshLods = 4;            // Including the full detail mesh
+const GLuint minLodTriangles = 1024;  // Smaller meshes aren't worth simplifying
+
+// A symmetric 4x4 matrix, stored as its upper triangle.
+typedef struct {
+    double q[10];
+} quadric;
+
+static void addPlane(quadric *Q, double a, double b, double c, double d, double weight) {
+    const double p[4] = {a, b, c, d};
+    int k = 0;
+    for (int i = 0; i < 4; i++)
+        for (int j = i; j < 4; j++)
+            Q->q[k++] += weight * p[i] * p[j];
+}
+
+static void addQuadric(quadric *Q, const quadric &R) {
+    for (int k = 0; k < 10; k++) Q->q[k] += R.q[k];
+}
+
+// The sum of squared distances from p to the planes in Q.
+static double quadricError(const quadric &Q, const vec3 &p) {
+    const double v[4] = {p.x, p.y, p.z, 1.0};
+    double error = 0.0;
+    int k = 0;
+    for (int i = 0; i < 4; i++)
+        for (int j = i; j < 4; j++)
+            error += (i == j ? 1.0 : 2.0) * Q.q[k++] * v[i] * v[j];
+    return std::max(error, 0.0);
+}
+
+// A level of detail: a triangle list, plus the largest distance (roughly, in
+// model units) the simplification moved the surface to get there.
+typedef struct {
+    std::vector<GLuint> indices;
+    float error;
+} meshLod;
+
+typedef struct {
+    double cost;
+    GLuint from, to;
+    GLuint fromVersion, toVersion; // Stale if either vertex has changed since
+} edgeCollapse;
+
+struct cheapestCollapseFirst {
+    bool operator()(const edgeCollapse &a, const edgeCollapse &b) const { return a.cost > b.cost; }
+};
+
+// Simplify a triangle list, appending a level of detail to lods each time the
+// triangle count halves, up to maxMeshLods - 1 levels.  Stops early if the mesh
+// can't be simplified any further.
+void simplifyMesh(const GLfloat *positions, GLuint nVertices, const GLuint *indices, GLuint nIndices,
+                  std::vector<meshLod> &lods) {
+    GLuint nTriangles = nIndices / 3;
+    if (nTriangles < minLodTriangles) return;
+
+    // Weld vertices with identical positions by sorting them
+    std::vector<GLuint> order(nVertices);
+    for (GLuint i = 0; i < nVertices; i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [positions](GLuint a, GLuint b) {
+        return std::lexicographical_compare(positions + a * 3, positions + a * 3 + 3,
+                                            positions + b * 3, positions + b * 3 + 3);
+    });
+    std::vector<GLuint> posOf(nVertices), firstVertex;
+    std::vector<vec3> pos;
+    for (GLuint i = 0; i < nVertices; i++) {
+        const GLfloat *p = positions + order[i] * 3;
+        if (i == 0 || !std::equal(p, p + 3, positions + order[i - 1] * 3)) {
+            pos.push_back(vec3(p[0], p[1], p[2]));
+            firstVertex.push_back(order[i]);
+        }
+        posOf[order[i]] = pos.size() - 1;
+    }
+    GLuint nPos = pos.size();
+
+    // Each triangle's corners as both welded positions and original vertices
+    std::vector<GLuint> corners(nIndices), triVerts(indices, indices + nIndices);
+    std::vector<bool> alive(nTriangles, true);
+    std::vector<std::vector<GLuint> > trisAt(nPos);
+    std::vector<quadric> Q(nPos);
+    memset(Q.data(), 0, sizeof(quadric) * nPos);
+    std::unordered_map<unsigned long long, int> edgeUses;
+    GLuint nAlive = 0;
+
+    for (GLuint t = 0; t < nTriangles; t++) {
+        GLuint *c = &corners[t * 3];
+        for (int j = 0; j < 3; j++) c[j] = posOf[indices[t * 3 + j]];
+        vec3 n = cross(pos[c[1]] - pos[c[0]], pos[c[2]] - pos[c[0]]);
+        if (c[0] == c[1] || c[1] == c[2] || c[0] == c[2] || length(n) == 0.0) {
+            alive[t] = false; // Degenerate
+            continue;
+        }
+        nAlive++;
+        n = normalize(n);
+        for (int j = 0; j < 3; j++) {
+            addPlane(&Q[c[j]], n.x, n.y, n.z, -dot(n, pos[c[0]]), 1.0);
+            trisAt[c[j]].push_back(t);
+            GLuint a = std::min(c[j], c[(j + 1) % 3]), b = std::max(c[j], c[(j + 1) % 3]);
+            edgeUses[(unsigned long long) a << 32 | b]++;
+        }
+    }
+
+    // Keep open borders in place with planes through them, perpendicular to their triangle
+    const double borderWeight = 10.0;
+    for (GLuint t = 0; t < nTriangles; t++) {
+        if (!alive[t]) continue;
+        const GLuint *c = &corners[t * 3];
+        vec3 n = normalize(cross(pos[c[1]] - pos[c[0]], pos[c[2]] - pos[c[0]]));
+        for (int j = 0; j < 3; j++) {
+            GLuint a = c[j], b = c[(j + 1) % 3];
+            if (edgeUses[(unsigned long long) std::min(a, b) << 32 | std::max(a, b)] != 1) continue;
+            vec3 side = cross(pos[b] - pos[a], n);
+            if (length(side) == 0.0) continue;
+            side = normalize(side);
+            addPlane(&Q[a], side.x, side.y, side.z, -dot(side, pos[a]), borderWeight);
+            addPlane(&Q[b], side.x, side.y, side.z, -dot(side, pos[a]), borderWeight);
+        }
+    }
+
+    std::vector<GLuint> version(nPos, 0);
+    std::vector<bool> collapsed(nPos, false);
+    std::priority_queue<edgeCollapse, std::vector<edgeCollapse>, cheapestCollapseFirst> heap;
+
+    // Queue the cheaper direction for collapsing the edge a-b
+    auto queueEdge = [&](GLuint a, GLuint b) {
+        quadric sum = Q[a];
+        addQuadric(&sum, Q[b]);
+        double costToB = quadricError(sum, pos[b]), costToA = quadricError(sum, pos[a]);
+        edgeCollapse e;
+        e.cost = std::min(costToA, costToB);
+        e.from = costToB <= costToA ? a : b;
+        e.to = costToB <= costToA ? b : a;
+        e.fromVersion = version[e.from];
+        e.toVersion = version[e.to];
+        heap.push(e);
+    };
+    for (auto &edge : edgeUses)
+        queueEdge(edge.first >> 32, edge.first & 0xffffffffULL);
+    edgeUses.clear();
+
+    double maxCost = 0.0;
+    GLuint target = nAlive / 2;
+    while (!heap.empty() && (int) lods.size() < maxMeshLods - 1) {
+        edgeCollapse e = heap.top();
+        heap.pop();
+        if (collapsed[e.from] || collapsed[e.to] || version[e.from] != e.fromVersion
+            || version[e.to] != e.toVersion)
+            continue;
+
+        // Don't let any triangle that survives the collapse flip over
+        bool flips = false;
+        for (GLuint t : trisAt[e.from]) {
+            if (!alive[t]) continue;
+            const GLuint *c = &corners[t * 3];
+            if (c[0] == e.to || c[1] == e.to || c[2] == e.to) continue;
+            vec3 p[3], moved[3];
+            for (int j = 0; j < 3; j++) {
+                p[j] = pos[c[j]];
+                moved[j] = c[j] == e.from ? pos[e.to] : pos[c[j]];
+            }
+            vec3 before = cross(p[1] - p[0], p[2] - p[0]);
+            vec3 after = cross(moved[1] - moved[0], moved[2] - moved[0]);
+            if (dot(before, after) <= 0.2 * length(before) * length(after)) {
+                flips = true;
+                break;
+            }
+        }
+        if (flips) continue;
+
+        // Collapse: triangles on the edge go, the rest move their corner to e.to
+        for (GLuint t : trisAt[e.from]) {
+            if (!alive[t]) continue;
+            GLuint *c = &corners[t * 3];
+            if (c[0] == e.to || c[1] == e.to || c[2] == e.to) {
+                alive[t] = false;
+                nAlive--;
+                continue;
+            }
+            for (int j = 0; j < 3; j++)
+                if (c[j] == e.from) {
+                    c[j] = e.to;
+                    triVerts[t * 3 + j] = firstVertex[e.to];
+                }
+            trisAt[e.to].push_back(t);
+        }
+        collapsed[e.from] = true;
+        trisAt[e.from].clear();
+        addQuadric(&Q[e.to], Q[e.from]);
+        version[e.to]++;
+        maxCost = std::max(maxCost, e.cost);
+
+        // Tidy up e.to's triangles, then requeue its edges at their new cost
+        std::vector<GLuint> &tris = trisAt[e.to];
+        tris.erase(std::remove_if(tris.begin(), tris.end(), [&](GLuint t) { return !alive[t]; }),
+                   tris.end());
+        std::vector<GLuint> neighbours;
+        for (GLuint t : tris)
+            for (int j = 0; j < 3; j++)
+                if (corners[t * 3 + j] != e.to) neighbours.push_back(corners[t * 3 + j]);
+        std::sort(neighbours.begin(), neighbours.end());
+        neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+        for (GLuint n : neighbours) queueEdge(e.to, n);
+
+        if (nAlive <= target) {
+            meshLod lod;
+            lod.error = sqrt(maxCost);
+            for (GLuint t = 0; t < nTriangles; t++)
+                if (alive[t])
+                    lod.indices.insert(lod.indices.end(), &triVerts[t * 3], &triVerts[t * 3 + 3]);
+            lods.push_back(lod);
+            target = nAlive / 2;
+        }
+    }
+}
@@ -0,0 +1,260 @@
+// CPU mipmap generation (mipmaps.h)
+//
+// The texture baker builds each mip chain itself rather than leaving it to
+// glGenerateMipmap, so the result is the same on every driver and none of the
+// work happens on the display thread.  The textures are sRGB, so the colour
+// channels are converted to linear light before filtering; averaging the
+// stored values directly darkens every level.  Level 0 is converted to linear
+// floats once, and each level is filtered from the float copy of the one above
+// it, so rounding doesn't build up down the chain.  The rows of each level are
+// spread over the worker threads with parallelFor, and the filters work on a
+// whole RGBA pixel at a time with SSE where it's available.
+//
+// Two filters are available (see --mip-filter):
+//   box     Averages each 2x2 block.  Odd last rows and columns are averaged
+//           with themselves.
+//   kaiser  A Kaiser windowed sinc, 8 taps each way, wrapping around the edges
+//           since the textures repeat.  Sharper, with less aliasing.  Levels
+//           with an odd width or height fall back to the box filter.
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define MIPMAPS_SSE
+#endif
+
+enum mipFilter { mipFilterBox = 0, mipFilterKaiser = 1 };
+
+const char *mipFilterNames[] = {"box", "kaiser"};
+
+const int kaiserTaps = 8;
+const int linearToSrgbSize = 16384; // Enough steps that even the darkest sRGB values round correctly
+
+typedef struct {
+    float srgbToLinear[256];
+    GLubyte linearToSrgb[linearToSrgbSize + 1];
+    float kaiserWeights[kaiserTaps];
+} mipTables;
+
+static float srgbDecode(float c) {
+    return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static float srgbEncode(float c) {
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+}
+
+// The zeroth order modified Bessel function of the first kind, for the Kaiser window.
+static double besselI0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static mipTables makeMipTables() {
+    mipTables tables;
+    for (int i = 0; i < 256; i++)
+        tables.srgbToLinear[i] = srgbDecode(i / 255.0f);
+    for (int i = 0; i <= linearToSrgbSize; i++)
+        tables.linearToSrgb[i] = (GLubyte) (srgbEncode((float) i / linearToSrgbSize) * 255.0f + 0.5f);
+
+    // Taps are at half pixel distances from the centre of the destination
+    // pixel, i.e., -3.5 to 3.5 source pixels, and the cutoff is at half the
+    // source's Nyquist frequency
+    const double alpha = 4.0, pi = 3.14159265358979323846;
+    double sum = 0.0, weights[kaiserTaps];
+    for (int k = 0; k < kaiserTaps; k++) {
+        double d = fabs(k - (kaiserTaps - 1) * 0.5), x = d * 0.5;
+        double sinc = sin(pi * x) / (pi * x);
+        double window = besselI0(alpha * sqrt(1.0 - (d / 4.0) * (d / 4.0))) / besselI0(alpha);
+        weights[k] = sinc * window;
+        sum += weights[k];
+    }
+    for (int k = 0; k < kaiserTaps; k++)
+        tables.kaiserWeights[k] = weights[k] / sum;
+    return tables;
+}
+
+static const mipTables &getMipTables() {
+    static const mipTables tables = makeMipTables(); // Made once, thread safely
+    return tables;
+}
+
+// The level a new level is filtered from: either the 8 bit sRGB level 0,
+// converted to linear a row at a time as it's read, or a level made earlier,
+// kept as linear floats.
+typedef struct {
+    GLuint width, height;
+    const GLubyte *srgb;
+    const float *linear; // When srgb is NULL
+} mipSource;
+
+// Split rows into up to 16 pieces of work, a few for each worker.
+static void parallelRows(GLuint nRows, std::function<void(GLuint, GLuint)> body) {
+    int nPieces = std::min<int>(nRows, 16);
+    parallelFor(nPieces, [=](int piece) {
+        body((GLuint) ((unsigned long long) nRows * piece / nPieces),
+             (GLuint) ((unsigned long long) nRows * (piece + 1) / nPieces));
+    });
+}
+
+// Row y of the source in linear floats, converted into buffer if need be.
+static const float *sourceRow(const mipSource &src, GLuint y, float *buffer) {
+    if (src.srgb == NULL) return src.linear + (size_t) y * src.width * 4;
+
+    const float *toLinear = getMipTables().srgbToLinear;
+    const GLubyte *in = src.srgb + (size_t) y * src.width * 4;
+    for (GLuint i = 0; i < src.width * 4; i += 4) {
+        buffer[i] = toLinear[in[i]];
+        buffer[i + 1] = toLinear[in[i + 1]];
+        buffer[i + 2] = toLinear[in[i + 2]];
+        buffer[i + 3] = in[i + 3] * (1.0f / 255.0f); // Alpha is already linear
+    }
+    return buffer;
+}
+
+// Convert a row of width linear pixels back to 8 bit sRGB.
+static void encodeRow(const float *in, GLuint width, GLubyte *out) {
+    const GLubyte *toSrgb = getMipTables().linearToSrgb;
+    for (GLuint i = 0; i < width * 4; i += 4) {
+        // Clamped, since the Kaiser filter can overshoot
+#ifdef MIPMAPS_SSE
+        __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i), _mm_setzero_ps()), _mm_set1_ps(1.0f));
+        __m128 scaled = _mm_add_ps(_mm_mul_ps(v, _mm_set_ps(255.0f, linearToSrgbSize, linearToSrgbSize,
+                                                           linearToSrgbSize)), _mm_set1_ps(0.5f));
+        int index[4];
+        _mm_storeu_si128((__m128i *) index, _mm_cvttps_epi32(scaled));
+#else
+        int index[4];
+        for (int c = 0; c < 4; c++)
+            index[c] = (int) (std::min(std::max(in[i + c], 0.0f), 1.0f) * (c == 3 ? 255 : linearToSrgbSize) + 0.5f);
+#endif
+        out[i] = toSrgb[index[0]];
+        out[i + 1] = toSrgb[index[1]];
+        out[i + 2] = toSrgb[index[2]];
+        out[i + 3] = (GLubyte) index[3];
+    }
+}
+
+// Average each 2x2 block of src into dst, in linear and as sRGB in out.
+static void boxFilter(const mipSource &src, GLuint dstWidth, GLuint dstHeight, float *dst, GLubyte *out) {
+    GLuint width = src.width, height = src.height;
+    parallelRows(dstHeight, [=](GLuint y0, GLuint y1) {
+        std::vector<float> buffers(src.srgb != NULL ? width * 8 : 0);
+        for (GLuint y = y0; y < y1; y++) {
+            const float *row0 = sourceRow(src, std::min(y * 2, height - 1), buffers.data());
+            const float *row1 = sourceRow(src, std::min(y * 2 + 1, height - 1), buffers.data() + width * 4);
+            float *o = dst + (size_t) y * dstWidth * 4;
+            for (GLuint x = 0; x < dstWidth; x++) {
+                GLuint x0 = std::min(x * 2, width - 1) * 4, x1 = std::min(x * 2 + 1, width - 1) * 4;
+#ifdef MIPMAPS_SSE
+                __m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(row0 + x0), _mm_loadu_ps(row0 + x1)),
+                                        _mm_add_ps(_mm_loadu_ps(row1 + x0), _mm_loadu_ps(row1 + x1)));
+                _mm_storeu_ps(o + x * 4, _mm_mul_ps(sum, _mm_set1_ps(0.25f)));
+#else
+                for (int c = 0; c < 4; c++)
+                    o[x * 4 + c] = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c]) * 0.25f;
+#endif
+            }
+            encodeRow(o, dstWidth, out + (size_t) y * dstWidth * 4);
+        }
+    });
+}
+
+// The source pixel for tap k of destination pixel x, out of count, wrapping
+// around at the ends.
+static GLuint kaiserSource(GLuint x, int k, GLuint count) {
+    return (x * 2 + count * kaiserTaps + k - kaiserTaps / 2 + 1) % count;
+}
+
+// Filter a row of width pixels down to width / 2 at out.
+static void kaiserFilterRow(const float *in, GLuint width, float *out) {
+    const float *weights = getMipTables().kaiserWeights;
+    for (GLuint x = 0; x < width / 2; x++, out += 4) {
+        // Only the pixels near the ends need to wrap around
+        GLuint first = x * 2 + 1 - kaiserTaps / 2;
+        bool inside = x * 2 + 1 >= (GLuint) kaiserTaps / 2 && first + kaiserTaps <= width;
+#ifdef MIPMAPS_SSE
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < kaiserTaps; k++) {
+            GLuint s = inside ? first + k : kaiserSource(x, k, width);
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(in + s * 4), _mm_set1_ps(weights[k])));
+        }
+        _mm_storeu_ps(out, sum);
+#else
+        for (int c = 0; c < 4; c++) out[c] = 0.0f;
+        for (int k = 0; k < kaiserTaps; k++) {
+            GLuint s = inside ? first + k : kaiserSource(x, k, width);
+            for (int c = 0; c < 4; c++)
+                out[c] += in[s * 4 + c] * weights[k];
+        }
+#endif
+    }
+}
+
+// Separably: the rows are filtered across into tmp, then each output row is
+// the weighted sum of the eight rows of tmp around it.  The width and height
+// must be even.
+static void kaiserFilter(const mipSource &src, float *dst, GLubyte *out, std::vector<float> &tmp) {
+    GLuint width = src.width, height = src.height, dstWidth = width / 2, dstHeight = height / 2;
+    tmp.resize((size_t) dstWidth * height * 4);
+    float *across = tmp.data();
+
+    parallelRows(height, [=](GLuint y0, GLuint y1) {
+        std::vector<float> buffer(src.srgb != NULL ? width * 4 : 0);
+        for (GLuint y = y0; y < y1; y++)
+            kaiserFilterRow(sourceRow(src, y, buffer.data()), width, across + (size_t) y * dstWidth * 4);
+    });
+
+    size_t rowFloats = (size_t) dstWidth * 4;
+    parallelRows(dstHeight, [=](GLuint y0, GLuint y1) {
+        const float *weights = getMipTables().kaiserWeights;
+        for (GLuint y = y0; y < y1; y++) {
+            float *o = dst + y * rowFloats;
+            std::fill(o, o + rowFloats, 0.0f);
+            for (int k = 0; k < kaiserTaps; k++) {
+                const float *row = across + kaiserSource(y, k, height) * rowFloats;
+                size_t i = 0;
+#ifdef MIPMAPS_SSE
+                __m128 weight = _mm_set1_ps(weights[k]);
+                for (; i < rowFloats; i += 4)
+                    _mm_storeu_ps(o + i, _mm_add_ps(_mm_loadu_ps(o + i), _mm_mul_ps(_mm_loadu_ps(row + i), weight)));
+#endif
+                for (; i < rowFloats; i++)
+                    o[i] += row[i] * weights[k];
+            }
+            encodeRow(o, dstWidth, out + y * rowFloats);
+        }
+    });
+}
+
+// Fill in levels 1 to nLevels - 1 of an RGBA8 mip chain from level 0, each
+// level half the size of the one before (rounding down, but at least 1).  If
+// levelMs isn't NULL it gets the time taken to make each level in
+// milliseconds (so levelMs[0] is 0).
+void buildMipChain(GLuint width, GLuint height, GLuint nLevels, GLubyte *const *levels, mipFilter filter,
+                   double *levelMs) {
+    mipSource src = {width, height, levels[0], NULL};
+    std::vector<float> current, next, tmp;
+    if (levelMs != NULL) levelMs[0] = 0.0;
+
+    for (GLuint level = 1; level < nLevels; level++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        GLuint dstWidth = std::max(src.width / 2, 1u), dstHeight = std::max(src.height / 2, 1u);
+        next.resize((size_t) dstWidth * dstHeight * 4);
+        if (filter == mipFilterKaiser && src.width % 2 == 0 && src.height % 2 == 0)
+            kaiserFilter(src, next.data(), levels[level], tmp);
+        else
+            boxFilter(src, dstWidth, dstHeight, next.data(), levels[level]);
+
+        current.swap(next);
+        src.width = dstWidth;
+        src.height = dstHeight;
+        src.srgb = NULL;
+        src.linear = current.data();
+        if (levelMs != NULL)
+            levelMs[level] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+}
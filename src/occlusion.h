@@ -0,0 +1,403 @@
+// Software occlusion culling (occlusion.h)
+//
+// Objects hidden behind others are dropped before they reach the GPU.  Each
+// frame the biggest objects on screen are rasterized on the CPU, using a
+// coarse level of detail of their meshes, into a small depth buffer.  Every
+// other object that survived frustum culling then has its bounding box tested
+// against it, and is skipped if the box is behind what's already there at
+// every pixel it could cover.
+//
+// The buffer holds 1/w rather than depth, since it can be interpolated
+// linearly across a triangle on screen: larger is nearer, and 0 means nothing
+// was drawn.  The rows are split into bands which the workers rasterize in
+// parallel, four pixels at a time with SSE where it's available.  Then a
+// hierarchical-Z pyramid is built, each texel holding the farthest value of
+// the 2 x 2 below it, so that a box can be tested with at most four reads
+// however much of the screen it covers.
+//
+// None of this touches GL, so it can be timed without a window (see
+// benchmarkOcclusion).
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define OCCLUSION_SSE
+#endif
+
+const int occlusionWidth = 256, occlusionHeight = 128; // A multiple of 4 wide, for the SSE
+const int occlusionLevels = 9;   // Down to 1 x 1
+const int occlusionBands = 8;    // Of 16 rows each
+const int maxOccluders = 16;     // A frame's occluders are the largest this many objects on screen
+const float minOccluderSize = 0.05; // Radius over distance, below which an object isn't worth drawing
+const float occluderMaxError = 0.05; // As a fraction of the mesh's radius (see makeOccluderMesh)
+
+typedef struct {
+    std::vector<vec3> positions; // In model coordinates
+    std::vector<GLuint> indices;
+} occluderMesh;
+
+typedef struct {
+    int minX, minY, maxX, maxY;         // The pixels it might cover, inclusive
+    float edgeA[3], edgeB[3], edgeC[3]; // Pixel (x, y) is inside if A x + B y + C >= 0 for each edge
+    float depthA, depthB, depthC;       // 1/w at the centre of pixel (x, y) is A x + B y + C
+} occluderTriangle;
+
+typedef struct {
+    mat4 viewProjection;
+    std::vector<occluderTriangle> triangles;
+    std::vector<vec4> clipped;  // Working space for addOccluder
+    std::vector<float> levels[occlusionLevels]; // Level 0 is the depth buffer itself
+} occlusionBuffer;
+
+int occlusionLevelWidth(int level) {
+    return std::max(occlusionWidth >> level, 1);
+}
+
+int occlusionLevelHeight(int level) {
+    return std::max(occlusionHeight >> level, 1);
+}
+
+// Round a screen coordinate down to a whole pixel, first clamping it to well
+// outside the buffer (size pixels across) so it can't overflow an int.
+static int pixelFloor(float f, int size) {
+    return (int) floor(std::max(-2.0f * size, std::min(f, 2.0f * size)));
+}
+
+//------Occluder meshes---------------------------------------------------------
+
+// The model position of vertex v of a baked mesh.
+static vec3 meshCachePosition(const meshCacheHeader *header, GLuint v) {
+    const GLubyte *vertex = meshCacheVertices(header) + vertexSize(header->vertexFormat) * v;
+    vec3 p;
+    if (header->vertexFormat == floatPositions) {
+        packedVertexFloat packed;
+        memcpy(&packed, vertex, sizeof(packed));
+        p = vec3(packed.position[0], packed.position[1], packed.position[2]);
+    } else {
+        packedVertex packed;
+        memcpy(&packed, vertex, sizeof(packed));
+        for (int i = 0; i < 3; i++)
+            p[i] = std::max(packed.position[i] / 32767.0f, -1.0f);
+    }
+    return p * header->posScale + vec3(header->posOffset[0], header->posOffset[1], header->posOffset[2]);
+}
+
+// Copy the triangles of a mesh to draw as an occluder: its coarsest level of
+// detail that strays no more than occluderMaxError from the full mesh, since
+// a cruder one could poke out past it and hide things that should be seen.
+void makeOccluderMesh(const meshCacheHeader *header, occluderMesh *occluder) {
+    GLuint lod = 0;
+    for (GLuint i = 1; i < header->nLods; i++)
+        if (header->lodError[i] <= occluderMaxError * header->radius) lod = i;
+    size_t first = 0;
+    for (GLuint i = 0; i < lod; i++)
+        first += header->lodIndexCount[i];
+
+    // Keep only the vertices that level uses
+    std::vector<GLuint> remap(header->nVertices, ~0u);
+    const GLubyte *indices = meshCacheIndices(header);
+    occluder->positions.clear();
+    occluder->indices.resize(header->lodIndexCount[lod]);
+    for (GLuint i = 0; i < header->lodIndexCount[lod]; i++) {
+        GLuint v = header->indexSize == sizeof(GLushort) ? ((const GLushort *) indices)[first + i]
+                                                         : ((const GLuint *) indices)[first + i];
+        if (remap[v] == ~0u) {
+            remap[v] = occluder->positions.size();
+            occluder->positions.push_back(meshCachePosition(header, v));
+        }
+        occluder->indices[i] = remap[v];
+    }
+}
+
+// Choose which of n objects to draw as occluders, from how big each looks
+// (its radius over its distance, or 0 if it can't be one).  Fills chosen with
+// their indices and returns how many there are.
+int pickOccluders(const float *screenSize, int n, int *chosen) {
+    int nChosen = 0;
+    for (int i = 0; i < n; i++) {
+        if (screenSize[i] < minOccluderSize) continue;
+        if (nChosen == maxOccluders) {
+            if (screenSize[chosen[nChosen - 1]] >= screenSize[i]) continue;
+            nChosen--; // Make room by dropping the smallest
+        }
+        // Insert it in the list, which is kept largest first
+        int j = nChosen++;
+        for (; j > 0 && screenSize[chosen[j - 1]] < screenSize[i]; j--)
+            chosen[j] = chosen[j - 1];
+        chosen[j] = i;
+    }
+    return nChosen;
+}
+
+//------Rasterizing-------------------------------------------------------------
+
+// Start a frame's occlusion buffer.
+void clearOcclusion(occlusionBuffer *ob, const mat4 &viewProjection) {
+    ob->viewProjection = viewProjection;
+    ob->triangles.clear();
+    ob->levels[0].assign(occlusionWidth * occlusionHeight, 0.0f);
+}
+
+// Work out a clip space triangle's edges and depth on screen.  It must be
+// entirely in front of the near plane.
+static void setupOccluderTriangle(occlusionBuffer *ob, const vec4 &a, const vec4 &b, const vec4 &c) {
+    const vec4 *v[3] = {&a, &b, &c};
+    float x[3], y[3], invW[3];
+    for (int i = 0; i < 3; i++) {
+        invW[i] = 1.0f / v[i]->w;
+        x[i] = (v[i]->x * invW[i] * 0.5f + 0.5f) * occlusionWidth;
+        y[i] = (v[i]->y * invW[i] * 0.5f + 0.5f) * occlusionHeight;
+    }
+
+    // Turn it counterclockwise, so inside is positive whichever way it faces
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (area == 0.0f) return;
+    if (area < 0.0f) {
+        std::swap(x[1], x[2]);
+        std::swap(y[1], y[2]);
+        std::swap(invW[1], invW[2]);
+        area = -area;
+    }
+
+    // Pixels are sampled at their centres
+    occluderTriangle t;
+    t.minX = std::max(0, -pixelFloor(0.5f - std::min(x[0], std::min(x[1], x[2])), occlusionWidth));
+    t.maxX = std::min(occlusionWidth - 1, pixelFloor(std::max(x[0], std::max(x[1], x[2])) - 0.5f, occlusionWidth));
+    t.minY = std::max(0, -pixelFloor(0.5f - std::min(y[0], std::min(y[1], y[2])), occlusionHeight));
+    t.maxY = std::min(occlusionHeight - 1, pixelFloor(std::max(y[0], std::max(y[1], y[2])) - 0.5f, occlusionHeight));
+    if (t.minX > t.maxX || t.minY > t.maxY) return;
+
+    for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        t.edgeA[i] = y[i] - y[j];
+        t.edgeB[i] = x[j] - x[i];
+        t.edgeC[i] = -t.edgeA[i] * x[i] - t.edgeB[i] * y[i] + 0.5f * (t.edgeA[i] + t.edgeB[i]);
+    }
+    t.depthA = ((invW[1] - invW[0]) * (y[2] - y[0]) - (invW[2] - invW[0]) * (y[1] - y[0])) / area;
+    t.depthB = ((invW[2] - invW[0]) * (x[1] - x[0]) - (invW[1] - invW[0]) * (x[2] - x[0])) / area;
+    t.depthC = invW[0] - t.depthA * x[0] - t.depthB * y[0] + 0.5f * (t.depthA + t.depthB);
+    ob->triangles.push_back(t);
+}
+
+// Add an object's occluder mesh, transformed by its model matrix.  Triangles
+// crossing the near plane are clipped to it; the screen edges are left to
+// the rasterizer.
+void addOccluder(occlusionBuffer *ob, const occluderMesh &mesh, const mat4 &model) {
+    mat4 m = ob->viewProjection * model;
+    ob->clipped.resize(mesh.positions.size());
+    for (size_t i = 0; i < mesh.positions.size(); i++)
+        ob->clipped[i] = m * vec4(mesh.positions[i], 1.0);
+
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        vec4 in[3], out[4];
+        int nFront = 0, nOut = 0;
+        for (int j = 0; j < 3; j++) {
+            in[j] = ob->clipped[mesh.indices[i + j]];
+            if (in[j].z + in[j].w >= 0.0f) nFront++;
+        }
+        if (nFront == 0) continue;
+        if (nFront == 3) {
+            setupOccluderTriangle(ob, in[0], in[1], in[2]);
+            continue;
+        }
+        for (int j = 0; j < 3; j++) {
+            const vec4 &p = in[j], &q = in[(j + 1) % 3];
+            float dp = p.z + p.w, dq = q.z + q.w;
+            if (dp >= 0.0f) out[nOut++] = p;
+            if ((dp >= 0.0f) != (dq >= 0.0f))
+                out[nOut++] = p + (q - p) * (dp / (dp - dq));
+        }
+        for (int j = 2; j < nOut; j++)
+            setupOccluderTriangle(ob, out[0], out[j - 1], out[j]);
+    }
+}
+
+// Draw every triangle's part of rows y0 to y1 - 1 into level 0.
+static void rasterizeOcclusionBand(occlusionBuffer *ob, int y0, int y1) {
+    float *depth = ob->levels[0].data();
+    for (size_t i = 0; i < ob->triangles.size(); i++) {
+        const occluderTriangle &t = ob->triangles[i];
+        int yStart = std::max(t.minY, y0), yEnd = std::min(t.maxY, y1 - 1);
+        int xStart = t.minX & ~3; // Whole groups of four, which stay on the row
+        for (int y = yStart; y <= yEnd; y++) {
+            float *row = depth + y * occlusionWidth;
+#ifdef OCCLUSION_SSE
+            __m128 lanes = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+            __m128 edge[3], edgeStep[3];
+            for (int e = 0; e < 3; e++) {
+                edge[e] = _mm_add_ps(_mm_set1_ps(t.edgeA[e] * xStart + t.edgeB[e] * y + t.edgeC[e]),
+                                     _mm_mul_ps(_mm_set1_ps(t.edgeA[e]), lanes));
+                edgeStep[e] = _mm_set1_ps(t.edgeA[e] * 4.0f);
+            }
+            __m128 z = _mm_add_ps(_mm_set1_ps(t.depthA * xStart + t.depthB * y + t.depthC),
+                                  _mm_mul_ps(_mm_set1_ps(t.depthA), lanes));
+            __m128 zStep = _mm_set1_ps(t.depthA * 4.0f), zero = _mm_setzero_ps();
+            for (int x = xStart; x <= t.maxX; x += 4) {
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(edge[0], zero), _mm_cmpge_ps(edge[1], zero)),
+                                           _mm_cmpge_ps(edge[2], zero));
+                if (_mm_movemask_ps(inside) != 0) {
+                    __m128 old = _mm_loadu_ps(row + x);
+                    __m128 nearer = _mm_max_ps(old, z);
+                    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+                }
+                for (int e = 0; e < 3; e++)
+                    edge[e] = _mm_add_ps(edge[e], edgeStep[e]);
+                z = _mm_add_ps(z, zStep);
+            }
+#else
+            for (int x = xStart; x <= t.maxX; x++) {
+                bool inside = true;
+                for (int e = 0; e < 3; e++)
+                    inside = inside && t.edgeA[e] * x + t.edgeB[e] * y + t.edgeC[e] >= 0.0f;
+                if (inside) row[x] = std::max(row[x], t.depthA * x + t.depthB * y + t.depthC);
+            }
+#endif
+        }
+    }
+}
+
+// Build each level of the pyramid from the one below, keeping the farthest.
+static void buildOcclusionPyramid(occlusionBuffer *ob) {
+    for (int level = 1; level < occlusionLevels; level++) {
+        int width = occlusionLevelWidth(level), height = occlusionLevelHeight(level);
+        int belowWidth = occlusionLevelWidth(level - 1), belowHeight = occlusionLevelHeight(level - 1);
+        const float *below = ob->levels[level - 1].data();
+        ob->levels[level].resize(width * height);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++) {
+                int x0 = std::min(2 * x, belowWidth - 1), x1 = std::min(2 * x + 1, belowWidth - 1);
+                int y0 = std::min(2 * y, belowHeight - 1), y1 = std::min(2 * y + 1, belowHeight - 1);
+                ob->levels[level][y * width + x] = std::min(std::min(below[y0 * belowWidth + x0], below[y0 * belowWidth + x1]),
+                                                            std::min(below[y1 * belowWidth + x0], below[y1 * belowWidth + x1]));
+            }
+    }
+}
+
+// Draw the occluders added since clearOcclusion, spread over the workers, and
+// build the pyramid for boxOccluded.
+void rasterizeOccluders(occlusionBuffer *ob) {
+    const int rowsPerBand = occlusionHeight / occlusionBands;
+    parallelFor(occlusionBands, [ob, rowsPerBand](int band) {
+        rasterizeOcclusionBand(ob, band * rowsPerBand, (band + 1) * rowsPerBand);
+    });
+    buildOcclusionPyramid(ob);
+}
+
+//------Testing-----------------------------------------------------------------
+
+// Test a model space box transformed by model.  Returns true only if it's
+// certainly hidden: boxes reaching in front of the near plane never are.
+bool boxOccluded(const occlusionBuffer *ob, const mat4 &model, const vec3 &boxMin, const vec3 &boxMax) {
+    mat4 m = ob->viewProjection * model;
+    float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f, nearest = 0.0f;
+    for (int corner = 0; corner < 8; corner++) {
+        vec4 p = m * vec4(corner & 1 ? boxMax.x : boxMin.x, corner & 2 ? boxMax.y : boxMin.y,
+                          corner & 4 ? boxMax.z : boxMin.z, 1.0);
+        if (p.z + p.w < 0.0f) return false;
+        float invW = 1.0f / p.w;
+        float x = (p.x * invW * 0.5f + 0.5f) * occlusionWidth, y = (p.y * invW * 0.5f + 0.5f) * occlusionHeight;
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+        nearest = std::max(nearest, invW);
+    }
+
+    // Every pixel the box touches, on screen
+    int x0 = std::max(0, pixelFloor(minX, occlusionWidth));
+    int x1 = std::min(occlusionWidth - 1, pixelFloor(maxX, occlusionWidth));
+    int y0 = std::max(0, pixelFloor(minY, occlusionHeight));
+    int y1 = std::min(occlusionHeight - 1, pixelFloor(maxY, occlusionHeight));
+    if (x0 > x1 || y0 > y1) return false;
+
+    // The finest level where they're within 2 x 2 texels
+    int level = 0;
+    while (level < occlusionLevels - 1 && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+        level++;
+    int width = occlusionLevelWidth(level);
+    for (int y = y0 >> level; y <= y1 >> level; y++)
+        for (int x = x0 >> level; x <= x1 >> level; x++)
+            if (ob->levels[level][y * width + x] <= nearest) return false;
+    return true;
+}
+
+//------Benchmark---------------------------------------------------------------
+
+// Time occlusion culling a grid of models seen from just above the ground
+// (for --bench-occlusion), taking the best of a few runs.  Needs no window.
+void benchmarkOcclusion() {
+    const int gridSize = 16, runs = 20;
+    std::vector<occluderMesh> occluders;
+    std::vector<vec3> boundsMin, boundsMax;
+    std::vector<float> radius;
+    for (int meshNumber = 1; meshNumber < numMeshes && (int) occluders.size() < gridSize; meshNumber++) {
+        mappedFile baked;
+        std::vector<GLubyte> blob;
+        const meshCacheHeader *header = NULL;
+        baked.data = NULL;
+        if (mapBakedMesh(meshNumber, &baked)) header = (const meshCacheHeader *) baked.data;
+        else if (bakeMesh(meshNumber, blob)) header = (const meshCacheHeader *) blob.data();
+        if (header == NULL) continue;
+
+        occluders.push_back(occluderMesh());
+        makeOccluderMesh(header, &occluders.back());
+        boundsMin.push_back(vec3(header->boundsMin[0], header->boundsMin[1], header->boundsMin[2]));
+        boundsMax.push_back(vec3(header->boundsMax[0], header->boundsMax[1], header->boundsMax[2]));
+        radius.push_back(header->radius);
+        unmapFile(&baked);
+    }
+    if (occluders.empty()) {
+        printf("No models to test with\n");
+        return;
+    }
+
+    // Models about 2 units across, 1.5 apart, in rows going away from the camera
+    int nObjects = gridSize * gridSize;
+    std::vector<mat4> models(nObjects);
+    std::vector<int> objectMesh(nObjects);
+    mat4 view = Translate(0.0, -1.0, -3.0);
+    mat4 projection = Perspective(60.0, 2.0, 0.1, 100.0);
+    std::vector<float> screenSize(nObjects);
+    for (int i = 0; i < nObjects; i++) {
+        int mesh = objectMesh[i] = i % occluders.size();
+        vec3 centre = (boundsMin[mesh] + boundsMax[mesh]) * 0.5;
+        vec3 loc((i % gridSize - gridSize / 2) * 1.5, 1.0, -(i / gridSize) * 1.5);
+        models[i] = Translate(loc) * Scale(1.0 / radius[mesh]) * Translate(-centre);
+        screenSize[i] = 1.0 / std::max(-(view * vec4(loc, 1.0)).z, 1e-3f);
+    }
+
+    // Only objects in view can be occluders, as in cullObjects
+    frustum f = frustumFromMatrix(projection * view);
+    int nInView = 0;
+    for (int i = 0; i < nObjects; i++) {
+        if (boxOutsideFrustum(f, models[i], boundsMin[objectMesh[i]], boundsMax[objectMesh[i]]))
+            screenSize[i] = 0.0;
+        else
+            nInView++;
+    }
+    int chosen[maxOccluders];
+    int nChosen = pickOccluders(screenSize.data(), nObjects, chosen);
+
+    occlusionBuffer ob;
+    double best[3] = {1e30, 1e30, 1e30};
+    int nOccluded = 0;
+    for (int run = 0; run < runs; run++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        clearOcclusion(&ob, projection * view);
+        for (int i = 0; i < nChosen; i++)
+            addOccluder(&ob, occluders[objectMesh[chosen[i]]], models[chosen[i]]);
+        std::chrono::steady_clock::time_point setUp = std::chrono::steady_clock::now();
+        rasterizeOccluders(&ob);
+        std::chrono::steady_clock::time_point rasterized = std::chrono::steady_clock::now();
+        nOccluded = 0;
+        for (int i = 0; i < nObjects; i++)
+            if (boxOccluded(&ob, models[i], boundsMin[objectMesh[i]], boundsMax[objectMesh[i]])) nOccluded++;
+        std::chrono::steady_clock::time_point tested = std::chrono::steady_clock::now();
+
+        std::chrono::duration<double, std::milli> times[3] = {setUp - start, rasterized - setUp, tested - rasterized};
+        for (int j = 0; j < 3; j++)
+            best[j] = std::min(best[j], times[j].count());
+    }
+    printf("%d occluders, %zu triangles on screen: set up %.3f ms, rasterize %.3f ms, test %d boxes %.3f ms\n",
+           nChosen, ob.triangles.size(), best[0], best[1], nObjects, best[2]);
+    printf("%d of the %d objects in view occluded\n", nOccluded, nInView);
+}
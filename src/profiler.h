@@ -0,0 +1,218 @@
+// Frame profiler (profiler.h)
+//
+// The frames per second in the title bar say how fast frames are, but not
+// where the time goes.  With --profile or --trace, display marks the start of
+// each phase of a frame (loading, the view, the lights, culling, queueing the
+// objects, drawing the shadow maps, drawing, lighting the G-buffer with
+// --deferred, and the buffer swap) with profilePhase, which times it on the CPU and, with a
+// GL_TIME_ELAPSED query, on the GPU.  The phases follow one another rather
+// than nesting, since only one elapsed time query can be running at once.
+//
+// Reading a query's result straight away would stall until the GPU caught up,
+// so there are two sets of queries used on alternate frames, and each set's
+// results are collected just before it's reused, two frames later.  If one
+// still isn't ready then its sample is dropped rather than waited for.
+//
+// Each phase keeps its last profileWindow samples, and once a second timer
+// writes their 50th, 95th and 99th percentiles to the --profile CSV file.
+// --trace writes every phase of every frame as Chrome trace JSON, to load
+// into chrome://tracing or Perfetto.
+
+enum {
+    phaseLoads,   // Uploading meshes and textures from the workers, and evicting
+    phaseView,    // Clearing and setting the view
+    phaseLights,  // Filling in the lights, and their clusters or volumes
+    phaseCulling, // Frustum and occlusion culling
+    phaseObjects, // Choosing levels of detail and queueing each object
+    phaseShadows, // Bringing the shadow maps up to date (see shadows.h)
+    phaseDraws,   // Uploading the instances and issuing the draws
+    phaseShading, // Drawing the light volumes, with --deferred (see deferred.h)
+    phaseSwap,
+    numProfilePhases,
+    phaseNone = numProfilePhases
+};
+
+const char *profilePhaseNames[numProfilePhases + 1] = {"loads", "view", "lights", "culling", "objects",
+                                                       "shadows", "draws", "shading", "swap", "frame"};
+const int profileWindow = 256; // Frames that the percentiles are over
+
+typedef struct {
+    float ms[profileWindow];
+    int count; // Up to profileWindow
+    int next;  // Where the next one goes
+} rollingSamples;
+
+bool profiling = false;       // Set by --profile or --trace
+bool haveTimerQueries = false;
+FILE *profileCsv = NULL;
+FILE *profileTrace = NULL;
+bool traceEventWritten = false; // So the next one needs a comma before it
+int numGpuSamplesDropped = 0;
+
+// The last entry of each is for the whole frame.
+rollingSamples cpuSamples[numProfilePhases + 1];
+rollingSamples gpuSamples[numProfilePhases + 1];
+
+// Two sets of queries, used on alternate frames.  The CPU start times are kept
+// for the trace until the GPU times come back.
+GLuint phaseQueries[2][numProfilePhases];
+bool phaseQueried[2][numProfilePhases];
+double phaseStartUs[2][numProfilePhases];
+
+std::chrono::steady_clock::time_point profileStart;
+long long profileFrame = 0;
+int currentPhase = phaseNone;
+double currentPhaseStartUs, frameStartUs;
+
+static double profileMicroseconds() {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - profileStart).count();
+}
+
+static void addSample(rollingSamples *samples, double ms) {
+    samples->ms[samples->next] = ms;
+    samples->next = (samples->next + 1) % profileWindow;
+    samples->count = std::min(samples->count + 1, profileWindow);
+}
+
+// The given percentile (nearest rank) of the samples, which mustn't be empty.
+static float samplePercentile(const rollingSamples *samples, double percent) {
+    float sorted[profileWindow];
+    std::copy(samples->ms, samples->ms + samples->count, sorted);
+    std::sort(sorted, sorted + samples->count);
+    int rank = (int) ceil(percent / 100.0 * samples->count);
+    return sorted[std::max(rank, 1) - 1];
+}
+
+static void writeTraceEvent(const char *name, const char *category, int thread, double startUs, double us) {
+    if (profileTrace == NULL) return;
+    fprintf(profileTrace, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                          "\"ts\":%.1f,\"dur\":%.1f}",
+            traceEventWritten ? ",\n" : "", name, category, thread, startUs, us);
+    traceEventWritten = true;
+}
+
+//------Setting up and finishing------------------------------------------------
+
+// Called from main, for --profile and --trace, before there's a GL context.
+void openProfileFiles(const char *csvName, const char *traceName) {
+    if (csvName != NULL) {
+        profileCsv = fopen(csvName, "w");
+        if (profileCsv == NULL) fail("Error - couldn't write the profile file:", (char *) csvName);
+        fprintf(profileCsv, "seconds,phase,samples,cpu_p50_ms,cpu_p95_ms,cpu_p99_ms,gpu_p50_ms,gpu_p95_ms,gpu_p99_ms\n");
+    }
+    if (traceName != NULL) {
+        profileTrace = fopen(traceName, "w");
+        if (profileTrace == NULL) fail("Error - couldn't write the trace file:", (char *) traceName);
+        fprintf(profileTrace, "[\n");
+    }
+    profiling = profileCsv != NULL || profileTrace != NULL;
+    profileStart = std::chrono::steady_clock::now();
+}
+
+// Finish off the files (at exit, so quitting from the menu or keyboard works).
+static void closeProfileFiles() {
+    if (profileCsv != NULL) fclose(profileCsv);
+    if (profileTrace != NULL) {
+        fprintf(profileTrace, "\n]\n");
+        fclose(profileTrace);
+    }
+    profileCsv = profileTrace = NULL;
+    if (numGpuSamplesDropped > 0)
+        printf("%d GPU times weren't ready in time, and were left out of the profile\n", numGpuSamplesDropped);
+}
+
+// Called from init, once there's a GL context.
+void initProfiler() {
+    if (!profiling) return;
+#ifndef __APPLE__
+    haveTimerQueries = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+#endif
+    if (haveTimerQueries) glGenQueries(2 * numProfilePhases, &phaseQueries[0][0]);
+    else printf("Warning - no timer queries, so only CPU times will be profiled\n");
+    CheckError();
+    atexit(closeProfileFiles);
+}
+
+//------Timing the phases-------------------------------------------------------
+
+// Collect the GPU times from the set of queries about to be reused.
+static void collectGpuTimes(int set) {
+    double frameMs = 0.0, nowUs = profileMicroseconds();
+    bool complete = true;
+    for (int phase = 0; phase < numProfilePhases; phase++) {
+        if (!phaseQueried[set][phase]) continue;
+        phaseQueried[set][phase] = false;
+        GLint available = 0;
+        glGetQueryObjectiv(phaseQueries[set][phase], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            numGpuSamplesDropped++;
+            complete = false;
+            continue;
+        }
+        GLuint64 ns;
+        glGetQueryObjectui64v(phaseQueries[set][phase], GL_QUERY_RESULT, &ns);
+        if (ns / 1e3 > nowUs - phaseStartUs[set][phase]) { // Impossible, as Mesa's llvmpipe gives for its first
+            numGpuSamplesDropped++;
+            complete = false;
+            continue;
+        }
+        addSample(&gpuSamples[phase], ns / 1e6);
+        frameMs += ns / 1e6;
+        // Only durations are measured, so the trace shows each where its commands were issued
+        writeTraceEvent(profilePhaseNames[phase], "gpu", 2, phaseStartUs[set][phase], ns / 1e3);
+    }
+    if (complete && frameMs > 0.0) addSample(&gpuSamples[numProfilePhases], frameMs);
+}
+
+static void endPhase() {
+    if (currentPhase == phaseNone) return;
+    double endUs = profileMicroseconds();
+    addSample(&cpuSamples[currentPhase], (endUs - currentPhaseStartUs) / 1e3);
+    writeTraceEvent(profilePhaseNames[currentPhase], "cpu", 1, currentPhaseStartUs, endUs - currentPhaseStartUs);
+    if (phaseQueried[profileFrame % 2][currentPhase]) glEndQuery(GL_TIME_ELAPSED);
+    currentPhase = phaseNone;
+}
+
+// End the current phase of the frame, if any, and start timing the given one.
+void profilePhase(int phase) {
+    if (!profiling) return;
+    endPhase();
+    int set = profileFrame % 2;
+    currentPhaseStartUs = profileMicroseconds();
+    if (phase == phaseLoads) { // The first of the frame
+        frameStartUs = currentPhaseStartUs;
+        if (haveTimerQueries) collectGpuTimes(set);
+    }
+    currentPhase = phase;
+    phaseStartUs[set][phase] = currentPhaseStartUs;
+    if (haveTimerQueries && phase != phaseSwap) { // The GPU's time for the swap isn't meaningful
+        glBeginQuery(GL_TIME_ELAPSED, phaseQueries[set][phase]);
+        phaseQueried[set][phase] = true;
+    }
+}
+
+// Called once the frame is finished.
+void endProfiledFrame() {
+    if (!profiling) return;
+    endPhase();
+    double endUs = profileMicroseconds();
+    addSample(&cpuSamples[numProfilePhases], (endUs - frameStartUs) / 1e3);
+    writeTraceEvent("frame", "cpu", 0, frameStartUs, endUs - frameStartUs);
+    profileFrame++;
+}
+
+// Write the current percentiles to the CSV file (from timer, once a second).
+void writeProfilePercentiles() {
+    if (profileCsv == NULL) return;
+    double seconds = profileMicroseconds() / 1e6;
+    for (int phase = 0; phase <= numProfilePhases; phase++) {
+        const rollingSamples *cpu = &cpuSamples[phase], *gpu = &gpuSamples[phase];
+        if (cpu->count == 0) continue;
+        fprintf(profileCsv, "%.3f,%s,%d,%.4f,%.4f,%.4f", seconds, profilePhaseNames[phase], cpu->count,
+                samplePercentile(cpu, 50), samplePercentile(cpu, 95), samplePercentile(cpu, 99));
+        if (gpu->count == 0) fprintf(profileCsv, ",,,\n");
+        else fprintf(profileCsv, ",%.4f,%.4f,%.4f\n", samplePercentile(gpu, 50), samplePercentile(gpu, 95),
+                     samplePercentile(gpu, 99));
+    }
+    fflush(profileCsv);
+}
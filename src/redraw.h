@@ -0,0 +1,73 @@
+// Redrawing only when something changes (redraw.h)
+//
+// Redrawing flat out from the idle callback keeps a core busy even while the
+// scene sits still.  Instead the state that affects a frame (the camera, the
+// objects, the window size, ...) is registered with watchForChanges, and a
+// timer compares it against a copy taken after the last frame drawn.  Only if
+// it differs, or something is still loading, is a redisplay posted.  So edits
+// made anywhere (menus, keys, the mouse tools) are picked up without each one
+// having to remember to ask for a redraw, though callbacks that already call
+// glutPostRedisplay still get a frame straight away.
+//
+// With a frame rate cap (--max-fps), display waits for each frame's slot:
+// sleeping until just before it, then spinning the rest, since sleeps alone
+// can overshoot by a millisecond or more.
+
+#include <chrono>
+
+typedef struct {
+    const void *data;
+    size_t size;
+    std::vector<GLubyte> copy; // As it was when the last frame was drawn
+} watchedRegion;
+
+std::vector<watchedRegion> watchedRegions;
+
+bool alwaysRedraw = false;    // --always-redraw draws continuously, as before
+int maxFramesPerSecond = 0;   // Set with --max-fps; 0 for no cap
+const int redrawCheckRate = 60; // Checks for changes a second, when there's no cap
+int numFramesSkipped = 0;     // Checks since the last timer call that found nothing to draw
+
+// Redraw whenever the size bytes at data change.
+void watchForChanges(const void *data, size_t size) {
+    watchedRegion region;
+    region.data = data;
+    region.size = size;
+    region.copy.assign((const GLubyte *) data, (const GLubyte *) data + size);
+    watchedRegions.push_back(region);
+}
+
+bool watchedRegionsChanged() {
+    for (size_t i = 0; i < watchedRegions.size(); i++)
+        if (memcmp(watchedRegions[i].data, watchedRegions[i].copy.data(), watchedRegions[i].size) != 0)
+            return true;
+    return false;
+}
+
+// Call after drawing a frame, so that later changes can be noticed.
+void snapshotWatchedRegions() {
+    for (size_t i = 0; i < watchedRegions.size(); i++)
+        memcpy(watchedRegions[i].copy.data(), watchedRegions[i].data, watchedRegions[i].size);
+}
+
+// Milliseconds between checks for changes.
+int redrawCheckInterval() {
+    return 1000 / (maxFramesPerSecond > 0 ? maxFramesPerSecond : redrawCheckRate);
+}
+
+// Wait until it's time for the next frame, under the frame rate cap.
+void waitForFrameSlot() {
+    static std::chrono::steady_clock::time_point nextFrame = std::chrono::steady_clock::now();
+    if (maxFramesPerSecond <= 0) return;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now < nextFrame) {
+        std::chrono::steady_clock::time_point wakeUp = nextFrame - std::chrono::milliseconds(2);
+        if (now < wakeUp) std::this_thread::sleep_until(wakeUp);
+        while (std::chrono::steady_clock::now() < nextFrame)
+            std::this_thread::yield();
+        now = nextFrame;
+    }
+    // After a slow frame, start again from now rather than rushing to catch up
+    nextFrame = std::max(nextFrame, now) + std::chrono::microseconds(1000000 / maxFramesPerSecond);
+}
@@ -0,0 +1,56 @@
+// Render queue sort keys (renderqueue.h)
+//
+// Every draw gets a 64 bit key holding the state it needs, most expensive to
+// change first, with its distance from the camera in the low bits:
+//
+//   63..60 program   59..48 texture   47..34 mesh   33..32 level of detail   31..0 depth
+//
+// Sorting the keys puts draws needing the same state next to each other, so
+// each change of state happens once per run, and within a run they go front
+// to back so that early depth testing can throw away hidden fragments.  The
+// depth is the bit pattern of a non-negative float, which sorts the same way
+// as the float does.
+
+typedef struct {
+    unsigned long long key;
+    GLuint item; // Index of the draw the key belongs to
+} sortKey;
+
+const int sortKeyStateShift = 32; // Keys with the same bits from here up can be drawn together
+
+unsigned long long makeSortKey(int program, int texture, int mesh, int lod, float depth) {
+    GLuint depthBits;
+    depth = std::max(depth, 0.0f);
+    memcpy(&depthBits, &depth, sizeof(depthBits));
+    return (unsigned long long) (program & 0xf) << 60 | (unsigned long long) (texture & 0xfff) << 48
+           | (unsigned long long) (mesh & 0x3fff) << 34 | (unsigned long long) (lod & 0x3) << 32
+           | depthBits;
+}
+
+// Least significant digit radix sort, a byte at a time.  Bytes that are the
+// same in every key (e.g., the program, while there's only one) are skipped,
+// so typical scenes take only a few passes.  scratch is just working space.
+void radixSortKeys(std::vector<sortKey> &keys, std::vector<sortKey> &scratch) {
+    size_t n = keys.size();
+    scratch.resize(n);
+    sortKey *from = keys.data(), *to = scratch.data();
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t counts[256] = {0};
+        for (size_t i = 0; i < n; i++)
+            counts[(from[i].key >> shift) & 0xff]++;
+        if (n == 0 || counts[(from[0].key >> shift) & 0xff] == n) continue;
+
+        size_t offset = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            size_t count = counts[digit];
+            counts[digit] = offset;
+            offset += count;
+        }
+        for (size_t i = 0; i < n; i++)
+            to[counts[(from[i].key >> shift) & 0xff]++] = from[i];
+        std::swap(from, to);
+    }
+
+    if (from != keys.data()) keys.swap(scratch);
+}
@@ -24,13 +24,82 @@ GLint windowHeight = 640, windowWidth = 960;
 // to modify (but, you can).
 #include "gnatidread.h"
 
+// Worker threads, so meshes can load without stalling the display.
+#include "threadpool.h"
+
+// Compact, quantized vertex layouts for the meshes.
+#include "vertexformat.h"
+
+// Simplified levels of detail for the bigger meshes.
+#include "meshsimplify.h"
+
+// Culling objects outside the view.
+#include "frustum.h"
+
+// Sort keys for ordering draws by state and depth.
+#include "renderqueue.h"
+
+// Shader attribute and uniform locations, looked up once.
+#include "shaderprogram.h"
+
+// A fast parser for the text .x models, with Assimp as the fallback.
+#include "xparser.h"
+
+// Baked binary copies of the processed meshes, so Assimp only runs once per model.
+#include "meshcache.h"
+
+// Filtering texture mipmaps on the CPU, in linear space, for the baker.
+#include "mipmaps.h"
+
+// Baked textures with their mipmaps, loaded straight from mapped files.
+#include "texturecache.h"
+
+// A persistently mapped buffer the workers copy textures into for upload.
+#include "uploadring.h"
+
+// Packing the textures into one texture array, for --texture-array.
+#include "texturearray.h"
+
+// Sub-allocating every mesh from a few shared vertex and index buffers.
+#include "geometrypool.h"
+
+// Hiding objects behind others, with a small depth buffer drawn on the CPU.
+#include "occlusion.h"
+
+// Only redrawing when something has changed, with an optional frame rate cap.
+#include "redraw.h"
+
+// Timing each phase of a frame on the CPU and GPU, for --profile and --trace.
+#include "profiler.h"
+
+// Drawing a fixed scene offscreen and timing it, for --bench.
+#include "benchmark.h"
+
+// Any number of lights, each only lighting the parts of the view it can reach.
+#include "lightclusters.h"
+
+// Lighting after the objects are drawn, from a G-buffer, for --deferred.
+#include "deferred.h"
+
+// Shadows from the first three lights, with their maps kept until something in them moves.
+#include "shadows.h"
+
+// Building the scene shaders as specialized variants, with their binaries cached.
+#include "shadervariants.h"
+
+// Model matrices kept until objects move, and the model-view matrices made all at once.
+#include "transforms.h"
+
 using namespace std;        // Import the C++ standard functions (e.g., min)
 
 
-// IDs for the GLSL program and GLSL variables.
-GLuint shaderProgram; // The number identifying the GLSL shader program
-GLuint vPosition, vNormal, vTexCoord; // IDs for vshader input vars (from glGetAttribLocation)
-GLuint projectionU, modelViewU; // IDs for uniform variables (from glGetUniformLocation)
+// The GLSL program, with the IDs for its variables (see shaderprogram.h).
+// shader is the variant of it used last (see shadervariants.h), and
+// programInUse is its program while it's still in use this frame.
+sceneShader shader;
+GLuint programInUse = 0;
+unsigned frameShaderVariant = 0; // The variant flags for this frame's draws, set by display
+GLuint lightsBuffer; // Holds the Lights uniform block
 
 static float viewDist = 1.5; // Distance from the camera to the centre of the scene
 static float camRotSidewaysDeg = 0; // rotates the camera sideways around the centre
@@ -43,16 +112,103 @@ mat4 view; // View matrix - set in the display function.
 char lab[] = "Project1";
 char *programName = NULL; // Set in main
 int numDisplayCalls = 0; // Used to calculate the number of frames per second
+int numTrianglesDrawn = 0; // In the last frame, which depends on the levels of detail used
+int numObjectsCulled = 0; // In the last frame, because they were outside the view or hidden
+int numObjectsOccluded = 0; // Those of them hidden behind other objects (see cullObjects)
+int numDrawCalls = 0; // In the last frame - objects sharing pools and a texture share a draw call
+int numBinds = 0, numBindsAvoided = 0; // Texture and VAO binds in the last frame, and those saved by sorting
+unsigned int frameNumber = 0; // Counts every frame, unlike numDisplayCalls
 
 //------Meshes----------------------------------------------------------------
-// Uses the type aiMesh from ../../assimp--3.0.1270/include/assimp/mesh.h
+// The mesh data itself lives in GL buffers; this is what we keep on the CPU side.
 //                           (numMeshes is defined in gnatidread.h)
-aiMesh *meshes[numMeshes]; // For each mesh we have a pointer to the mesh to draw
-GLuint vaoIDs[numMeshes]; // and a corresponding VAO ID from glGenVertexArrays
+enum meshState { meshNotLoaded, meshLoading, meshLoaded };
+
+typedef struct {
+    meshState state;
+    bool boundsKnown;
+    GLuint nLods;              // Levels of detail, including the full mesh
+    GLsizei lodIndexCount[maxMeshLods];
+    GLuint lodFirstIndex[maxMeshLods];  // Of each level, in its index pool
+    float lodError[maxMeshLods];        // In model units - see meshsimplify.h
+    vec3 posOffset;            // Undoes the position quantization - see vertexformat.h
+    float posScale;
+    vec3 boundsMin, boundsMax; // Axis aligned bounding box in model coordinates
+    vec3 centre;               // Bounding sphere
+    float radius;
+    GLuint pool;               // The vertex pool (i.e., vertex format) it's in
+    GLuint indexPool;          // And the index pool, for the size of its indices
+    GLuint firstVertex, nVertices, firstIndex, nIndices; // Its ranges of the pools, while loaded
+    size_t gpuBytes;           // The size of its ranges, while loaded
+    unsigned int lastDrawnFrame;
+} meshInfo;
+
+meshInfo meshes[numMeshes]; // For each mesh we have the details needed to draw it
+occluderMesh meshOccluders[numMeshes]; // and a coarse copy of it for occlusion culling, while loaded
+
+// The meshes' vertices, one buffer per vertex format, and their indices, one
+// buffer per index size (see geometrypool.h).  Meshes with fewer than 65536
+// vertices keep their GLushort indices.
+enum { shortIndices, intIndices };
+
+typedef struct {
+    GLenum type; // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    GLuint size; // Of each index, in bytes
+    GLuint buffer;
+    rangeAllocator indices;
+} indexPool;
+
+typedef struct {
+    GLuint vertexBuffer;
+    GLuint positionBuffer; // The same vertices' positions alone, for depth passes (see shadows.h)
+    GLuint vaos[2];        // Reading from vertexBuffer and each of indexPools
+    GLuint depthVaos[2];   // Likewise from positionBuffer
+    rangeAllocator vertices;
+} vertexPool;
+
+vertexPool vertexPools[2]; // Indexed by vertexFormat
+indexPool indexPools[2] = {{GL_UNSIGNED_SHORT, sizeof(GLushort)}, {GL_UNSIGNED_INT, sizeof(GLuint)}};
+const GLuint initialPoolVertices = 1 << 16, initialPoolIndices = 1 << 18; // Grown as needed
+
+// Use glMultiDrawElementsIndirect if the driver has it.  Turned off with --no-indirect.
+bool useMultiDrawIndirect = true;
+GLuint indirectBuffer;
+std::vector<drawIndirectCommand> drawCommands;
+
+// The most the pools' buffers grow to, making room by evicting the least
+// recently drawn meshes (see allocatePoolVertices and evictMeshes).  Set with
+// --mesh-budget.
+size_t meshBudgetBytes = 256 << 20;
+size_t meshBytesLoaded = 0; // Of the pools' space, in use by the loaded meshes
+int numMeshesEvicted = 0; // Ever, since a mesh is only evicted when the budget is short
+
+// What each instance of a mesh needs, in the layout of the per-instance
+// attributes in vStart.glsl.
+typedef struct {
+    GLfloat modelView[16];  // Column major, as a mat4 vertex attribute expects
+    GLfloat ambientProduct[3], diffuseProduct[3], specularProduct[3];
+    GLfloat shine, texScale;
+    GLfloat texLayer[2], texTile[3]; // See textureColor in fStart.glsl
+} instanceData;
+
+typedef struct {
+    unsigned long long key; // See renderqueue.h - the state bits are equal for objects drawn together
+    GLuint pool;            // Which of vertexPools the mesh is in
+    GLuint indexPool;       // And which of indexPools
+    GLsizei count;
+    GLuint firstIndex;      // In the index pool
+    GLint baseVertex;       // The mesh's first vertex in the pool
+    GLuint texture;         // placeholderTexture while the object's texture loads, 0 for textureArray
+    instanceData instance;
+} drawItem;
+
+std::vector<drawItem> drawItems; // Added to by drawMesh, drawn and cleared by drawBatches
+std::vector<instanceData> instances;
+std::vector<sortKey> drawOrder, sortScratch;
+GLuint instanceBuffer;
 
 // -----Textures--------------------------------------------------------------
 //                           (numTextures is defined in gnatidread.h)
-texture *textures[numTextures]; // An array of texture pointers - see gnatidread.h
 GLuint textureIDs[numTextures]; // Stores the IDs returned by glGenTextures
 
 //------Scene Objects---------------------------------------------------------
@@ -70,6 +226,9 @@ typedef struct {
     int meshId;
     int texId;
     float texScale;
+    int lod; // The level of detail drawn last frame (see chooseLod)
+    int light; // What kind of light the object is, if any (see lightType)
+    bool modelDirty; // loc, scale or angles changed since its objectModels entry was made (see cullObjects)
 } SceneObject;
 
 const int maxObjects = 1024; // Scenes with more than 1024 objects seem unlikely
@@ -79,108 +238,647 @@ int nObjects = 0;    // How many objects are currenly in the scene.
 int currObject = -1; // The current object
 int toolObj = -1;    // The object currently being modified
 
-//----------------------------------------------------------------------------
+//------Texture loading-------------------------------------------------------
 //
-// Loads a texture by number, and binds it for later use.
-void loadTextureIfNotAlreadyLoaded(int i) {
-    if (textures[i] != NULL) return; // The texture is already loaded.
+// Textures are loaded like meshes (see below): a worker thread maps the baked
+// file from the texture cache (see texturecache.h), baking it first if needed,
+// and copies it into textureUploads (see uploadring.h), so the display thread
+// only has to start the upload from there.  Before that copy the worker hands
+// back a preview, the levels of 16 x 16 and smaller, which goes into
+// previewTextureIDs and is drawn with until the whole texture is in.  Until
+// the preview arrives objects are drawn with placeholderTexture, a single
+// white texel.
+
+enum textureState { textureNotLoaded, textureLoading, texturePreviewed, textureLoaded };
+textureState textureStates[numTextures];
+GLuint previewTextureIDs[numTextures];
+GLuint placeholderTexture;
+bool haveTextureStorage; // glTexStorage2D (OpenGL 4.2 or ARB_texture_storage) is available
+uploadRing textureUploads;
+
+// With --texture-array, textures that fit go into textureArray instead, which
+// stays bound to texture unit 1 (see texturearray.h).
+bool useTextureArray = false;
+textureArrayLayout arrayLayout;
+GLuint textureArray;
+GLuint textureArrayBaseLevel[numTextures]; // The level a texture's level 0 went in at: above 0 for a preview
+const int textureArraySortSlot = 0xfff;    // The sort key texture slot for everything drawn from the array
+
+typedef struct textureLoadJob {
+    int textureNumber;
+    bool preview;                     // Only the smallest levels (see copySmallestLevels)
+    mappedFile baked;
+    std::vector<GLubyte> blob;        // Only used if there is no valid baked file, or for a preview
+    const textureCacheHeader *header; // Points into baked or blob, or NULL on failure
+    const GLubyte *uploadData;        // A copy of the whole file in textureUploads, or NULL
+    unsigned long long uploadRange;
+    struct textureLoadJob *next;
+} textureLoadJob;
+
+completionQueue<textureLoadJob> finishedTextureLoads;
+
+static textureLoadJob *newTextureLoadJob(int textureNumber) {
+    textureLoadJob *job = new textureLoadJob();
+    job->textureNumber = textureNumber;
+    job->preview = false;
+    job->baked.data = NULL;
+    job->header = NULL;
+    job->uploadData = NULL;
+    return job;
+}
+
+// Runs on a worker thread.
+static void loadTextureData(textureLoadJob *job) {
+    if (mapBakedTexture(job->textureNumber, &job->baked))
+        job->header = (const textureCacheHeader *) job->baked.data;
+    else if (bakeTexture(job->textureNumber, job->blob))
+        job->header = (const textureCacheHeader *) job->blob.data();
+    if (job->header == NULL) {
+        finishedTextureLoads.push(job);
+        return;
+    }
+
+    // The smallest levels are only a few kilobytes, so they can be shown well before the rest
+    textureLoadJob *preview = newTextureLoadJob(job->textureNumber);
+    preview->preview = true;
+    if (copySmallestLevels(job->header, previewSize, preview->blob)) {
+        preview->header = (const textureCacheHeader *) preview->blob.data();
+        finishedTextureLoads.push(preview);
+    } else
+        delete preview;
+
+    size_t size = textureCacheFileSize(job->header);
+    GLubyte *upload = allocateUpload(&textureUploads, size, &job->uploadRange);
+    if (upload != NULL) {
+        memcpy(upload, job->header, size);
+        job->uploadData = upload;
+    } else if (job->baked.data != NULL) {
+        // No room, so it's uploaded from the mapped file.  Page it in here rather
+        // than in glTexSubImage2D on the display thread.
+        volatile GLubyte sum = 0;
+        for (size_t i = 0; i < job->baked.size; i += 4096)
+            sum += job->baked.data[i];
+    }
+    finishedTextureLoads.push(job);
+}
+
+// Start loading a texture if it isn't already loaded or loading.
+// Returns how far it's got.
+textureState requestTexture(int textureNumber) {
+    if (textureNumber < 0 || textureNumber >= numTextures)
+        failInt("Error in loading texture - wrong texture number:", textureNumber);
+
+    if (textureStates[textureNumber] != textureNotLoaded) return textureStates[textureNumber];
+
+    textureStates[textureNumber] = textureLoading;
+    textureLoadJob *job = newTextureLoadJob(textureNumber);
+    queueWork([job] { loadTextureData(job); });
+    return textureLoading;
+}
 
-    textures[i] = loadTextureNum(i);
+static void setTextureParameters(GLenum target) {
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     CheckError();
+}
+
+// Whether a loaded texture (or preview) matches its place in textureArray.
+// It might not if the .bmp file changed after the layout was planned.
+static bool fitsTextureArray(const textureLoadJob *job) {
+    const textureCacheHeader *header = job->header;
+    const textureArraySlot *slot = &arrayLayout.slots[job->textureNumber];
+    if (slot->layer < 0 || header->width != header->height) return false;
+    return job->preview ? header->width < slot->size && slot->size % header->width == 0
+                        : header->width == slot->size;
+}
+
+// Copy a loaded texture's levels into its place in textureArray, from source.
+static void uploadToTextureArray(textureLoadJob *job, const GLubyte *source) {
+    const textureCacheHeader *header = job->header;
+    const textureArraySlot *slot = &arrayLayout.slots[job->textureNumber];
+    GLuint baseLevel = log2Size(slot->size / header->width);
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, textureArray);
+    for (GLuint level = 0; level < header->nLevels; level++) {
+        GLuint arrayLevel = baseLevel + level;
+        GLsizei size = mipLevelSize(header->width, level);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, arrayLevel, slot->x >> arrayLevel, slot->y >> arrayLevel,
+                        slot->layer, size, size, 1, GL_RGBA, GL_UNSIGNED_BYTE, source + header->levelOffset[level]);
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    textureArrayBaseLevel[job->textureNumber] = baseLevel;
+}
+
+// Copy a loaded texture's levels into its texture object, or its preview's,
+// or into textureArray.
+static void uploadTexture(textureLoadJob *job) {
+    const textureCacheHeader *header = job->header;
+    char fileName[256];
+    textureSourceFileName(job->textureNumber, fileName);
+    if (header == NULL) fail("Error loading image: ", fileName);
+
+    bool intoArray = useTextureArray && fitsTextureArray(job);
+    if (useTextureArray && !intoArray) {
+        if (job->preview && arrayLayout.slots[job->textureNumber].layer >= 0) {
+            return; // Only the whole texture can tell whether it still fits
+        }
+        arrayLayout.slots[job->textureNumber].layer = -1; // Give it its own texture object
+    }
+
+    textureStates[job->textureNumber] = job->preview ? texturePreviewed : textureLoaded;
     glActiveTexture(GL_TEXTURE0);
-    CheckError();
 
-    // Based on: http://www.opengl.org/wiki/Common_Mistakes
-    glBindTexture(GL_TEXTURE_2D, textureIDs[i]);
-    CheckError();
+    // With the copy in textureUploads bound, the level "pointers" are offsets into it
+    const GLubyte *source = (const GLubyte *) header;
+    if (job->uploadData != NULL) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, textureUploads.buffer);
+        source = (const GLubyte *) BUFFER_OFFSET(uploadOffset(&textureUploads, job->uploadData));
+    }
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, textures[i]->width, textures[i]->height,
-                 0, GL_RGB, GL_UNSIGNED_BYTE, textures[i]->rgbData);
-    CheckError();
-    glGenerateMipmap(GL_TEXTURE_2D);
-    CheckError();
+    if (intoArray) {
+        uploadToTextureArray(job, source);
+        if (job->uploadData != NULL) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            fenceUpload(&textureUploads, job->uploadRange);
+        }
+        CheckError();
+        return;
+    }
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    CheckError();
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    CheckError();
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    CheckError();
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    CheckError();
+    glBindTexture(GL_TEXTURE_2D, job->preview ? previewTextureIDs[job->textureNumber]
+                                              : textureIDs[job->textureNumber]);
+
+    // Immutable storage lets the driver allocate every level at once, up front
+#ifndef __APPLE__
+    if (haveTextureStorage)
+        glTexStorage2D(GL_TEXTURE_2D, header->nLevels, GL_RGBA8, header->width, header->height);
+#endif
+    for (GLuint level = 0; level < header->nLevels; level++) {
+        GLsizei width = mipLevelSize(header->width, level), height = mipLevelSize(header->height, level);
+        if (haveTextureStorage)
+            glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE,
+                            source + header->levelOffset[level]);
+        else
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                         source + header->levelOffset[level]);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, header->nLevels - 1);
+    setTextureParameters(GL_TEXTURE_2D);
 
+    if (job->uploadData != NULL) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        fenceUpload(&textureUploads, job->uploadRange); // Its space is reused once the copy is done
+    }
     glBindTexture(GL_TEXTURE_2D, 0);
     CheckError(); // Back to default texture
 }
 
+// Upload every texture the workers have finished loading since the last frame.
+void uploadFinishedTextures() {
+    reclaimUploads(&textureUploads);
+    textureLoadJob *job = finishedTextureLoads.takeAll();
+    while (job != NULL) {
+        textureLoadJob *next = job->next;
+        uploadTexture(job);
+        unmapFile(&job->baked);
+        delete job;
+        job = next;
+    }
+}
+
+static void makePlaceholderTexture() {
+    const GLubyte white[4] = {255, 255, 255, 255};
+    glGenTextures(1, &placeholderTexture);
+    glBindTexture(GL_TEXTURE_2D, placeholderTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    setTextureParameters(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Plan where each texture goes in textureArray from the .bmp headers, and
+// allocate it, bound to texture unit 1.
+static void makeTextureArray() {
+    GLuint widths[numTextures], heights[numTextures];
+    for (int i = 0; i < numTextures; i++) {
+        char fileName[256];
+        textureSourceFileName(i, fileName);
+        if (!readBitmapSize(fileName, &widths[i], &heights[i]))
+            widths[i] = heights[i] = 0; // Loading it will report the problem
+    }
+    planTextureArray(widths, heights, &arrayLayout);
+    GLsizei size = max(arrayLayout.size, 1u), nLayers = max(arrayLayout.nLayers, 1);
+
+    glGenTextures(1, &textureArray);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, textureArray);
+#ifndef __APPLE__
+    if (haveTextureStorage)
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, arrayLayout.nLevels, GL_RGBA8, size, size, nLayers);
+#endif
+    if (!haveTextureStorage)
+        for (GLuint level = 0; level < arrayLayout.nLevels; level++)
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGBA8, max(size >> level, 1), max(size >> level, 1),
+                         nLayers, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, arrayLayout.nLevels - 1);
+    setTextureParameters(GL_TEXTURE_2D_ARRAY);
+    glActiveTexture(GL_TEXTURE0);
+    CheckError();
+}
+
 //------Mesh loading----------------------------------------------------------
 //
-// The following uses the Open Asset Importer library via loadMesh in
-// gnatidread.h to load models in .x format, including vertex positions,
-// normals, and texture coordinates.
+// Meshes come from the baked mesh cache (see meshcache.h) when possible, and
+// otherwise from the .x file via readMeshData in meshcache.h, in which case
+// the result is baked for next time.  That all happens on a worker thread (see
+// threadpool.h); only the upload to GL buffers happens on the display thread,
+// in uploadFinishedMeshes.  Nothing is kept on the CPU side after that except
+// what's in meshInfo.  Until a mesh is uploaded, objects using it are drawn as
+// a box (see drawMesh).  Meshes evicted to keep within meshBudgetBytes go back
+// to meshNotLoaded, and are loaded again the same way the next time they're drawn.
 // You shouldn't need to modify this - it's called from drawMesh below.
 
-void loadMeshIfNotAlreadyLoaded(int meshNumber) {
-    if (meshNumber >= numMeshes || meshNumber < 0) {
-        printf("Error - no such model number");
-        exit(1);
-    }
+typedef struct meshLoadJob {
+    int meshNumber;
+    mappedFile baked;
+    std::vector<GLubyte> blob;     // Only used if there is no valid baked file
+    const meshCacheHeader *header; // Points into baked or blob, or NULL on failure
+    occluderMesh occluder;
+    struct meshLoadJob *next;
+} meshLoadJob;
 
-    if (meshes[meshNumber] != NULL)
-        return; // Already loaded
+completionQueue<meshLoadJob> finishedMeshLoads;
 
-    aiMesh *mesh = loadMesh(meshNumber);
-    meshes[meshNumber] = mesh;
+// Point vPosition at positions in the given format (see vertexformat.h) in the
+// bound buffer, stride bytes apart from offset.
+static void setPositionAttribute(GLuint format, GLsizei stride, size_t offset) {
+    // vPosition it actually 4D - the conversion sets the fourth dimension (i.e. w) to 1.0
+    if (format == floatPositions)
+        glVertexAttribPointer(shader.vPosition, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(offset));
+    else
+        glVertexAttribPointer(shader.vPosition, 3, GL_SHORT, GL_TRUE, stride, BUFFER_OFFSET(offset));
+    glEnableVertexAttribArray(shader.vPosition);
+}
+
+// Point all the vertex shader attributes at vertices in the given format in the bound buffer.
+static void setMeshVertexAttributes(GLuint format) {
+    GLsizei stride = vertexSize(format);
+    setPositionAttribute(format, stride, format == floatPositions ? offsetof(packedVertexFloat, position)
+                                                                  : offsetof(packedVertex, position));
+
+    size_t texCoordOffset = format == floatPositions ? offsetof(packedVertexFloat, texCoord)
+                                                     : offsetof(packedVertex, texCoord);
+    glVertexAttribPointer(shader.vTexCoord, 2, GL_HALF_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(texCoordOffset));
+    glEnableVertexAttribArray(shader.vTexCoord);
+
+    // The normal is octahedral encoded and decoded in the vertex shader
+    size_t normalOffset = format == floatPositions ? offsetof(packedVertexFloat, normal)
+                                                   : offsetof(packedVertex, normal);
+    glVertexAttribPointer(shader.vNormal, 2, GL_SHORT, GL_TRUE, stride, BUFFER_OFFSET(normalOffset));
+    glEnableVertexAttribArray(shader.vNormal);
+}
 
+static void setInstanceAttributes(size_t firstInstance);
+
+static void bindVertexArray(GLuint vao) {
 #ifdef __APPLE__
-    glBindVertexArrayAPPLE( vaoIDs[meshNumber] );
+    glBindVertexArrayAPPLE(vao);
 #else
-    glBindVertexArray(vaoIDs[meshNumber]);
+    glBindVertexArray(vao);
 #endif
+}
 
-    // Create and initialize a buffer object for positions and texture coordinates, initially empty.
-    // mesh->mTextureCoords[0] has space for up to 3 dimensions, but we only need 2.
-    GLuint buffer[1];
-    glGenBuffers(1, buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, buffer[0]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * (3 + 3 + 3) * mesh->mNumVertices,
-                 NULL, GL_STATIC_DRAW);
+static GLuint makeVertexArray() {
+    GLuint vao;
+#ifdef __APPLE__
+    glGenVertexArraysAPPLE(1, &vao);
+#else
+    glGenVertexArrays(1, &vao);
+#endif
+    bindVertexArray(vao);
+    return vao;
+}
+
+// Point a vertex pool's VAOs at its vertex and position buffers, e.g., after they've grown.
+static void setPoolVertexBuffer(GLuint format) {
+    vertexPool *pool = &vertexPools[format];
+    for (GLuint indices = shortIndices; indices <= intIndices; indices++) {
+        bindVertexArray(pool->vaos[indices]);
+        glBindBuffer(GL_ARRAY_BUFFER, pool->vertexBuffer);
+        setMeshVertexAttributes(format);
+        bindVertexArray(pool->depthVaos[indices]);
+        glBindBuffer(GL_ARRAY_BUFFER, pool->positionBuffer);
+        setPositionAttribute(format, positionSize(format), 0);
+    }
+}
 
-    int nVerts = mesh->mNumVertices;
-    // Next, we load the position and texCoord data in parts.
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float) * 3 * nVerts, mesh->mVertices);
-    glBufferSubData(GL_ARRAY_BUFFER, sizeof(float) * 3 * nVerts, sizeof(float) * 3 * nVerts, mesh->mTextureCoords[0]);
-    glBufferSubData(GL_ARRAY_BUFFER, sizeof(float) * 6 * nVerts, sizeof(float) * 3 * nVerts, mesh->mNormals);
+// The bytes a vertex takes in its pool, counting its copy of the position.
+static size_t poolVertexSize(GLuint format) {
+    return vertexSize(format) + positionSize(format);
+}
 
-    // Load the element index data
-    //GLuint elements[mesh->mNumFaces*3];
-    std::vector<GLuint> elements = std::vector<GLuint>(mesh->mNumFaces * 3, 0);
+// Likewise for the VAOs that read from an index pool.
+static void setPoolIndexBuffer(GLuint indices) {
+    for (GLuint format = snorm16Positions; format <= floatPositions; format++) {
+        bindVertexArray(vertexPools[format].vaos[indices]);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexPools[indices].buffer);
+        bindVertexArray(vertexPools[format].depthVaos[indices]);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexPools[indices].buffer);
+    }
+}
 
-    for (GLuint i = 0; i < mesh->mNumFaces; i++) {
-        elements[i * 3] = mesh->mFaces[i].mIndices[0];
-        elements[i * 3 + 1] = mesh->mFaces[i].mIndices[1];
-        elements[i * 3 + 2] = mesh->mFaces[i].mIndices[2];
+// Create the pools' buffers, and for each vertex format and index pool a VAO
+// that reads from them and instanceBuffer, and one that reads just the
+// positions and indices.
+static void makeGeometryPools() {
+    for (GLuint indices = shortIndices; indices <= intIndices; indices++) {
+        indexPool *pool = &indexPools[indices];
+        glGenBuffers(1, &pool->buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, pool->buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, initialPoolIndices * pool->size, NULL, GL_STATIC_DRAW);
+        initRanges(&pool->indices, initialPoolIndices);
     }
 
-    GLuint elementBufferId[1];
-    glGenBuffers(1, elementBufferId);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementBufferId[0]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * mesh->mNumFaces * 3, elements.data(), GL_STATIC_DRAW);
+    for (GLuint format = snorm16Positions; format <= floatPositions; format++) {
+        vertexPool *pool = &vertexPools[format];
+        glGenBuffers(1, &pool->vertexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, pool->vertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, initialPoolVertices * vertexSize(format), NULL, GL_STATIC_DRAW);
+        glGenBuffers(1, &pool->positionBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, pool->positionBuffer);
+        glBufferData(GL_ARRAY_BUFFER, initialPoolVertices * positionSize(format), NULL, GL_STATIC_DRAW);
+        initRanges(&pool->vertices, initialPoolVertices);
+        for (GLuint indices = shortIndices; indices <= intIndices; indices++) {
+            pool->vaos[indices] = makeVertexArray();
+            setInstanceAttributes(0); // Each draw's baseInstance picks out its instances
+            pool->depthVaos[indices] = makeVertexArray();
+        }
+        setPoolVertexBuffer(format);
+    }
+    for (GLuint indices = shortIndices; indices <= intIndices; indices++)
+        setPoolIndexBuffer(indices);
+    CheckError();
+}
 
-    // vPosition it actually 4D - the conversion sets the fourth dimension (i.e. w) to 1.0
-    glVertexAttribPointer(vPosition, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-    glEnableVertexAttribArray(vPosition);
-
-    // vTexCoord is actually 2D - the third dimension is ignored (it's always 0.0)
-    glVertexAttribPointer(vTexCoord, 3, GL_FLOAT, GL_FALSE, 0,
-                          BUFFER_OFFSET(sizeof(float) * 3 * mesh->mNumVertices));
-    glEnableVertexAttribArray(vTexCoord);
-    glVertexAttribPointer(vNormal, 3, GL_FLOAT, GL_FALSE, 0,
-                          BUFFER_OFFSET(sizeof(float) * 6 * mesh->mNumVertices));
-    glEnableVertexAttribArray(vNormal);
+// The size of all the pools' buffers, which is what counts against meshBudgetBytes.
+static size_t poolBytesAllocated() {
+    size_t bytes = 0;
+    for (GLuint indices = shortIndices; indices <= intIndices; indices++)
+        bytes += indexPools[indices].indices.capacity * indexPools[indices].size;
+    for (GLuint format = snorm16Positions; format <= floatPositions; format++)
+        bytes += vertexPools[format].vertices.capacity * poolVertexSize(format);
+    return bytes;
+}
+
+// Free the pool space of the least recently drawn mesh in the given vertex
+// pool and index pool, either of which can be -1 for any.  Meshes drawn in
+// the last frame are kept, as they'd only have to be loaded again straight
+// away.  Returns false if there's nothing to evict.
+static bool evictOldestMesh(int pool, int indices) {
+    int oldest = -1;
+    for (int i = 0; i < numMeshes; i++)
+        if (meshes[i].state == meshLoaded && meshes[i].lastDrawnFrame + 1 < frameNumber
+            && (pool < 0 || (int) meshes[i].pool == pool) && (indices < 0 || (int) meshes[i].indexPool == indices)
+            && (oldest < 0 || meshes[i].lastDrawnFrame < meshes[oldest].lastDrawnFrame))
+            oldest = i;
+    if (oldest < 0) return false;
+
+    meshInfo *mesh = &meshes[oldest];
+    freeRange(&vertexPools[mesh->pool].vertices, mesh->firstVertex, mesh->nVertices);
+    freeRange(&indexPools[mesh->indexPool].indices, mesh->firstIndex, mesh->nIndices);
+    meshOccluders[oldest] = occluderMesh();
+    meshBytesLoaded -= mesh->gpuBytes;
+    mesh->gpuBytes = 0;
+    mesh->state = meshNotLoaded; // The bounds are kept, for the placeholder
+    numMeshesEvicted++;
+    return true;
+}
+
+// The capacity to grow a pool to when length more elements of elementBytes
+// each won't fit: double, or as far as meshBudgetBytes allows, but always
+// enough for them.
+static GLuint grownCapacity(GLuint capacity, GLuint length, size_t elementBytes) {
+    size_t allocated = poolBytesAllocated();
+    size_t room = allocated < meshBudgetBytes ? (meshBudgetBytes - allocated) / elementBytes : 0;
+    return capacity + max((GLuint) min((size_t) capacity, room), length);
+}
+
+// Find room for nVertices in a vertex pool.  When there isn't any, the least
+// recently drawn meshes in it are evicted to make some before it's grown past
+// meshBudgetBytes, which only happens if what's left was all drawn last frame.
+static GLuint allocatePoolVertices(GLuint format, GLuint nVertices) {
+    vertexPool *pool = &vertexPools[format];
+    GLuint start;
+    while (!allocateRange(&pool->vertices, nVertices, &start)) {
+        if (poolBytesAllocated() + (size_t) nVertices * poolVertexSize(format) > meshBudgetBytes
+            && evictOldestMesh(format, -1))
+            continue;
+        GLuint capacity = grownCapacity(pool->vertices.capacity, nVertices, poolVertexSize(format));
+        pool->vertexBuffer = growBuffer(pool->vertexBuffer, pool->vertices.capacity * vertexSize(format),
+                                        capacity * vertexSize(format));
+        pool->positionBuffer = growBuffer(pool->positionBuffer, pool->vertices.capacity * positionSize(format),
+                                          capacity * positionSize(format));
+        growRanges(&pool->vertices, capacity);
+        setPoolVertexBuffer(format);
+    }
+    return start;
+}
+
+// Likewise for nIndices in an index pool.
+static GLuint allocatePoolIndices(GLuint indices, GLuint nIndices) {
+    indexPool *pool = &indexPools[indices];
+    GLuint start;
+    while (!allocateRange(&pool->indices, nIndices, &start)) {
+        if (poolBytesAllocated() + (size_t) nIndices * pool->size > meshBudgetBytes && evictOldestMesh(-1, indices))
+            continue;
+        GLuint capacity = grownCapacity(pool->indices.capacity, nIndices, pool->size);
+        pool->buffer = growBuffer(pool->buffer, pool->indices.capacity * pool->size, capacity * pool->size);
+        growRanges(&pool->indices, capacity);
+        setPoolIndexBuffer(indices);
+    }
+    return start;
+}
+
+// Copy vertices, and a packed copy of their positions, and indices (of the
+// index pool's type) into their ranges of the pools.
+static void uploadToPools(GLuint format, GLuint firstVertex, GLuint nVertices, const void *vertices,
+                          GLuint indices, GLuint firstIndex, GLuint nIndices, const void *indexData) {
+    glBindBuffer(GL_COPY_WRITE_BUFFER, vertexPools[format].vertexBuffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, firstVertex * vertexSize(format), nVertices * vertexSize(format), vertices);
+    std::vector<GLubyte> positions(nVertices * positionSize(format));
+    copyPositions(format, vertices, nVertices, positions.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, vertexPools[format].positionBuffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, firstVertex * positionSize(format), positions.size(), positions.data());
+    const indexPool *pool = &indexPools[indices];
+    glBindBuffer(GL_COPY_WRITE_BUFFER, pool->buffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, firstIndex * pool->size, nIndices * pool->size, indexData);
     CheckError();
 }
 
+// A placeholder drawn instead of a mesh that's still loading: a box from
+// -1 to 1, which drawMesh stretches over the mesh's bounding box.
+GLuint placeholderFirstVertex, placeholderFirstIndex; // In the snorm16Positions and shortIndices pools
+const GLsizei placeholderIndices = 36;
+
+static void makePlaceholder() {
+    packedVertex verts[24];
+    GLushort indices[placeholderIndices];
+    for (int face = 0; face < 6; face++) {
+        int axis = face / 2;
+        float side = face % 2 == 0 ? 1.0 : -1.0;
+        vec3 normal(0.0, 0.0, 0.0);
+        normal[axis] = side;
+        for (int corner = 0; corner < 4; corner++) {
+            float u = corner == 1 || corner == 2 ? 1.0 : 0.0;
+            float v = corner >= 2 ? 1.0 : 0.0;
+            packedVertex *vert = &verts[face * 4 + corner];
+            vert->position[axis] = packSnorm16(side);
+            vert->position[(axis + 1) % 3] = packSnorm16((u * 2.0 - 1.0) * side);
+            vert->position[(axis + 2) % 3] = packSnorm16(v * 2.0 - 1.0);
+            vert->position[3] = 0;
+            vert->texCoord[0] = packHalf(u);
+            vert->texCoord[1] = packHalf(v);
+            packOctahedral(normal, vert->normal);
+        }
+        const int quad[6] = {0, 1, 2, 0, 2, 3};
+        for (int j = 0; j < 6; j++)
+            indices[face * 6 + j] = face * 4 + quad[j];
+    }
+
+    placeholderFirstVertex = allocatePoolVertices(snorm16Positions, 24);
+    placeholderFirstIndex = allocatePoolIndices(shortIndices, placeholderIndices);
+    uploadToPools(snorm16Positions, placeholderFirstVertex, 24, verts,
+                  shortIndices, placeholderFirstIndex, placeholderIndices, indices);
+}
+
+// Runs on a worker thread.
+static void loadMeshData(meshLoadJob *job) {
+    if (mapBakedMesh(job->meshNumber, &job->baked))
+        job->header = (const meshCacheHeader *) job->baked.data;
+    else if (bakeMesh(job->meshNumber, job->blob))
+        job->header = (const meshCacheHeader *) job->blob.data();
+
+    if (job->header != NULL) makeOccluderMesh(job->header, &job->occluder);
+
+    // Page in the mapped file here rather than in glBufferData on the display thread
+    if (job->baked.data != NULL) {
+        volatile GLubyte sum = 0;
+        for (size_t i = 0; i < job->baked.size; i += 4096)
+            sum += job->baked.data[i];
+    }
+    finishedMeshLoads.push(job);
+}
+
+// Start loading a mesh if it isn't already loaded or loading.
+// Returns true if it's ready to draw.
+bool requestMesh(int meshNumber) {
+    if (meshNumber >= numMeshes || meshNumber < 0) {
+        printf("Error - no such model number");
+        exit(1);
+    }
+
+    meshInfo *mesh = &meshes[meshNumber];
+    if (mesh->state == meshLoaded) return true;
+    if (mesh->state == meshLoading) return false;
+
+    // Size the placeholder from the baked file's header if there is one
+    meshCacheHeader header;
+    if (peekBakedMeshHeader(meshNumber, &header)) {
+        mesh->boundsKnown = true;
+        mesh->boundsMin = vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+        mesh->boundsMax = vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+        mesh->centre = vec3(header.centre[0], header.centre[1], header.centre[2]);
+        mesh->radius = header.radius;
+    }
+
+    mesh->state = meshLoading;
+    meshLoadJob *job = new meshLoadJob();
+    job->meshNumber = meshNumber;
+    job->baked.data = NULL;
+    job->header = NULL;
+    queueWork([job] { loadMeshData(job); });
+    return false;
+}
+
+// Copy a loaded mesh into its vertex pool and the index pool.
+static void uploadMesh(meshLoadJob *job) {
+    const meshCacheHeader *header = job->header;
+    if (header == NULL)
+        failInt("Error loading model number:", job->meshNumber);
+
+    meshInfo *mesh = &meshes[job->meshNumber];
+    mesh->boundsKnown = true;
+    mesh->nLods = header->nLods;
+    mesh->nIndices = 0;
+    for (GLuint i = 0; i < header->nLods; i++)
+        mesh->nIndices += header->lodIndexCount[i];
+    mesh->pool = header->vertexFormat;
+    mesh->indexPool = header->indexSize == sizeof(GLushort) ? shortIndices : intIndices;
+    mesh->nVertices = header->nVertices;
+    mesh->firstVertex = allocatePoolVertices(mesh->pool, mesh->nVertices);
+    mesh->firstIndex = allocatePoolIndices(mesh->indexPool, mesh->nIndices);
+    GLuint firstIndex = mesh->firstIndex;
+    for (GLuint i = 0; i < header->nLods; i++) {
+        mesh->lodIndexCount[i] = header->lodIndexCount[i];
+        mesh->lodFirstIndex[i] = firstIndex;
+        mesh->lodError[i] = header->lodError[i];
+        firstIndex += header->lodIndexCount[i];
+    }
+    mesh->posOffset = vec3(header->posOffset[0], header->posOffset[1], header->posOffset[2]);
+    mesh->posScale = header->posScale;
+    mesh->boundsMin = vec3(header->boundsMin[0], header->boundsMin[1], header->boundsMin[2]);
+    mesh->boundsMax = vec3(header->boundsMax[0], header->boundsMax[1], header->boundsMax[2]);
+    mesh->centre = vec3(header->centre[0], header->centre[1], header->centre[2]);
+    mesh->radius = header->radius;
+
+    uploadToPools(mesh->pool, mesh->firstVertex, mesh->nVertices, meshCacheVertices(header),
+                  mesh->indexPool, mesh->firstIndex, mesh->nIndices, meshCacheIndices(header));
+
+    mesh->gpuBytes = poolVertexSize(mesh->pool) * mesh->nVertices + indexPools[mesh->indexPool].size * mesh->nIndices;
+    meshOccluders[job->meshNumber] = std::move(job->occluder);
+    mesh->lastDrawnFrame = frameNumber; // So it isn't evicted before it's drawn
+    mesh->state = meshLoaded; // Only now, so making room for it can't evict it
+    meshBytesLoaded += mesh->gpuBytes;
+}
+
+// Upload every mesh the workers have finished loading since the last frame.
+void uploadFinishedMeshes() {
+    meshLoadJob *job = finishedMeshLoads.takeAll();
+    while (job != NULL) {
+        meshLoadJob *next = job->next;
+        uploadMesh(job);
+        unmapFile(&job->baked);
+        delete job;
+        job = next;
+    }
+}
+
+// Evict the least recently drawn meshes until the rest fit in meshBudgetBytes,
+// which they only don't if the pools had to grow past it for the meshes in
+// use, so that the space is there for later loads without growing further.
+void evictMeshes() {
+    while (meshBytesLoaded > meshBudgetBytes && evictOldestMesh(-1, -1)) {}
+}
+
+// Where a mesh's full level of detail is, for drawing it into the shadow maps
+// (see findShadowMesh in shadows.h).  Shadows don't go with the camera's
+// levels of detail, since a map may be kept for many frames.
+static bool shadowMeshOf(int meshId, shadowMesh *draw) {
+    if (!requestMesh(meshId)) return false;
+    meshInfo *mesh = &meshes[meshId];
+    mesh->lastDrawnFrame = frameNumber;
+    draw->vao = vertexPools[mesh->pool].depthVaos[mesh->indexPool];
+    draw->indexType = indexPools[mesh->indexPool].type;
+    draw->indexSize = indexPools[mesh->indexPool].size;
+    draw->meshModel = Translate(mesh->posOffset) * Scale(mesh->posScale);
+    draw->count = mesh->lodIndexCount[0];
+    draw->firstIndex = mesh->lodFirstIndex[0];
+    draw->baseVertex = mesh->firstVertex;
+    return true;
+}
+
 //----------------------------------------------------------------------------
 
 void zoomIn() {
@@ -235,11 +933,13 @@ static void adjustcamSideUp(vec2 su) {
 static void adjustLocXZ(vec2 xz) {
     sceneObjs[toolObj].loc[0] += xz[0];
     sceneObjs[toolObj].loc[2] += xz[1];
+    sceneObjs[toolObj].modelDirty = true;
 }
 
 static void adjustScaleY(vec2 sy) {
     sceneObjs[toolObj].scale += sy[0];
     sceneObjs[toolObj].loc[1] += sy[1];
+    sceneObjs[toolObj].modelDirty = true;
 }
 
 
@@ -283,12 +983,15 @@ static void addObject(int id) {
     sceneObjs[nObjects].meshId = id;
 
     sceneObjs[nObjects].texId = rand() % numTextures;
+    sceneObjs[nObjects].lod = 0;
+    sceneObjs[nObjects].light = lightNone;
+    sceneObjs[nObjects].modelDirty = true; // So whatever's set before it's first drawn is picked up too
 
     toolObj = currObject = nObjects++;
     setToolCallbacks(adjustLocXZ, camRotZ(),
                      adjustScaleY, mat2(0.05, 0, 0, 10.0));
 
-    glutPostRedisplay();
+    if (!benchmarking) glutPostRedisplay(); // There's no window with --bench
 }
 
 /*
@@ -328,6 +1031,7 @@ static void duplicateObject(int id)
         sceneObjs[currObject].angles[0] = sceneObjs[id].angles[0];
         sceneObjs[currObject].angles[1] = sceneObjs[id].angles[1];
         sceneObjs[currObject].angles[2] = sceneObjs[id].angles[2];
+        sceneObjs[currObject].light = sceneObjs[id].light;
 
         setToolCallbacks(adjustLocXZ, camRotZ(),
                          adjustScaleY, mat2(0.05, 0, 0, 10.0) );
@@ -359,6 +1063,7 @@ static void deleteObject(int id) {
         // Decrease the number of object
         for (int i=currObject; i < nObjects; i++) {
             sceneObjs[i] = sceneObjs[i+1];
+            sceneObjs[i].modelDirty = true; // Its objectModels entry is still at i + 1
         }
         nObjects--;
         glutPostRedisplay();
@@ -367,40 +1072,83 @@ static void deleteObject(int id) {
 
 //------The init function-----------------------------------------------------
 
+// Point a variant of the scene shaders at the texture units, as it becomes
+// ready (see initShaderVariants).
+static void setSceneShaderUnits(const sceneShader &program) {
+    glUseProgram(program.id);
+    // Texture 0 is the only texture type in this program, and is for the rgb
+    // colour of the surface but there could be separate types for, e.g.,
+    // specularity and normals.
+    glUniform1i(program.texture, 0);
+    glUniform1i(program.textureArray, 1); // Even when unused, as it can't share a unit with texture
+    glUniform1f(program.textureArraySize, max(arrayLayout.size, 1u));
+    glUniform1i(program.lightTexture, lightTextureUnit - GL_TEXTURE0);
+    glUniform1i(program.clusterTexture, clusterTextureUnit - GL_TEXTURE0);
+    glUniform1i(program.lightIndexTexture, lightIndexTextureUnit - GL_TEXTURE0);
+    glUniform1i(program.pointShadowMap, shadowTextureUnit - GL_TEXTURE0 + pointShadow);
+    glUniform1i(program.directionalShadowMap, shadowTextureUnit - GL_TEXTURE0 + directionalShadow);
+    glUniform1i(program.spotShadowMap, shadowTextureUnit - GL_TEXTURE0 + spotShadow);
+    glUseProgram(programInUse); // Which may be part way through a frame
+    CheckError();
+}
+
 void init(void) {
-    srand(time(NULL)); /* initialize random seed - so the starting scene varies */
+    srand(benchmarking ? benchSeed : time(NULL)); /* initialize random seed - so the starting scene varies */
     aiInit();
 
     // for (int i=0; i < numMeshes; i++)
     //     meshes[i] = NULL;
 
-#ifdef __APPLE__
-    glGenVertexArraysAPPLE(numMeshes, vaoIDs); CheckError(); // Allocate vertex array objects for meshes
-#else
-    glGenVertexArrays(numMeshes, vaoIDs);
-    CheckError(); // Allocate vertex array objects for meshes
-#endif
-
     glGenTextures(numTextures, textureIDs);
+    glGenTextures(numTextures, previewTextureIDs);
     CheckError(); // Allocate texture objects
+#ifndef __APPLE__
+    haveTextureStorage = GLEW_VERSION_4_2 || GLEW_ARB_texture_storage;
+#endif
+    initUploadRing(&textureUploads, uploadRingSize); // Before the workers start using it
+
+    startWorkerThreads(); // For loading meshes and textures in the background
 
-    // Load shaders and use the resulting shader program
-    shaderProgram = InitShader("res/shaders/vStart.glsl", "res/shaders/fStart.glsl");
+    // Before the shaders, which are told the texture array's size
+    makeLightClusters();
+    if (useTextureArray) makeTextureArray();
 
-    glUseProgram(shaderProgram);
+    // Load shaders, as the variants each draw needs (see shadervariants.h).  The
+    // one that can draw anything is built straight away, and the rest are built
+    // when first used or, if the driver can, in the background from now on.
+    unsigned optionVariant = (useTextureArray ? variantTextureArray : 0) | (useShadows ? variantShadows : 0);
+    initShaderVariants(optionVariant, setSceneShaderUnits);
+    shader = sceneShaderVariant(fallbackVariant(optionVariant)); // The attributes are the same in every variant
     CheckError();
 
-    // Initialize the vertex position attribute from the vertex shader
-    vPosition = glGetAttribLocation(shaderProgram, "vPosition");
-    vNormal = glGetAttribLocation(shaderProgram, "vNormal");
+    // The per-instance attributes come from instanceBuffer (see drawBatches)
+    glGenBuffers(1, &instanceBuffer);
     CheckError();
 
-    // Likewise, initialize the vertex texture coordinates attribute.
-    vTexCoord = glGetAttribLocation(shaderProgram, "vTexCoord");
+    // The meshes go into shared buffers, drawn with indirect commands if possible
+#ifdef __APPLE__
+    useMultiDrawIndirect = false;
+#else
+    useMultiDrawIndirect = useMultiDrawIndirect
+                           && (GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance));
+#endif
+    glGenBuffers(1, &indirectBuffer);
+    makeGeometryPools();
+
+    initProfiler(); // For --profile and --trace
+
+    // The lights are filled in each frame by display
+    glGenBuffers(1, &lightsBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, lightsBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(lightsBlock), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, lightsBinding, lightsBuffer);
     CheckError();
 
-    projectionU = glGetUniformLocation(shaderProgram, "Projection");
-    modelViewU = glGetUniformLocation(shaderProgram, "ModelView");
+    makeDeferred();
+    makeShadowMaps(shadowMeshOf);
+
+    makePlaceholder(); // Drawn in place of meshes that are still loading
+    makePlaceholderTexture(); // Likewise for textures
 
     // Objects 0, and 1 are the ground and the first light.
     addObject(0); // Square for the ground
@@ -414,6 +1162,7 @@ void init(void) {
     sceneObjs[1].scale = 0.1;
     sceneObjs[1].texId = 0; // Plain texture
     sceneObjs[1].brightness = 0.2; // The light's brightness is 5 times this (below).
+    sceneObjs[1].light = lightPoint;
 
     /* Part I adding extra object to store values for light 2
     *
@@ -424,6 +1173,7 @@ void init(void) {
     sceneObjs[2].texId = 0; // Plain texture
     sceneObjs[2].brightness = 0.2; // The light's brightness is 5 times this (below).
     sceneObjs[2].angles[1] = 90.0;
+    sceneObjs[2].light = lightDirectional;
 
     /* Part J 3 adding extra object to store values for light 3
     *
@@ -433,6 +1183,7 @@ void init(void) {
     sceneObjs[3].scale = 0.1;
     sceneObjs[3].texId = 0; // Plain texture
     sceneObjs[3].brightness = 0.2; // The light's brightness is 5 times this (below).
+    sceneObjs[3].light = lightSpot;
 
     addObject(rand() % numMeshes); // A test mesh
 
@@ -441,66 +1192,388 @@ void init(void) {
     glEnable(GL_DEPTH_TEST);
     doRotate(); // Start in camera rotate mode.
     glClearColor(0.0, 0.0, 0.0, 1.0); /* black background */
+
+    // Everything that changes what's drawn, for checkForRedraw
+    watchForChanges(sceneObjs, sizeof(sceneObjs));
+    watchForChanges(&nObjects, sizeof(nObjects));
+    watchForChanges(&viewDist, sizeof(viewDist));
+    watchForChanges(&camRotSidewaysDeg, sizeof(camRotSidewaysDeg));
+    watchForChanges(&camRotUpAndOverDeg, sizeof(camRotUpAndOverDeg));
+    watchForChanges(&projection, sizeof(projection)); // Set by reshape, as are the next two
+    watchForChanges(&windowWidth, sizeof(windowWidth));
+    watchForChanges(&windowHeight, sizeof(windowHeight));
 }
 
 //----------------------------------------------------------------------------
 
-void drawMesh(SceneObject sceneObj) {
-
-    // Activate a texture, loading if needed.
-    loadTextureIfNotAlreadyLoaded(sceneObj.texId);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, textureIDs[sceneObj.texId]);
+// Add an object to this frame's instances, with its model-view matrix in
+// columns (see multiplyModelViews).  It's actually drawn by drawBatches.
+void drawMesh(SceneObject sceneObj, const GLfloat *modelView) {
+    drawItem item;
+
+    // Use the object's texture, or its preview or a plain white one while it loads.
+    textureState texState = requestTexture(sceneObj.texId);
+    item.texture = texState == textureLoaded      ? textureIDs[sceneObj.texId]
+                   : texState == texturePreviewed ? previewTextureIDs[sceneObj.texId]
+                                                  : placeholderTexture;
+    int textureSlot = texState == textureLoaded      ? sceneObj.texId + 1
+                      : texState == texturePreviewed ? numTextures + sceneObj.texId + 1
+                                                     : 0;
+    instanceData *instance = &item.instance;
+    instance->texLayer[0] = -1.0;
+
+    // Textures in textureArray are told apart per instance, so they all share a
+    // sort key slot and objects with different textures can be drawn together
+    const textureArraySlot *arraySlot = &arrayLayout.slots[sceneObj.texId];
+    if (useTextureArray && arraySlot->layer >= 0 && texState != textureLoading) {
+        item.texture = 0;
+        textureSlot = textureArraySortSlot;
+        instance->texLayer[0] = arraySlot->layer;
+        instance->texLayer[1] = texState == texturePreviewed ? textureArrayBaseLevel[sceneObj.texId] : 0;
+        instance->texTile[0] = (float) arraySlot->x / arrayLayout.size;
+        instance->texTile[1] = (float) arraySlot->y / arrayLayout.size;
+        instance->texTile[2] = (float) arraySlot->size / arrayLayout.size;
+    }
 
-    // Texture 0 is the only texture type in this program, and is for the rgb
-    // colour of the surface but there could be separate types for, e.g.,
-    // specularity and normals.
-    glUniform1i(glGetUniformLocation(shaderProgram, "texture"), 0);
+    // Part I accouring for different lights and brightness and colour calculation from light are now done in shaders
+    vec3 rgb = sceneObj.rgb * sceneObj.brightness * 2.0;
+    for (int j = 0; j < 3; j++) {
+        instance->ambientProduct[j] = sceneObj.ambient * rgb[j];
+        instance->diffuseProduct[j] = sceneObj.diffuse * rgb[j];
+        instance->specularProduct[j] = sceneObj.specular * rgb[j];
+    }
+    instance->shine = sceneObj.shine;
 
     // Set the texture scale for the shaders
-    glUniform1f(glGetUniformLocation(shaderProgram, "texScale"), sceneObj.texScale);
+    instance->texScale = sceneObj.texScale;
+
+    // The shaders take the model-view matrix as a mat4 attribute, i.e., as columns
+    memcpy(instance->modelView, modelView, sizeof(instance->modelView));
+
+    // Use the mesh's part of its pool, or draw a box in its place while it loads.
+    meshInfo *mesh = &meshes[sceneObj.meshId];
+    int meshSlot, meshLod = 0;
+    if (!requestMesh(sceneObj.meshId)) {
+        // Flat meshes (like the ground) get a little thickness, to avoid z-fighting
+        vec3 halfSize = (mesh->boundsMax - mesh->boundsMin) * 0.5;
+        float minHalfSize = 0.01 * max(halfSize.x, max(halfSize.y, halfSize.z));
+        for (int j = 0; j < 3; j++)
+            halfSize[j] = max(halfSize[j], minHalfSize);
+        if (mesh->boundsKnown)
+            translateScaleColumns(instance->modelView, (mesh->boundsMin + mesh->boundsMax) * 0.5, halfSize);
+        else
+            toColumns(view * Translate(sceneObj.loc) * Scale(0.1), instance->modelView); // No idea of the size yet
+        item.pool = snorm16Positions;
+        item.indexPool = shortIndices;
+        item.count = placeholderIndices;
+        item.firstIndex = placeholderFirstIndex;
+        item.baseVertex = placeholderFirstVertex;
+        meshSlot = 0; // All placeholders share a mesh
+    } else {
+        // Scale the stored positions back to model size
+        translateScaleColumns(instance->modelView, mesh->posOffset, mesh->posScale);
+        int lod = min(sceneObj.lod, (int) mesh->nLods - 1);
+        item.pool = mesh->pool;
+        item.indexPool = mesh->indexPool;
+        item.count = mesh->lodIndexCount[lod];
+        item.firstIndex = mesh->lodFirstIndex[lod];
+        item.baseVertex = mesh->firstVertex;
+        meshSlot = (mesh->pool * 2 + mesh->indexPool) << 12 | (sceneObj.meshId + 1); // So each pool's meshes sort together
+        meshLod = lod;
+        mesh->lastDrawnFrame = frameNumber;
+    }
+
+    // Sort by state, then by the depth of the model's origin
+    item.key = makeSortKey(0, textureSlot, meshSlot, meshLod, -instance->modelView[14]);
+    drawItems.push_back(item);
+}
+
+//----------------------------------------------------------------------------
+//
+// Instanced drawing.  drawMesh only adds to drawItems; drawBatches then sorts
+// them so objects with the same mesh, level of detail and texture are next to
+// each other, copies all of their instanceData into one buffer, and makes each
+// run of them one indirect draw command, with baseInstance saying where its
+// instances start.  All the commands for a pair of pools and a texture are then drawn
+// with a single glMultiDrawElementsIndirect.  Without it, each command is
+// drawn on its own by glDrawElementsInstancedBaseVertex.
+
+// Point the per-instance attributes at instanceBuffer, starting from the given
+// instance.  Needs the VAO to be drawn with to be bound.
+static void setInstanceAttributes(size_t firstInstance) {
+    size_t base = firstInstance * sizeof(instanceData);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    for (int col = 0; col < 4; col++) {
+        glVertexAttribPointer(shader.iModelView + col, 4, GL_FLOAT, GL_FALSE, sizeof(instanceData),
+                              BUFFER_OFFSET(base + offsetof(instanceData, modelView) + col * 4 * sizeof(GLfloat)));
+        glEnableVertexAttribArray(shader.iModelView + col);
+    }
+    glVertexAttribPointer(shader.iAmbientProduct, 3, GL_FLOAT, GL_FALSE, sizeof(instanceData),
+                          BUFFER_OFFSET(base + offsetof(instanceData, ambientProduct)));
+    glVertexAttribPointer(shader.iDiffuseProduct, 3, GL_FLOAT, GL_FALSE, sizeof(instanceData),
+                          BUFFER_OFFSET(base + offsetof(instanceData, diffuseProduct)));
+    glVertexAttribPointer(shader.iSpecularProduct, 3, GL_FLOAT, GL_FALSE, sizeof(instanceData),
+                          BUFFER_OFFSET(base + offsetof(instanceData, specularProduct)));
+    glVertexAttribPointer(shader.iShineTexScale, 2, GL_FLOAT, GL_FALSE, sizeof(instanceData),
+                          BUFFER_OFFSET(base + offsetof(instanceData, shine)));
+    glEnableVertexAttribArray(shader.iAmbientProduct);
+    glEnableVertexAttribArray(shader.iDiffuseProduct);
+    glEnableVertexAttribArray(shader.iSpecularProduct);
+    glEnableVertexAttribArray(shader.iShineTexScale);
+    glVertexAttribPointer(shader.iTexLayer, 2, GL_FLOAT, GL_FALSE, sizeof(instanceData),
+                          BUFFER_OFFSET(base + offsetof(instanceData, texLayer)));
+    glVertexAttribPointer(shader.iTexTile, 3, GL_FLOAT, GL_FALSE, sizeof(instanceData),
+                          BUFFER_OFFSET(base + offsetof(instanceData, texTile)));
+    glEnableVertexAttribArray(shader.iTexLayer);
+    glEnableVertexAttribArray(shader.iTexTile);
+
+    GLuint instanced[] = {shader.iModelView, shader.iModelView + 1, shader.iModelView + 2,
+                          shader.iModelView + 3, shader.iAmbientProduct, shader.iDiffuseProduct,
+                          shader.iSpecularProduct, shader.iShineTexScale, shader.iTexLayer,
+                          shader.iTexTile};
+    for (int i = 0; i < 10; i++) {
+#ifdef __APPLE__
+        glVertexAttribDivisorARB(instanced[i], 1);
+#else
+        glVertexAttribDivisor(instanced[i], 1);
+#endif
+    }
+}
 
-    // Set the projection matrix for the shaders
-    glUniformMatrix4fv(projectionU, 1, GL_TRUE, projection);
+// Draw with a variant of the scene shaders (see shadervariants.h), giving it
+// the projection if it's only just come into use this frame.
+static void useSceneVariant(unsigned variant) {
+    const sceneShader &ready = sceneShaderVariant(variant);
+    if (ready.id == programInUse) return;
+    shader = ready;
+    programInUse = shader.id;
+    glUseProgram(shader.id);
+    glUniformMatrix4fv(shader.projection, 1, GL_TRUE, projection);
+}
 
-    // Set the model matrix - this should combine translation, rotation and scaling based on what's
-    // in the sceneObj structure (see near the top of the program).
+void drawBatches() {
+    drawOrder.resize(drawItems.size());
+    for (size_t i = 0; i < drawItems.size(); i++) {
+        drawOrder[i].key = drawItems[i].key;
+        drawOrder[i].item = i;
+    }
+    radixSortKeys(drawOrder, sortScratch);
 
-    /* Part B
-    * Rotating the model by using built in function specified in mat.h which refers to lab 5.
-    * Here we use object slicing and swizzling which uses the indexing of array using [] and selection (.) operator refer to lecture 5 pg 30.
-    * each object has angles for x,y,z and we use the rotation matrix from mat.h to transform at each specific angle.
-    * angle[0] is x, angle[1] is y and angle[2] is z
-    * Order of transformation does not matter
-    */
+    instances.resize(drawItems.size());
+    for (size_t i = 0; i < drawItems.size(); i++)
+        instances[i] = drawItems[drawOrder[i].item].instance;
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(instanceData) * instances.size(), instances.data(), GL_STREAM_DRAW);
+    glActiveTexture(GL_TEXTURE0);
 
-    mat4 rotate = RotateX(sceneObj.angles[0]) *  RotateY(sceneObj.angles[1]) * RotateZ(sceneObj.angles[2]);
-    mat4 model = Translate(sceneObj.loc) * Scale(sceneObj.scale) * rotate;
+    drawCommands.clear();
+    for (size_t first = 0; first < drawOrder.size();) {
+        unsigned long long state = drawOrder[first].key >> sortKeyStateShift;
+        size_t last = first + 1;
+        while (last < drawOrder.size() && drawOrder[last].key >> sortKeyStateShift == state)
+            last++;
+        const drawItem &item = drawItems[drawOrder[first].item];
+        drawIndirectCommand command = {(GLuint) item.count, (GLuint) (last - first), item.firstIndex,
+                                       item.baseVertex, (GLuint) first};
+        drawCommands.push_back(command);
+        numTrianglesDrawn += item.count / 3 * (last - first);
+        first = last;
+    }
+    if (useMultiDrawIndirect) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(drawIndirectCommand) * drawCommands.size(),
+                     drawCommands.data(), GL_STREAM_DRAW);
+    }
 
+    // Drawing each object on its own would bind a VAO and a texture for every one
+    GLuint boundVao = 0;
+    GLuint boundTexture = 0;
+    numBinds = 0;
+    for (size_t first = 0; first < drawCommands.size();) {
+        const drawItem &item = drawItems[drawOrder[drawCommands[first].baseInstance].item];
+        size_t last = first + 1;
+        while (useMultiDrawIndirect && last < drawCommands.size()) {
+            const drawItem &next = drawItems[drawOrder[drawCommands[last].baseInstance].item];
+            if (next.pool != item.pool || next.indexPool != item.indexPool || next.texture != item.texture) break;
+            last++;
+        }
 
-    // Set the model-view matrix for the shaders
-    glUniformMatrix4fv(modelViewU, 1, GL_TRUE, view * model);
+        GLuint vao = vertexPools[item.pool].vaos[item.indexPool];
+        const indexPool *indices = &indexPools[item.indexPool];
+        if (vao != boundVao) {
+            bindVertexArray(vao);
+            boundVao = vao;
+            numBinds++;
+        }
+        if (item.texture != boundTexture) {
+            glBindTexture(GL_TEXTURE_2D, item.texture);
+            boundTexture = item.texture;
+            numBinds++;
+        }
+        useSceneVariant(frameShaderVariant | (item.texture == placeholderTexture ? variantUntextured : 0));
 
-    // Activate the VAO for a mesh, loading if needed.
-    loadMeshIfNotAlreadyLoaded(sceneObj.meshId);
-    CheckError();
-#ifdef __APPLE__
-    glBindVertexArrayAPPLE( vaoIDs[sceneObj.meshId] );
-#else
-    glBindVertexArray(vaoIDs[sceneObj.meshId]);
+#ifndef __APPLE__
+        if (useMultiDrawIndirect)
+            glMultiDrawElementsIndirect(GL_TRIANGLES, indices->type,
+                                        BUFFER_OFFSET(first * sizeof(drawIndirectCommand)), last - first, 0);
+        else
 #endif
-    CheckError();
+        {
+            const drawIndirectCommand &command = drawCommands[first];
+            setInstanceAttributes(command.baseInstance);
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES, command.count, indices->type,
+                                              BUFFER_OFFSET((size_t) command.firstIndex * indices->size),
+                                              command.instanceCount, command.baseVertex);
+        }
+        CheckError();
+        numDrawCalls++;
+        first = last;
+    }
+    numBindsAvoided = 2 * drawItems.size() - numBinds;
+    drawItems.clear();
+}
 
-    glDrawElements(GL_TRIANGLES, meshes[sceneObj.meshId]->mNumFaces * 3,
-                   GL_UNSIGNED_INT, NULL);
-    CheckError();
+//----------------------------------------------------------------------------
+//
+// Levels of detail are chosen from how big an object's bounding sphere looks
+// on screen: a level is good enough if its error, as a fraction of the sphere's
+// radius, covers less than lodPixelError pixels.  So objects only get their
+// full triangle count when they're big enough to show it.  To stop objects
+// flickering back and forth at the boundary, moving to a coarser level needs
+// the error to be lodHysteresis times smaller than the limit.
+const float lodPixelError = 1.0;
+const float lodHysteresis = 0.5;
+
+int chooseLod(SceneObject *so, const mat4 &model) {
+    meshInfo *mesh = &meshes[so->meshId];
+    if (mesh->state != meshLoaded || mesh->nLods <= 1) return so->lod = 0;
+
+    vec4 centre = view * model * vec4(mesh->centre, 1.0);
+    float radius = mesh->radius * so->scale;
+    float distance = -centre.z;
+    if (distance <= radius || mesh->radius <= 0.0) return so->lod = 0; // The camera is inside it
+
+    // projection[1][1] is cot(fovy/2), so this is the sphere's radius in pixels
+    float radiusPixels = radius * projection[1][1] / distance * windowHeight * 0.5;
+    float pixelsPerError = radiusPixels / mesh->radius;
+
+    int lod = min(max(so->lod, 0), (int) mesh->nLods - 1);
+    while (lod > 0 && mesh->lodError[lod] * pixelsPerError > lodPixelError)
+        lod--;
+    while (lod + 1 < (int) mesh->nLods
+           && mesh->lodError[lod + 1] * pixelsPerError < lodPixelError * lodHysteresis)
+        lod++;
+    return so->lod = lod;
+}
+
+//----------------------------------------------------------------------------
+//
+// View frustum culling (see frustum.h).  Every object's bounding sphere is
+// moved to world coordinates and they're all tested together, then the boxes
+// of any spheres on the edge of the view are tested to be sure.  Objects whose
+// mesh bounds aren't known yet are always drawn.
+//
+// Then occlusion culling (see occlusion.h): the objects that look biggest are
+// drawn into occlusionDepth, and the rest are tested against it.  Turned off
+// with --no-occlusion.
+//
+// The model matrices are only remade for objects whose modelDirty is set.
+mat4 objectModels[maxObjects]; // The model matrix for each object
+static columnMatrix objectModelColumns[maxObjects]; // The same, in columns (see transforms.h)
+bool objectVisible[maxObjects];
+static float cullX[maxObjects], cullY[maxObjects], cullZ[maxObjects], cullRadius[maxObjects];
+static GLubyte cullResults[maxObjects];
+bool useOcclusionCulling = true;
+occlusionBuffer occlusionDepth;
+static float occluderSize[maxObjects];
+
+void cullObjects() {
+    for (int i = 0; i < nObjects; i++) {
+        SceneObject &so = sceneObjs[i];
+        if (so.modelDirty) {
+            /* Part B
+            * Rotating the model by using built in function specified in mat.h which refers to lab 5.
+            * each object has angles for x,y,z and we use the rotation matrix from mat.h to transform at each specific angle.
+            * angle[0] is x, angle[1] is y and angle[2] is z
+            */
+            mat4 rotate = RotateX(so.angles[0]) * RotateY(so.angles[1]) * RotateZ(so.angles[2]);
+            objectModels[i] = Translate(so.loc) * Scale(so.scale) * rotate;
+            toColumns(objectModels[i], objectModelColumns[i]);
+            so.modelDirty = false;
+        }
+
+        meshInfo *mesh = &meshes[so.meshId];
+        vec4 centre = objectModels[i] * vec4(mesh->centre, 1.0);
+        cullX[i] = centre.x;
+        cullY[i] = centre.y;
+        cullZ[i] = centre.z;
+        cullRadius[i] = mesh->boundsKnown ? mesh->radius * fabs(so.scale) : 1e30;
+    }
+
+    frustum f = frustumFromMatrix(projection * view);
+    cullSpheres(f, cullX, cullY, cullZ, cullRadius, nObjects, cullResults);
+
+    numObjectsCulled = 0;
+    for (int i = 0; i < nObjects; i++) {
+        meshInfo *mesh = &meshes[sceneObjs[i].meshId];
+        objectVisible[i] = cullResults[i] == cullInside
+                           || (cullResults[i] == cullIntersecting
+                               && !(mesh->boundsKnown && boxOutsideFrustum(f, objectModels[i], mesh->boundsMin,
+                                                                           mesh->boundsMax)));
+        if (!objectVisible[i]) numObjectsCulled++;
+    }
+
+    numObjectsOccluded = 0;
+    if (!useOcclusionCulling) return;
+    for (int i = 0; i < nObjects; i++) {
+        SceneObject &so = sceneObjs[i];
+        meshInfo *mesh = &meshes[so.meshId];
+        float distance = -(view * vec4(cullX[i], cullY[i], cullZ[i], 1.0)).z;
+        occluderSize[i] = 0.0;
+        if (objectVisible[i] && mesh->state == meshLoaded && !meshOccluders[so.meshId].indices.empty())
+            occluderSize[i] = cullRadius[i] / max(distance, 1e-3f);
+    }
+    int occluders[maxOccluders];
+    int nOccluders = pickOccluders(occluderSize, nObjects, occluders);
+    if (nOccluders == 0) return;
+
+    clearOcclusion(&occlusionDepth, projection * view);
+    for (int i = 0; i < nOccluders; i++) {
+        int id = occluders[i];
+        addOccluder(&occlusionDepth, meshOccluders[sceneObjs[id].meshId], objectModels[id]);
+        occluderSize[id] = -1.0; // Marks it as an occluder, which can't hide itself
+    }
+    rasterizeOccluders(&occlusionDepth);
+
+    for (int i = 0; i < nObjects; i++) {
+        meshInfo *mesh = &meshes[sceneObjs[i].meshId];
+        if (!objectVisible[i] || occluderSize[i] < 0.0 || !mesh->boundsKnown) continue;
+        if (boxOccluded(&occlusionDepth, objectModels[i], mesh->boundsMin, mesh->boundsMax)) {
+            objectVisible[i] = false;
+            numObjectsCulled++;
+            numObjectsOccluded++;
+        }
+    }
 }
 
 //----------------------------------------------------------------------------
 
 void display(void) {
+    waitForFrameSlot(); // Under --max-fps (see redraw.h)
     numDisplayCalls++;
-
+    frameNumber++;
+    numTrianglesDrawn = 0;
+    numDrawCalls = 0;
+
+    profilePhase(phaseLoads);
+    uploadFinishedMeshes(); // From the worker threads (see requestMesh)
+    uploadFinishedTextures(); // Likewise (see requestTexture)
+    evictMeshes();
+    finishBuiltVariants(); // See shadervariants.h
+
+    profilePhase(phaseView);
+    programInUse = 0; // The first draw will choose (see useSceneVariant)
+    if (useDeferred) beginGBufferPass(windowWidth, windowHeight);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     CheckError(); // May report a harmless GL_INVALID_OPERATION with GLEW on the first frame
 
@@ -518,73 +1591,120 @@ void display(void) {
     mat4 rotateX = RotateX(camRotUpAndOverDeg);
     view = Translate(0.0, 0.0, -viewDist) * rotateX * rotateY; //Multiply to the viewport variable to change the view of angle
 
-    SceneObject lightObj1 = sceneObjs[1];
-    vec4 lightPosition1 = view * lightObj1.loc;
-    glUniform4fv(glGetUniformLocation(shaderProgram, "LightPosition1"),
-                 1, lightPosition1);
-    CheckError();
-    glUniform3fv(glGetUniformLocation(shaderProgram, "LightColor1"),
-                 1, lightObj1.rgb);
-    CheckError();
-    glUniform1f(glGetUniformLocation(shaderProgram, "LightBrightness1"),
-                lightObj1.brightness);
+    // Every object that's a light goes in frameLights, in eye coordinates, and
+    // then into the clusters it reaches (see lightclusters.h), or with
+    // --deferred into the list of light volumes to draw (see deferred.h).
+    // Those that cast shadows aim their shadow maps (see shadows.h).
+    profilePhase(phaseLights);
+    frameLights.clear();
+    bool anySpotLights = false;
+    for (int i = 0; i < nObjects; i++) {
+        SceneObject *obj = &sceneObjs[i];
+        if (obj->light == lightNone) continue;
+        anySpotLights = anySpotLights || obj->light == lightSpot;
+        lightData light;
+        vec4 position;
+
+        /* Part I
+        * A directional light's position is the direction towards it, so it
+        * only turns with the camera
+        */
+        if (obj->light == lightDirectional) position = rotateY * rotateX * obj->loc;
+        else position = view * obj->loc;
+        for (int j = 0; j < 3; j++) light.position[j] = position[j];
+        light.position[3] = obj->light;
+
+        for (int j = 0; j < 3; j++) light.color[j] = obj->rgb[j] * obj->brightness;
+        light.color[3] = lightRange(max(max(light.color[0], light.color[1]), light.color[2]));
+
+        /* Part J  3
+        * A spotlight points up, turned by the object's angles
+        */
+        vec4 pointing = RotateZ(obj->angles[2]) * RotateY(obj->angles[1]) * RotateX(obj->angles[0])
+                        * vec4(0.0, 1.0, 0.0, 0.0);
+        vec4 direction = normalize(view * pointing);
+        for (int j = 0; j < 3; j++) light.direction[j] = direction[j];
+        light.direction[3] = spotCosCutoff;
+
+        // It lights what's on the far side of it from its direction, as the shaders compare that with the
+        // direction to the light
+        int map = shadowMapOf(i, obj->light);
+        if (map >= 0) aimShadowMap(map, obj->loc, -normalize(vec3(pointing.x, pointing.y, pointing.z)), light.color[3]);
+        light.shadow[0] = map;
+        light.shadow[1] = light.shadow[2] = light.shadow[3] = 0.0;
+        frameLights.push_back(light);
+    }
+    uploadLights();
+    frameShaderVariant = (useDeferred ? variantGBuffer : 0) | (useTextureArray ? variantTextureArray : 0)
+                         | (anySpotLights ? variantSpotLights : 0) | (useShadows ? variantShadows : 0);
+    if (useDeferred) {
+        orderLightVolumes(projection);
+    } else {
+        assignLightsToClusters(projection);
+        uploadLightClusters();
+    }
     CheckError();
 
-    /* Part J  3
-    * Adding an extra light object for display
-    */
-    SceneObject lightObj3 = sceneObjs[3];
-    vec4 lightPosition3 = view * lightObj3.loc;
-    glUniform4fv(glGetUniformLocation(shaderProgram, "LightPosition3"),
-                 1, lightPosition3);
-    CheckError();
-    glUniform3fv(glGetUniformLocation(shaderProgram, "LightColor3"),
-                 1, lightObj3.rgb);
-    CheckError();
-    glUniform1f(glGetUniformLocation(shaderProgram, "LightBrightness3"),
-                lightObj3.brightness);
-    CheckError();
+    profilePhase(phaseCulling);
+    cullObjects();
+    profilePhase(phaseObjects);
+    static int visibleObjects[maxObjects];
+    static columnMatrix objectModelViews[maxObjects];
+    int nVisible = 0;
+    for (int i = 0; i < nObjects; i++)
+        if (objectVisible[i]) visibleObjects[nVisible++] = i;
+    multiplyModelViews(view, objectModelColumns, visibleObjects, nVisible, objectModelViews);
+    for (int j = 0; j < nVisible; j++) {
+        int i = visibleObjects[j];
+        chooseLod(&sceneObjs[i], objectModels[i]);
+        drawMesh(sceneObjs[i], objectModelViews[i]);
+    }
 
-    mat4 directionX = RotateX(lightObj3.angles[0]);
-    mat4 directionY = RotateY(lightObj3.angles[1]);
-    mat4 directionZ = RotateZ(lightObj3.angles[2]);
-    vec4 light3Dir = view * directionZ * directionY * directionX * vec4(0.0,1.0,0.0,0.0);
-    glUniform4fv(glGetUniformLocation(shaderProgram, "LightDirection"),
-                 1, light3Dir);
-    CheckError();
+    // Every object, for the shadow maps to find what's moved (see shadows.h)
+    profilePhase(phaseShadows);
+    if (useShadows) {
+        shadowCasters.resize(nObjects);
+        for (int i = 0; i < nObjects; i++) {
+            shadowCasters[i].model = objectModels[i];
+            shadowCasters[i].meshId = sceneObjs[i].meshId;
+            shadowCasters[i].casts = sceneObjs[i].light == lightNone;
+        }
+        int padded = (nObjects + 3) & ~3; // maxObjects is a multiple of 4
+        casterX.assign(cullX, cullX + padded);
+        casterY.assign(cullY, cullY + padded);
+        casterZ.assign(cullZ, cullZ + padded);
+        casterRadius.assign(cullRadius, cullRadius + padded);
+        numDrawCalls += updateShadowMaps();
+    }
 
-    /* Part I
-    * Adding an extra light object for display
-    */
-    mat4 origin_perspective = rotateY * rotateX;
-    SceneObject lightObj2 = sceneObjs[2];
-    vec4 lightPosition2 = origin_perspective * lightObj2.loc;
-    glUniform4fv(glGetUniformLocation(shaderProgram, "LightPosition2"),
-                 1, lightPosition2);
-    CheckError();
-    glUniform3fv(glGetUniformLocation(shaderProgram, "LightColor2"),
-                 1, lightObj2.rgb);
-    CheckError();
-    glUniform1f(glGetUniformLocation(shaderProgram, "LightBrightness2"),
-                lightObj2.brightness);
+    // The Lights block, now that the shadow maps are aimed
+    lightsBlock lights;
+    lights.clusterScale[0] = (float) clusterTilesX / windowWidth;
+    lights.clusterScale[1] = (float) clusterTilesY / windowHeight;
+    lights.clusterScale[2] = sliceScale;
+    lights.clusterScale[3] = sliceBias;
+    lights.clusterSize[0] = clusterTilesX;
+    lights.clusterSize[1] = clusterTilesY;
+    lights.clusterSize[2] = clusterSlices;
+    lights.clusterSize[3] = 0.0;
+    mat4 viewInverse = RotateY(-camRotSidewaysDeg) * RotateX(-camRotUpAndOverDeg) * Translate(0.0, 0.0, viewDist);
+    setShadowMatrices(&lights, viewInverse);
+    glBindBuffer(GL_UNIFORM_BUFFER, lightsBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(lights), &lights);
     CheckError();
 
-    for (int i = 0; i < nObjects; i++) {
-        SceneObject so = sceneObjs[i];
-
-	// Part I accouring for different lights and brightness and colour calculation from light are now done in shaders
-        vec3 rgb = so.rgb * so.brightness * 2.0;
-        glUniform3fv(glGetUniformLocation(shaderProgram, "AmbientProduct"), 1, so.ambient * rgb);
-        CheckError();
-        glUniform3fv(glGetUniformLocation(shaderProgram, "DiffuseProduct"), 1, so.diffuse * rgb);
-        glUniform3fv(glGetUniformLocation(shaderProgram, "SpecularProduct"), 1, so.specular * rgb);
-        glUniform1f(glGetUniformLocation(shaderProgram, "Shininess"), so.shine);
-        CheckError();
-
-        drawMesh(sceneObjs[i]);
+    profilePhase(phaseDraws);
+    drawBatches();
+    if (useDeferred) {
+        profilePhase(phaseShading);
+        numDrawCalls += shadeGBuffer(projection);
     }
 
-    glutSwapBuffers();
+    profilePhase(phaseSwap);
+    if (benchmarking) glFinish(); // So that each frame's time includes the GPU's
+    else glutSwapBuffers();
+    endProfiledFrame();
+    snapshotWatchedRegions(); // Including the levels of detail just chosen
 }
 
 //----------------------------------------------------------------------------
@@ -616,6 +1736,7 @@ static void adjustBrightnessY(vec2 by) {
     {
         sceneObjs[toolObj].brightness += by[0];
         sceneObjs[toolObj].loc[1] += by[1];
+        sceneObjs[toolObj].modelDirty = true;
     }
 }
 
@@ -651,11 +1772,13 @@ static void adjustSpecularShine(vec2 ss){
 static void adjustAngleYX(vec2 angle_yx) {
     sceneObjs[currObject].angles[1] += angle_yx[0];
     sceneObjs[currObject].angles[0] += angle_yx[1];
+    sceneObjs[currObject].modelDirty = true;
 }
 
 static void adjustAngleYX_spot(vec2 angle_yx) {
     sceneObjs[3].angles[1] += angle_yx[0];
     sceneObjs[3].angles[0] += angle_yx[1];
+    sceneObjs[3].modelDirty = true;
 }
 
 static void lightMenu(int id) {
@@ -700,6 +1823,15 @@ static void lightMenu(int id) {
         toolObj = 3;
         setToolCallbacks(adjustAngleYX_spot, mat2(400, 0, 0, -400),
                          adjustBrightnessY, mat2(1.0, 0.0, 0.0, 10.0));
+    }
+    else if (id == 96) { // Another point light, moved and coloured like any object
+        addObject(55);
+        sceneObjs[currObject].scale = 0.1;
+        sceneObjs[currObject].texId = 0; // Plain texture
+        sceneObjs[currObject].brightness = 0.2;
+        sceneObjs[currObject].light = lightPoint;
+        setToolCallbacks(adjustLocXZ, camRotZ(),
+                         adjustBrightnessY, mat2(1.0, 0.0, 0.0, 10.0));
     }
      	else {
         printf("Error in lightMenu\n");
@@ -763,6 +1895,7 @@ static void materialMenu(int id) {
 
 static void adjustAngleZTexscale(vec2 az_ts) {
     sceneObjs[currObject].angles[2] += az_ts[0];
+    sceneObjs[currObject].modelDirty = true;
     sceneObjs[currObject].texScale += az_ts[1];
 }
 
@@ -812,6 +1945,7 @@ static void makeMenu() {
     glutAddMenuEntry("Move Light 3", 90);
     glutAddMenuEntry("R/G/B/All Light 3", 91);
     glutAddMenuEntry("Direction  Light 3", 95);
+    glutAddMenuEntry("Add Light", 96);
 
     glutCreateMenu(mainmenu);
     glutAddMenuEntry("Rotate/Move Camera", 50);
@@ -895,10 +2029,29 @@ void specialKeys(int key, int x, int y) {
 }
 //----------------------------------------------------------------------------
 
+// Only used with --always-redraw.
 void idle(void) {
     glutPostRedisplay();
 }
 
+// Whether any meshes or textures are still on their way, so that frames
+// should keep coming until they arrive.
+static bool stillLoading() {
+    for (int i = 0; i < numMeshes; i++)
+        if (meshes[i].state == meshLoading) return true;
+    for (int i = 0; i < numTextures; i++)
+        if (textureStates[i] == textureLoading || textureStates[i] == texturePreviewed) return true;
+    return false;
+}
+
+// Called redrawCheckRate times a second (or at the --max-fps rate), to post a
+// redisplay if anything that's drawn has changed (see redraw.h).
+void checkForRedraw(int unused) {
+    if (watchedRegionsChanged() || stillLoading()) glutPostRedisplay();
+    else numFramesSkipped++;
+    glutTimerFunc(redrawCheckInterval(), checkForRedraw, 0);
+}
+
 //----------------------------------------------------------------------------
 
 void reshape(int width, int height) {
@@ -954,13 +2107,18 @@ void reshape(int width, int height) {
 //----------------------------------------------------------------------------
 
 void timer(int unused) {
-    char title[256];
-    sprintf(title, "%s %s: %d Frames Per Second @ %d x %d",
-            lab, programName, numDisplayCalls, windowWidth, windowHeight);
+    char title[256]; // Cut short if it doesn't fit, e.g., with a long program name
+    snprintf(title, sizeof(title), "%s %s: %d Frames Per Second (%d skipped) @ %d x %d, %d triangles in %d draws, %d of %d objects culled (%d hidden), "
+                   "%d binds (%d avoided), %.1f MB of meshes in %.1f MB of pools (%d evicted)",
+            lab, programName, numDisplayCalls, numFramesSkipped, windowWidth, windowHeight, numTrianglesDrawn,
+            numDrawCalls, numObjectsCulled, nObjects, numObjectsOccluded, numBinds, numBindsAvoided,
+            meshBytesLoaded / 1048576.0, poolBytesAllocated() / 1048576.0, numMeshesEvicted);
 
     glutSetWindowTitle(title);
+    writeProfilePercentiles();
 
     numDisplayCalls = 0;
+    numFramesSkipped = 0;
     glutTimerFunc(1000, timer, 1);
 }
 
@@ -978,6 +2136,91 @@ void fileErr(char *fileName) {
     exit(1);
 }
 
+//------Benchmark---------------------------------------------------------------
+
+static double randomCoordinate(double range) {
+    return (rand() % 10000) / 10000.0 * 2.0 * range - range;
+}
+
+// A random mesh other than the ground's, skipping any missing from dataDir.
+static int randomBenchmarkMesh() {
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        int meshNumber = 1 + rand() % (numMeshes - 1);
+        char fileName[256];
+        unsigned long long size;
+        long long modTime;
+        meshSourceFileName(meshNumber, fileName);
+        if (fileSizeAndModTime(fileName, &size, &modTime)) return meshNumber;
+    }
+    fileErr(dataDir);
+    return 0;
+}
+
+// Build a scene from benchSeed, wait until it has all loaded, then time
+// benchFrames frames with the camera circling it, forward and then deferred,
+// and print the results (for --bench, see benchmark.h).
+static void runBenchmark() {
+    if (!makeOffscreenContext(windowWidth, windowHeight)) {
+        printf("Error - couldn't make an offscreen OpenGL context with EGL\n");
+        exit(1);
+    }
+    init();
+    reshape(windowWidth, windowHeight);
+
+    for (int i = 0; i < benchObjects && nObjects < maxObjects; i++) {
+        addObject(randomBenchmarkMesh());
+        sceneObjs[nObjects - 1].loc = vec4(randomCoordinate(2.5), 0.0, randomCoordinate(2.5), 1.0);
+        sceneObjs[nObjects - 1].angles[1] = rand() % 360;
+    }
+    for (int i = 0; i < benchLights && nObjects < maxObjects; i++) { // Dim, so each only reaches a metre (see lightRange)
+        addObject(55);
+        SceneObject *light = &sceneObjs[nObjects - 1];
+        light->loc = vec4(randomCoordinate(2.5), 0.2 + (rand() % 1000) / 1000.0, randomCoordinate(2.5), 1.0);
+        light->scale = 0.02;
+        light->texId = 0;
+        light->rgb = vec3((rand() % 1000) / 1000.0, (rand() % 1000) / 1000.0, (rand() % 1000) / 1000.0);
+        light->rgb[rand() % 3] = 1.0;
+        light->brightness = 0.0047;
+        light->light = lightPoint;
+    }
+
+    // Everything is requested up front, so nothing loads while being timed
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < nObjects; i++) {
+        requestMesh(sceneObjs[i].meshId);
+        requestTexture(sceneObjs[i].texId);
+    }
+    do display(); while (stillLoading());
+    std::chrono::duration<double, std::milli> loadTime = std::chrono::steady_clock::now() - start;
+
+    std::vector<benchmarkRun> runs;
+    for (int deferred = 0; deferred <= 1; deferred++) {
+        benchmarkRun run;
+        run.pipeline = deferred ? "deferred" : "forward";
+        useDeferred = deferred;
+        display(); // Untimed, so the G-buffer is made before the first timed frame
+
+        for (int frame = 0; frame < benchFrames; frame++) {
+            double turn = frame / (double) benchFrames;
+            camRotSidewaysDeg = 360.0 * turn;
+            camRotUpAndOverDeg = 20.0 + 15.0 * sin(2.0 * M_PI * turn);
+            viewDist = 2.5 + cos(4.0 * M_PI * turn); // In and out twice
+
+            std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+            display();
+            run.frameMs.push_back(
+                    std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
+        }
+        run.nTriangles = numTrianglesDrawn;
+        run.nDraws = numDrawCalls;
+        run.nCulled = numObjectsCulled;
+        run.nHidden = numObjectsOccluded;
+        runs.push_back(run);
+    }
+    printBenchmarkJson(runs, loadTime.count(), nObjects, frameLights.size());
+    writeProfilePercentiles(); // For --profile, over the last of the frames
+}
+
 //----------------------------------------------------------------------------
 
 int main(int argc, char *argv[]) {
@@ -986,15 +2229,82 @@ int main(int argc, char *argv[]) {
     for (char *cpointer = argv[0]; *cpointer != 0; cpointer++)
         if (*cpointer == '/' || *cpointer == '\\') programName = cpointer + 1;
 
+    // Options start with "--", anything else is taken as the models-textures directory.
+    char *dataDirArg = NULL;
+    bool bakeOnly = false; // --bake fills the mesh cache and exits, without opening a window
+    bool benchLoaders = false; // --bench-loaders times the .x parser against Assimp and exits
+    bool benchBitmaps = false; // --bench-bitmaps times BMP decoding with each kernel and exits
+    bool benchOcclusion = false; // --bench-occlusion times the software occlusion culling and exits
+    char *profileFile = NULL; // --profile writes percentiles of each phase's time here every second
+    char *traceFile = NULL;   // --trace writes the time of every phase here, as Chrome trace JSON
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bake") == 0) bakeOnly = true;
+        else if (strcmp(argv[i], "--bench-loaders") == 0) benchLoaders = true;
+        else if (strcmp(argv[i], "--bench-bitmaps") == 0) benchBitmaps = true;
+        else if (strcmp(argv[i], "--texture-array") == 0) useTextureArray = true; // See texturearray.h
+        else if (strcmp(argv[i], "--no-indirect") == 0) useMultiDrawIndirect = false; // See drawBatches
+        else if (strcmp(argv[i], "--no-occlusion") == 0) useOcclusionCulling = false; // See cullObjects
+        else if (strcmp(argv[i], "--deferred") == 0) useDeferred = true; // See deferred.h
+        else if (strcmp(argv[i], "--no-shadows") == 0) useShadows = false; // See shadows.h
+        else if (strcmp(argv[i], "--bench-occlusion") == 0) benchOcclusion = true;
+        else if (strcmp(argv[i], "--mip-filter") == 0 && i + 1 < argc) { // See mipmaps.h
+            i++;
+            if (strcmp(argv[i], "kaiser") == 0) textureMipFilter = mipFilterKaiser;
+            else if (strcmp(argv[i], "box") == 0) textureMipFilter = mipFilterBox;
+            else fail("Error - unknown mip filter:", argv[i]);
+        }
+        else if (strcmp(argv[i], "--mesh-budget") == 0 && i + 1 < argc)
+            meshBudgetBytes = atof(argv[++i]) * 1048576.0; // In megabytes
+        else if (strcmp(argv[i], "--always-redraw") == 0) alwaysRedraw = true; // See redraw.h
+        else if (strcmp(argv[i], "--max-fps") == 0 && i + 1 < argc) {
+            maxFramesPerSecond = atoi(argv[++i]);
+            if (maxFramesPerSecond <= 0 || maxFramesPerSecond > 1000) fail("Error - bad frame rate cap:", argv[i]);
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) profileFile = argv[++i]; // See profiler.h
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) traceFile = argv[++i];
+        else if (strcmp(argv[i], "--bench") == 0) benchmarking = true; // See benchmark.h
+        else if (strcmp(argv[i], "--bench-objects") == 0 && i + 1 < argc) benchObjects = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bench-lights") == 0 && i + 1 < argc) benchLights = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bench-frames") == 0 && i + 1 < argc) {
+            benchFrames = atoi(argv[++i]);
+            if (benchFrames <= 0) fail("Error - bad number of frames:", argv[i]);
+        }
+        else if (strcmp(argv[i], "--bench-seed") == 0 && i + 1 < argc) benchSeed = strtoul(argv[++i], NULL, 10);
+        else dataDirArg = argv[i];
+    }
+
     // Set the models-textures directory, via the first argument or some handy defaults.
-    if (argc > 1)
-        strcpy(dataDir, argv[1]);
+    if (dataDirArg != NULL)
+        strcpy(dataDir, dataDirArg);
     else if (EXISTS(dirDefault1)) strcpy(dataDir, dirDefault1);
     else if (EXISTS(dirDefault2)) strcpy(dataDir, dirDefault2);
     else if (EXISTS(dirDefault3)) strcpy(dataDir, dirDefault3);
     else if (EXISTS(dirDefault4)) strcpy(dataDir, dirDefault4);
     else fileErr(dirDefault1);
 
+    if (bakeOnly) {
+        bakeAllMeshes();
+        bakeAllTextures();
+        return 0;
+    }
+    if (benchLoaders) {
+        benchmarkMeshLoaders();
+        return 0;
+    }
+    if (benchBitmaps) {
+        benchmarkBitmapDecoding();
+        return 0;
+    }
+    if (benchOcclusion) {
+        benchmarkOcclusion();
+        return 0;
+    }
+    if (profileFile != NULL || traceFile != NULL) openProfileFiles(profileFile, traceFile);
+    if (benchmarking) {
+        runBenchmark();
+        return 0;
+    }
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
     glutInitWindowSize(windowWidth, windowHeight);
@@ -1018,7 +2328,8 @@ int main(int argc, char *argv[]) {
     glutDisplayFunc(display);
     glutKeyboardFunc(keyboard);
     glutSpecialFunc(specialKeys);
-    glutIdleFunc(idle);
+    if (alwaysRedraw) glutIdleFunc(idle);
+    else glutTimerFunc(redrawCheckInterval(), checkForRedraw, 0);
 
     glutMouseFunc(mouseClickOrScroll);
     glutPassiveMotionFunc(mousePassiveMotion);
@@ -0,0 +1,196 @@
+// Shader program wrapper (shaderprogram.h)
+//
+// Everything the scene shaders take from the program is looked up by name
+// once, straight after it's built, so drawing never calls glGet*Location.
+// The same shader files can be built more than one way, with #defines put in
+// after their #version line (see readShaderSource), and every build of the
+// scene shaders has its attributes at the same fixed locations, so the vertex
+// arrays work with any of them (see shadervariants.h).
+//
+// What the shader needs to find its cluster of lights is the same for every
+// object in a frame, so rather than separate uniforms it's one std140 uniform
+// block (Lights in fStart.glsl), filled in a lightsBlock and uploaded with a
+// single glBufferSubData, as are the shadow maps' matrices.  The lights
+// themselves are in buffer textures (see lightclusters.h).
+
+typedef struct {
+    GLuint id;
+
+    // Vertex attributes
+    GLuint vPosition, vNormal, vTexCoord;
+    // Per-instance attributes (see drawBatches in scene-start.cpp)
+    GLuint iModelView, iAmbientProduct, iDiffuseProduct, iSpecularProduct, iShineTexScale;
+    GLuint iTexLayer, iTexTile; // Where the texture is in the texture array, if it is
+
+    // Uniforms
+    GLint projection;
+    GLint texture;
+    GLint textureArray, textureArraySize; // See texturearray.h
+    GLint lightTexture, clusterTexture, lightIndexTexture; // See lightclusters.h
+    GLint pointShadowMap, directionalShadowMap, spotShadowMap; // See shadows.h
+    GLuint lightsBlock; // The index of the Lights uniform block
+} sceneShader;
+
+// The Lights uniform block, laid out by the std140 rules.
+typedef struct {
+    // The clusters' tiles per pixel across and up, then sliceScale and
+    // sliceBias, to find a fragment's cluster (see lightclusters.h)
+    GLfloat clusterScale[4];
+    GLfloat clusterSize[4]; // clusterTilesX, clusterTilesY and clusterSlices
+    GLfloat shadowMatrices[3][16]; // Column major, from eye coordinates to each shadow map's (see shadows.h)
+    GLfloat shadowCubeRange[4];    // The point light's cube map's near and far planes
+} lightsBlock;
+
+const GLuint lightsBinding = 0; // The uniform buffer binding point for the Lights block
+
+// Read a shader file, putting defines (e.g., "#define GBUFFER\n") in after
+// its first line, which must be its #version.
+static std::string readShaderSource(const char *fileName, const char *defines) {
+    FILE *file = fopen(fileName, "rb");
+    if (file == NULL) fail("Error - couldn't read the shader", (char *) fileName);
+    std::string source;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        source.append(buffer, n);
+    fclose(file);
+
+    if (defines != NULL) {
+        size_t lineEnd = source.find('\n');
+        source.insert(lineEnd == std::string::npos ? source.size() : lineEnd + 1, defines);
+    }
+    return source;
+}
+
+static GLuint compileShader(GLenum type, const std::string &source) {
+    const GLchar *text = source.c_str();
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &text, NULL);
+    glCompileShader(shader);
+    return shader;
+}
+
+// Start compiling and linking a program from the sources.  Before linking,
+// bindAttributes (if not NULL) can fix the attribute locations.  Nothing
+// waits for the driver to finish, so with parallel shader compiling (see
+// shadervariants.h) it carries on in the background until finishProgram.
+GLuint startProgram(const std::string &vSource, const std::string &fSource, void (*bindAttributes)(GLuint program),
+                    bool retrievable = false) {
+    GLuint program = glCreateProgram();
+    GLuint shaders[2] = {compileShader(GL_VERTEX_SHADER, vSource), compileShader(GL_FRAGMENT_SHADER, fSource)};
+    glAttachShader(program, shaders[0]);
+    glAttachShader(program, shaders[1]);
+    if (bindAttributes != NULL) bindAttributes(program);
+#ifndef __APPLE__
+    if (retrievable) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE); // For glGetProgramBinary
+#endif
+    glLinkProgram(program);
+    glDeleteShader(shaders[0]); // Only actually deleted with the program
+    glDeleteShader(shaders[1]);
+    return program;
+}
+
+// Wait for a program from startProgram, and if it failed print why, naming it
+// by description, and exit.
+void finishProgram(GLuint program, const char *description) {
+    GLint linked;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (linked) {
+        CheckError();
+        return;
+    }
+
+    GLuint shaders[2];
+    GLsizei nShaders = 0;
+    glGetAttachedShaders(program, 2, &nShaders, shaders);
+    for (GLsizei i = 0; i < nShaders; i++) {
+        GLint compiled, logSize;
+        glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &compiled);
+        if (compiled) continue;
+        glGetShaderiv(shaders[i], GL_INFO_LOG_LENGTH, &logSize);
+        std::vector<char> log(logSize + 1);
+        glGetShaderInfoLog(shaders[i], logSize, NULL, log.data());
+        printf("%s failed to compile:\n%s\n", description, log.data());
+    }
+    GLint logSize;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logSize);
+    std::vector<char> log(logSize + 1);
+    glGetProgramInfoLog(program, logSize, NULL, log.data());
+    printf("%s failed to link:\n%s\n", description, log.data());
+    exit(1);
+}
+
+// Compile and link a program, with defines (may be NULL) put into both shaders.
+// Before linking, bindAttributes (if not NULL) can fix the attribute locations.
+GLuint buildProgram(const char *vShaderFile, const char *fShaderFile, const char *defines,
+                    void (*bindAttributes)(GLuint program)) {
+    GLuint program = startProgram(readShaderSource(vShaderFile, defines), readShaderSource(fShaderFile, defines),
+                                  bindAttributes);
+    std::string description = std::string(vShaderFile) + " and " + fShaderFile;
+    if (defines != NULL) description += std::string(" with ") + defines;
+    finishProgram(program, description.c_str());
+    return program;
+}
+
+// The fixed locations of the scene shaders' attributes, indexed by location.
+// iModelView is a mat4 so it takes four.
+const char *sceneAttributeNames[] = {"vPosition", "vNormal", "vTexCoord", "iModelView", NULL, NULL, NULL,
+                                     "iAmbientProduct", "iDiffuseProduct", "iSpecularProduct", "iShineTexScale",
+                                     "iTexLayer", "iTexTile"};
+const GLuint numSceneAttributeLocations = sizeof(sceneAttributeNames) / sizeof(sceneAttributeNames[0]);
+
+static void bindSceneAttributes(GLuint program) {
+    for (GLuint location = 0; location < numSceneAttributeLocations; location++)
+        if (sceneAttributeNames[location] != NULL)
+            glBindAttribLocation(program, location, sceneAttributeNames[location]);
+}
+
+// Find a vertex attribute's fixed location.  Builds that don't use it (e.g.,
+// untextured ones, see shadervariants.h) still have it there.
+static GLuint findAttribute(const char *name) {
+    for (GLuint location = 0; location < numSceneAttributeLocations; location++)
+        if (sceneAttributeNames[location] != NULL && strcmp(sceneAttributeNames[location], name) == 0)
+            return location;
+    fail("Error - no such shader attribute:", (char *) name);
+    return 0;
+}
+
+// Look up what's needed from a linked build of the scene shaders.  Builds
+// that don't light anything needn't have the Lights block.
+sceneShader findSceneShaderLocations(GLuint program, bool lit) {
+    sceneShader shader;
+    shader.id = program;
+
+    shader.vPosition = findAttribute("vPosition");
+    shader.vNormal = findAttribute("vNormal");
+    shader.vTexCoord = findAttribute("vTexCoord");
+    shader.iModelView = findAttribute("iModelView");
+    shader.iAmbientProduct = findAttribute("iAmbientProduct");
+    shader.iDiffuseProduct = findAttribute("iDiffuseProduct");
+    shader.iSpecularProduct = findAttribute("iSpecularProduct");
+    shader.iShineTexScale = findAttribute("iShineTexScale");
+    shader.iTexLayer = findAttribute("iTexLayer");
+    shader.iTexTile = findAttribute("iTexTile");
+
+    shader.projection = glGetUniformLocation(shader.id, "Projection");
+    shader.texture = glGetUniformLocation(shader.id, "texture");
+    shader.textureArray = glGetUniformLocation(shader.id, "textureArray");
+    shader.textureArraySize = glGetUniformLocation(shader.id, "textureArraySize");
+    shader.lightTexture = glGetUniformLocation(shader.id, "lightTexture");
+    shader.clusterTexture = glGetUniformLocation(shader.id, "clusterTexture");
+    shader.lightIndexTexture = glGetUniformLocation(shader.id, "lightIndexTexture");
+    shader.pointShadowMap = glGetUniformLocation(shader.id, "pointShadowMap");
+    shader.directionalShadowMap = glGetUniformLocation(shader.id, "directionalShadowMap");
+    shader.spotShadowMap = glGetUniformLocation(shader.id, "spotShadowMap");
+
+    shader.lightsBlock = glGetUniformBlockIndex(shader.id, "Lights");
+    if (shader.lightsBlock != GL_INVALID_INDEX)
+        glUniformBlockBinding(shader.id, shader.lightsBlock, lightsBinding);
+    else if (lit) {
+        printf("Error - the scene shaders have no Lights uniform block\n");
+        exit(1);
+    }
+    CheckError();
+
+    return shader;
+}
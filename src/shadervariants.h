@@ -0,0 +1,230 @@
+// Shader variants (shadervariants.h)
+//
+// fStart.glsl can handle every case: textures in the texture array or not,
+// spotlights, shadows, and writing the G-buffer for --deferred.  Rather than every draw
+// paying for the branches it doesn't take, the scene shaders are built as
+// variants with #defines, one for each combination of the variant flags that
+// actually gets drawn (see sceneShaderVariant), each built the first time
+// it's asked for.
+//
+// Where the driver can compile in the background (KHR_parallel_shader_compile)
+// init starts every variant the options might need, and until one is ready
+// its fallback draws instead: the variant that does everything it would and
+// more, e.g., with spotlights even though there aren't any.
+//
+// Linking is the slow part of building, so each linked program is saved with
+// glGetProgramBinary to cacheDir, named by a hash of its sources (with the
+// defines) and of the driver and GL version, and later runs load it with
+// glProgramBinary rather than compiling.  A new driver changes the hash, and
+// if one rejects a binary anyway the variant is compiled from source.
+
+enum {
+    variantGBuffer = 1,      // Writing the G-buffer (see deferred.h), so nothing is lit
+    variantTextureArray = 2, // Textures may be in the texture array (--texture-array)
+    variantSpotLights = 4,   // Some of the lights are spotlights
+    variantUntextured = 8,   // Drawn with the placeholder texture, which is plain white
+    variantShadows = 16,     // Lights may cast shadows (see shadows.h), unless --no-shadows
+    numShaderVariants = 32
+};
+
+const unsigned variantOptions = variantTextureArray | variantShadows; // The flags set by options, not each frame
+
+const char *variantDefines[] = {"#define GBUFFER\n", "#define TEXTURE_ARRAY\n", "#define SPOT_LIGHTS\n",
+                                "#define UNTEXTURED\n", "#define SHADOWS\n"};
+
+enum variantState { variantNotStarted, variantBuilding, variantReady };
+
+typedef struct {
+    variantState state;
+    sceneShader shader;            // Once ready
+    GLuint program;                // While building
+    bool fromCache;                // Loaded from a program binary rather than compiled
+    unsigned long long sourceHash; // Of its sources and the driver, naming its program binary
+} shaderVariant;
+
+shaderVariant shaderVariants[numShaderVariants];
+std::string shaderDriver;      // The renderer and GL version, hashed with the sources
+bool parallelShaderCompile = false;
+bool haveProgramBinaries = false;
+int numVariantsCompiled = 0, numVariantsFromCache = 0;
+
+// Called with each variant as it becomes ready, to set the uniforms that
+// never change (e.g., which texture units the samplers use).
+void (*sceneVariantReady)(const sceneShader &shader) = NULL;
+
+const char programCacheMagic[4] = {'G', 'P', 'R', 'G'};
+const GLuint programCacheVersion = 1; // Increase whenever the file layout changes
+
+// The start of a program binary file, with the binary straight after.
+typedef struct {
+    char magic[4];
+    GLuint version;
+    GLenum binaryFormat;
+    GLuint binarySize;
+    unsigned long long sourceHash;
+} programCacheHeader;
+
+// The G-buffer lights nothing, so whether there are spotlights or shadows
+// doesn't matter.
+static unsigned canonicalVariant(unsigned variant) {
+    return variant & variantGBuffer ? variant & ~(variantSpotLights | variantShadows) : variant;
+}
+
+// The variant that stands in for one that isn't ready yet.
+static unsigned fallbackVariant(unsigned variant) {
+    return canonicalVariant((variant | variantSpotLights) & ~variantUntextured);
+}
+
+//------Program binaries--------------------------------------------------------
+
+// Fills a fileName of 256 chars, and fails if the path won't fit.
+static void programCacheFileName(unsigned long long hash, char *fileName) {
+    if (snprintf(fileName, 256, "%s/program-%016llx.bin", cacheDir, hash) >= 256)
+        fail("Error - the cache path is too long:", cacheDir);
+}
+
+// Load a program saved by saveProgramBinary, or return 0 if there isn't one
+// or the driver won't take it.
+static GLuint loadProgramBinary(unsigned long long hash) {
+    char fileName[256];
+    mappedFile mf;
+    programCacheFileName(hash, fileName);
+    if (!haveProgramBinaries || !mapFile(fileName, &mf)) return 0;
+
+    const programCacheHeader *header = (const programCacheHeader *) mf.data;
+    GLuint program = 0;
+    if (mf.size >= sizeof(programCacheHeader)
+        && memcmp(header->magic, programCacheMagic, sizeof(header->magic)) == 0
+        && header->version == programCacheVersion && header->sourceHash == hash
+        && mf.size == sizeof(programCacheHeader) + header->binarySize) {
+#ifndef __APPLE__
+        program = glCreateProgram();
+        glProgramBinary(program, header->binaryFormat, header + 1, header->binarySize);
+        GLint linked;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (!linked) {
+            glDeleteProgram(program);
+            while (glGetError() != GL_NO_ERROR) {} // An unknown format is reported as an error, but it's no problem
+            program = 0;
+        }
+#endif
+    }
+    unmapFile(&mf);
+    return program;
+}
+
+static void saveProgramBinary(GLuint program, unsigned long long hash) {
+#ifndef __APPLE__
+    GLint size = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+    if (size <= 0) return;
+
+    std::vector<GLubyte> blob(sizeof(programCacheHeader) + size);
+    programCacheHeader *header = (programCacheHeader *) blob.data();
+    memcpy(header->magic, programCacheMagic, sizeof(header->magic));
+    header->version = programCacheVersion;
+    header->binarySize = size;
+    header->sourceHash = hash;
+    glGetProgramBinary(program, size, NULL, &header->binaryFormat, header + 1);
+    CheckError();
+
+    char fileName[256];
+    programCacheFileName(hash, fileName);
+    if (!writeFileAtomically(fileName, blob.data(), blob.size()))
+        printf("Warning - couldn't write the program binary %s\n", fileName);
+#endif
+}
+
+//------Building the variants---------------------------------------------------
+
+static void startVariant(unsigned variant) {
+    shaderVariant *v = &shaderVariants[variant];
+    std::string defines;
+    for (int flag = 0; (1u << flag) < numShaderVariants; flag++)
+        if (variant & (1u << flag)) defines += variantDefines[flag];
+    std::string vSource = readShaderSource("res/shaders/vStart.glsl", defines.c_str());
+    std::string fSource = readShaderSource("res/shaders/fStart.glsl", defines.c_str());
+
+    std::string key = vSource + '\0' + fSource + '\0' + shaderDriver;
+    v->sourceHash = hashBytes((const GLubyte *) key.data(), key.size());
+    v->program = loadProgramBinary(v->sourceHash);
+    v->fromCache = v->program != 0;
+    if (!v->fromCache) v->program = startProgram(vSource, fSource, bindSceneAttributes, haveProgramBinaries);
+    v->state = variantBuilding;
+}
+
+// Whether a variant that's building can be finished without waiting.
+static bool variantBuilt(unsigned variant) {
+    if (!parallelShaderCompile) return true;
+    GLint done = GL_TRUE;
+#ifndef __APPLE__
+    glGetProgramiv(shaderVariants[variant].program, GL_COMPLETION_STATUS_KHR, &done);
+#endif
+    return done;
+}
+
+static void finishVariant(unsigned variant) {
+    shaderVariant *v = &shaderVariants[variant];
+    char description[64];
+    sprintf(description, "Scene shader variant %u", variant);
+    finishProgram(v->program, description);
+    if (v->fromCache) {
+        numVariantsFromCache++;
+    } else {
+        saveProgramBinary(v->program, v->sourceHash);
+        numVariantsCompiled++;
+    }
+    v->shader = findSceneShaderLocations(v->program, !(variant & variantGBuffer));
+    v->state = variantReady;
+    if (sceneVariantReady != NULL) sceneVariantReady(v->shader);
+}
+
+// Called from init.  optionFlags are the variant flags set by the options
+// (see variantOptions), and ready is called with each variant
+// as it becomes ready (see sceneVariantReady).
+void initShaderVariants(unsigned optionFlags, void (*ready)(const sceneShader &shader)) {
+    sceneVariantReady = ready;
+    shaderDriver = std::string((const char *) glGetString(GL_RENDERER)) + '\0'
+                   + (const char *) glGetString(GL_VERSION);
+#ifndef __APPLE__
+    GLint nFormats = 0;
+    if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary) glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nFormats);
+    haveProgramBinaries = nFormats > 0;
+
+    if (GLEW_KHR_parallel_shader_compile) {
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF); // As many as the driver likes
+        parallelShaderCompile = true;
+    } else if (GLEW_ARB_parallel_shader_compile) {
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+        parallelShaderCompile = true;
+    }
+#endif
+    CheckError();
+
+    // Everything that might be drawn, so it's all ready by the time it is
+    if (parallelShaderCompile)
+        for (unsigned variant = 0; variant < numShaderVariants; variant++)
+            if (canonicalVariant((variant & ~variantOptions) | optionFlags) == variant) startVariant(variant);
+}
+
+// Finish the variants that are done building in the background, so that
+// their binaries are saved even if they're never drawn with (from display).
+void finishBuiltVariants() {
+    if (!parallelShaderCompile) return;
+    for (unsigned variant = 0; variant < numShaderVariants; variant++)
+        if (shaderVariants[variant].state == variantBuilding && variantBuilt(variant)) finishVariant(variant);
+}
+
+// A ready build of the scene shaders for drawing with the given variant
+// flags: that variant, or if it's still compiling in the background its
+// fallback.  Anything not started yet is started now, which without parallel
+// compiling means built.
+const sceneShader &sceneShaderVariant(unsigned variant) {
+    variant = canonicalVariant(variant);
+    shaderVariant *v = &shaderVariants[variant];
+    if (v->state == variantNotStarted) startVariant(variant);
+    if (v->state == variantBuilding && (variantBuilt(variant) || fallbackVariant(variant) == variant))
+        finishVariant(variant);
+    if (v->state == variantReady) return v->shader;
+    return sceneShaderVariant(fallbackVariant(variant));
+}
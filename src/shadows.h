@@ -0,0 +1,482 @@
+// Shadow maps (shadows.h)
+//
+// The three lights every scene starts with (objects 1, 2 and 3, see init)
+// cast shadows, each from depth drawn from the light:
+//   - the point light, into a cube map of six 90 degree views around it, out
+//     to its range (see lightRange),
+//   - the directional light, into a 2D map with an orthographic view along
+//     its direction, over a sphere around the objects, and
+//   - the spotlight, into a 2D map with one perspective view down its
+//     direction, as wide as its cutoff and out to its range.
+// Other lights don't, so however many there are they cost no extra passes.
+//
+// Drawing the objects into every view every frame would multiply the cost of
+// the scene, so the maps are kept from frame to frame.  Each view has two
+// layers: staticDepth, with only the objects that haven't moved for
+// staticFrames frames, and the map itself, which is a copy of staticDepth
+// with the other objects drawn on top.  Each frame the casters are compared
+// with how they were last frame, setting their dirty flags, and then:
+//   - if the light has moved (i.e., a view's matrix has changed), the view
+//     draws both layers,
+//   - an object that became static or stopped being (or was added or removed)
+//     within the view, where it is now or where it was, redraws its static
+//     layer and so both,
+//   - an object that moved within the view only redraws the map, which is a
+//     copy and the few objects that aren't static,
+// and otherwise the view is used as it is.  A layer that left out casters
+// whose meshes were still loading is drawn again next frame.
+//
+// The depth passes only need positions, so they read them from each vertex
+// pool's buffer of packed positions (see shadowMesh), without fetching the rest
+// of each vertex, and vShadow.glsl and fShadow.glsl write nothing but depth.
+//
+// The 2D maps are compared in the shader with shadow2DProj and linear
+// filtering, so each lookup blends four comparisons.  The cube map is read as
+// plain depth and compared in the shader (see shadowFactor in fStart.glsl).
+// Shadows only take away a light's diffuse and specular light.
+
+bool useShadows = true; // Turned off with --no-shadows
+
+enum { pointShadow, directionalShadow, spotShadow, numShadowMaps };
+
+const int shadowMapSize = 1024; // The 2D maps' width and height
+const int shadowCubeSize = 512; // Each face of the cube map
+const unsigned staticFrames = 30; // Unmoved for this many frames, an object is drawn into the static layers
+const float shadowNear = 0.02;  // The point and spot lights' near planes
+
+// The maps' texture units, after the lights' (see lightclusters.h) and
+// deferred shading's (see deferred.h).
+const GLenum shadowTextureUnit = lightOrderTextureUnit + 1;
+
+typedef struct {
+    mat4 viewProjection;     // World to the view's clip coordinates
+    frustum f;               // Likewise, in world coordinates
+    GLuint framebuffer;      // Drawing into the map
+    GLuint staticFramebuffer, staticDepth; // The static layer, a renderbuffer
+    bool staticValid, valid; // Whether each layer is up to date
+} shadowView;
+
+typedef struct {
+    bool lit;          // The light exists, and reaches something
+    GLenum target;     // GL_TEXTURE_CUBE_MAP for the point light, else GL_TEXTURE_2D
+    int size, nViews;
+    shadowView views[6];
+    GLuint depth;      // The texture the shaders read
+    // From world coordinates: for 2D maps, to texture coordinates and depth;
+    // for the cube map, to coordinates around the light.
+    mat4 fromWorld;
+    // The light in world coordinates, from aimShadowMap
+    vec4 position;     // For the directional light, the direction towards it
+    vec3 direction;    // Which way the spotlight points
+    float range;       // How far it reaches (see lightRange), the far plane of the point and spot lights
+} shadowMap;
+
+shadowMap shadowMaps[numShadowMaps];
+
+typedef struct {
+    GLuint id;
+    GLint modelViewProjection;
+} depthShader;
+
+depthShader shadowShader;
+
+// One object, as display gives it to updateShadowMaps.
+typedef struct {
+    mat4 model;       // Its model matrix (see cullObjects)
+    int meshId;
+    bool casts;       // Lights don't, or they'd shadow everything they light
+} shadowCaster;
+
+// Filled in each frame by display, one per object, with their bounding
+// spheres in world coordinates.  The spheres' arrays have room for a multiple
+// of 4 (see cullSpheres).
+std::vector<shadowCaster> shadowCasters;
+std::vector<float> casterX, casterY, casterZ, casterRadius;
+
+// Where a mesh is in the vertex pools, for drawing it into a depth pass.
+typedef struct {
+    GLuint vao;       // The pool's VAO reading just its positions
+    mat4 meshModel;   // Undoes the position quantization
+    GLsizei count;
+    GLuint firstIndex, baseVertex;
+    GLenum indexType; // Of the index pool it's in
+    GLuint indexSize;
+} shadowMesh;
+
+// Fills in where a mesh is, or if it isn't loaded requests it and returns
+// false (set by makeShadowMaps).
+bool (*findShadowMesh)(int meshId, shadowMesh *mesh) = NULL;
+
+enum { casterMoved = 1, casterRestaticed = 2 }; // Dirty flags
+
+typedef struct {
+    shadowCaster last;   // As it was last frame
+    float x, y, z, radius; // Its bounding sphere last frame, radius -1 if it's new
+    unsigned lastMoved;  // The shadow frame it last moved in
+    bool isStatic;       // In the static layers
+    GLubyte dirty;       // casterMoved and casterRestaticed, for this frame
+} casterState;
+
+std::vector<casterState> casterStates;
+static std::vector<GLubyte> casterCulling;
+unsigned shadowFrame = 0; // Counts calls of updateShadowMaps
+int numShadowViewsDrawn = 0, numShadowCastersDrawn = 0; // In the last frame
+
+static void bindShadowAttributes(GLuint program) {
+    glBindAttribLocation(program, 0, "vPosition");
+}
+
+static GLuint makeShadowFramebuffer(GLenum attachTarget, GLuint texture) {
+    GLuint framebuffer;
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    if (attachTarget == GL_RENDERBUFFER)
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, texture);
+    else
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, attachTarget, texture, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        printf("Error - a shadow map framebuffer isn't complete, so shadows need --no-shadows here\n");
+        exit(1);
+    }
+    return framebuffer;
+}
+
+static void makeShadowMap(shadowMap *map, GLenum target, int size) {
+    map->target = target;
+    map->size = size;
+    map->nViews = target == GL_TEXTURE_CUBE_MAP ? 6 : 1;
+    glGenTextures(1, &map->depth);
+    glBindTexture(target, map->depth);
+    if (target == GL_TEXTURE_CUBE_MAP) {
+        // Read as plain depth, and compared in the shader
+        for (int face = 0; face < 6; face++)
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_DEPTH_COMPONENT24, size, size, 0,
+                         GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(target, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    } else {
+        // Outside the map nothing is in shadow
+        const GLfloat border[4] = {1.0, 1.0, 1.0, 1.0};
+        glTexImage2D(target, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+        glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+        glTexParameterfv(target, GL_TEXTURE_BORDER_COLOR, border);
+        glTexParameteri(target, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(target, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    }
+    glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, 0);
+
+    for (int i = 0; i < map->nViews; i++) {
+        shadowView *view = &map->views[i];
+        view->framebuffer = makeShadowFramebuffer(
+                target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + i : target, map->depth);
+        glGenRenderbuffers(1, &view->staticDepth);
+        glBindRenderbuffer(GL_RENDERBUFFER, view->staticDepth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size, size);
+        view->staticFramebuffer = makeShadowFramebuffer(GL_RENDERBUFFER, view->staticDepth);
+        view->staticValid = view->valid = false;
+    }
+}
+
+// Build the depth shaders and the maps, and bind the maps to their units for
+// good.  Called from init, with findMesh to find the casters' meshes (see
+// findShadowMesh).  The maps' units are set in the lighting shader here, and
+// in each build of the scene shaders by init.
+void makeShadowMaps(bool (*findMesh)(int meshId, shadowMesh *mesh)) {
+    findShadowMesh = findMesh;
+    glUseProgram(lightShader.id);
+    glUniform1i(glGetUniformLocation(lightShader.id, "pointShadowMap"), shadowTextureUnit - GL_TEXTURE0 + pointShadow);
+    glUniform1i(glGetUniformLocation(lightShader.id, "directionalShadowMap"),
+                shadowTextureUnit - GL_TEXTURE0 + directionalShadow);
+    glUniform1i(glGetUniformLocation(lightShader.id, "spotShadowMap"), shadowTextureUnit - GL_TEXTURE0 + spotShadow);
+    GLuint block = glGetUniformBlockIndex(lightShader.id, "Lights");
+    if (block != GL_INVALID_INDEX) glUniformBlockBinding(lightShader.id, block, lightsBinding);
+    if (!useShadows) return;
+
+    shadowShader.id = buildProgram("res/shaders/vShadow.glsl", "res/shaders/fShadow.glsl", NULL,
+                                   bindShadowAttributes);
+    shadowShader.modelViewProjection = glGetUniformLocation(shadowShader.id, "ModelViewProjection");
+
+    GLint framebuffer;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+    for (int i = 0; i < numShadowMaps; i++) {
+        glActiveTexture(shadowTextureUnit + i);
+        makeShadowMap(&shadowMaps[i], i == pointShadow ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D,
+                      i == pointShadow ? shadowCubeSize : shadowMapSize);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    CheckError();
+}
+
+// Which shadow map the given object casts, if it's a light of the given type,
+// or -1 if none.
+int shadowMapOf(int object, int type) {
+    const int types[numShadowMaps] = {lightPoint, lightDirectional, lightSpot};
+    if (!useShadows || object < 1 || object > numShadowMaps || types[object - 1] != type) return -1;
+    return object - 1;
+}
+
+static void setViewMatrix(shadowMap *map, int i, const mat4 &viewProjection) {
+    shadowView *view = &map->views[i];
+    if (memcmp(&view->viewProjection, &viewProjection, sizeof(mat4)) != 0)
+        view->staticValid = view->valid = false; // The light moved
+    view->viewProjection = viewProjection;
+    view->f = frustumFromMatrix(viewProjection);
+}
+
+// Clip coordinates to texture coordinates and depth, from 0 to 1.
+static mat4 shadowBias() {
+    return Translate(0.5, 0.5, 0.5) * Scale(0.5, 0.5, 0.5);
+}
+
+// Aim a light's map, from the light in world coordinates: its position (or
+// for a directional light, the direction towards it), the direction a
+// spotlight points in, and its range (see lightRange).  Called by display
+// each frame for each light that casts shadows (see shadowMapOf).
+void aimShadowMap(int i, const vec4 &position, const vec3 &direction, float range) {
+    shadowMap *map = &shadowMaps[i];
+    map->lit = range > shadowNear;
+    map->position = position;
+    map->direction = direction;
+    map->range = range;
+}
+
+// The views' matrices, from the light, noting if they've changed.
+static void setShadowViews(int i) {
+    shadowMap *map = &shadowMaps[i];
+    vec4 position = map->position;
+    if (i == pointShadow) {
+        // The cube map's faces, in GL's order, each looking down an axis
+        const vec4 faceDirections[6] = {vec4(1, 0, 0, 0), vec4(-1, 0, 0, 0), vec4(0, 1, 0, 0),
+                                        vec4(0, -1, 0, 0), vec4(0, 0, 1, 0), vec4(0, 0, -1, 0)};
+        const vec4 faceUps[6] = {vec4(0, -1, 0, 0), vec4(0, -1, 0, 0), vec4(0, 0, 1, 0),
+                                 vec4(0, 0, -1, 0), vec4(0, -1, 0, 0), vec4(0, -1, 0, 0)};
+        mat4 faceProjection = Perspective(90.0, 1.0, shadowNear, map->range);
+        for (int face = 0; face < 6; face++)
+            setViewMatrix(map, face, faceProjection * LookAt(position, position + faceDirections[face], faceUps[face]));
+        map->fromWorld = Translate(-position.x, -position.y, -position.z);
+        return;
+    }
+
+    vec4 eye = position, at = position + vec4(map->direction, 0.0);
+    mat4 projection = Perspective(2.0 * acos(spotCosCutoff) / DegreesToRadians, 1.0, shadowNear, map->range);
+    if (i == directionalShadow) {
+        // Around the casters that have sizes, a little bigger and snapped to a
+        // grid so that the view only moves when they move a fair way
+        vec3 lo(1e30, 1e30, 1e30), hi(-1e30, -1e30, -1e30);
+        for (size_t j = 0; j < shadowCasters.size(); j++) {
+            if (!shadowCasters[j].casts || casterRadius[j] > 1e20) continue;
+            vec3 centre(casterX[j], casterY[j], casterZ[j]);
+            for (int axis = 0; axis < 3; axis++) {
+                lo[axis] = std::min(lo[axis], centre[axis] - casterRadius[j]);
+                hi[axis] = std::max(hi[axis], centre[axis] + casterRadius[j]);
+            }
+        }
+        if (lo.x > hi.x) lo = hi = vec3(0.0, 0.0, 0.0);
+        float radius = std::max(0.5 * length(hi - lo), 1.0);
+        radius = pow(2.0, ceil(log2(radius) * 4.0) / 4.0);
+        float grid = radius / 8.0;
+        vec4 centre(0.0, 0.0, 0.0, 1.0);
+        for (int axis = 0; axis < 3; axis++)
+            centre[axis] = grid * floor(0.5 * (lo[axis] + hi[axis]) / grid + 0.5);
+        vec3 towards = normalize(vec3(position.x, position.y, position.z));
+        eye = centre + vec4(towards * radius, 0.0);
+        at = centre;
+        projection = Ortho(-radius, radius, -radius, radius, 0.0, 2.0 * radius);
+    }
+    vec3 forward = normalize(vec3(at.x - eye.x, at.y - eye.y, at.z - eye.z));
+    vec4 up = fabs(forward.y) > 0.99 ? vec4(1.0, 0.0, 0.0, 0.0) : vec4(0.0, 1.0, 0.0, 0.0);
+    setViewMatrix(map, 0, projection * LookAt(eye, at, up));
+    map->fromWorld = shadowBias() * map->views[0].viewProjection;
+}
+
+// Set the casters' dirty flags by comparing them with last frame, and decide
+// which are static.  Objects past the end of shadowCasters were removed.
+static void markMovedCasters() {
+    size_t n = shadowCasters.size();
+    for (size_t i = 0; i < casterStates.size(); i++) {
+        casterState *state = &casterStates[i];
+        state->dirty = 0;
+        if (i >= n) {
+            state->dirty = casterMoved | (state->isStatic ? casterRestaticed : 0);
+            state->isStatic = false;
+            continue;
+        }
+        const shadowCaster &caster = shadowCasters[i];
+        bool changed = memcmp(&caster.model, &state->last.model, sizeof(mat4)) != 0
+                       || caster.meshId != state->last.meshId || caster.casts != state->last.casts;
+        if (changed && (caster.casts || state->last.casts)) { // Lights moving only matter to their own maps
+            state->dirty = casterMoved;
+            state->lastMoved = shadowFrame;
+        }
+        bool isStatic = caster.casts && shadowFrame - state->lastMoved >= staticFrames;
+        if (isStatic != state->isStatic) state->dirty |= casterRestaticed;
+        state->isStatic = isStatic;
+    }
+    for (size_t i = casterStates.size(); i < n; i++) {
+        casterState state;
+        state.last = shadowCasters[i];
+        state.x = state.y = state.z = 0.0;
+        state.radius = -1.0; // No sphere last frame
+        state.lastMoved = shadowFrame;
+        state.isStatic = false;
+        state.dirty = casterMoved;
+        casterStates.push_back(state);
+    }
+}
+
+// Whether a caster is within a view, now or last frame.
+static bool casterInView(const frustum &f, size_t i) {
+    float x[4] = {0.0}, y[4] = {0.0}, z[4] = {0.0}, r[4] = {0.0};
+    GLubyte results[4];
+    int n = 0;
+    if (i < shadowCasters.size()) {
+        x[n] = casterX[i];
+        y[n] = casterY[i];
+        z[n] = casterZ[i];
+        r[n++] = casterRadius[i];
+    }
+    const casterState &state = casterStates[i];
+    if (state.radius >= 0.0) {
+        x[n] = state.x;
+        y[n] = state.y;
+        z[n] = state.z;
+        r[n++] = state.radius;
+    }
+    cullSpheres(f, x, y, z, r, n, results);
+    for (int j = 0; j < n; j++)
+        if (results[j] != cullOutside) return true;
+    return false;
+}
+
+// Draw the casters in a view into the bound framebuffer, either the static
+// ones or the others.  Returns false if some were left out while they load.
+static bool drawCasters(const shadowView *view, bool staticLayer, int *nDraws) {
+    size_t n = shadowCasters.size();
+    casterCulling.resize((n + 3) & ~3);
+    cullSpheres(view->f, casterX.data(), casterY.data(), casterZ.data(), casterRadius.data(), n, casterCulling.data());
+
+    bool complete = true;
+    GLuint boundVao = 0;
+    for (size_t i = 0; i < n; i++) {
+        const shadowCaster &caster = shadowCasters[i];
+        if (!caster.casts || casterStates[i].isStatic != staticLayer || casterCulling[i] == cullOutside) continue;
+        shadowMesh mesh;
+        if (!findShadowMesh(caster.meshId, &mesh)) {
+            complete = false;
+            continue;
+        }
+        if (mesh.vao != boundVao) {
+#ifdef __APPLE__
+            glBindVertexArrayAPPLE(mesh.vao);
+#else
+            glBindVertexArray(mesh.vao);
+#endif
+            boundVao = mesh.vao;
+        }
+        glUniformMatrix4fv(shadowShader.modelViewProjection, 1, GL_TRUE,
+                           view->viewProjection * caster.model * mesh.meshModel);
+        glDrawElementsBaseVertex(GL_TRIANGLES, mesh.count, mesh.indexType,
+                                 BUFFER_OFFSET((size_t) mesh.firstIndex * mesh.indexSize), mesh.baseVertex);
+        (*nDraws)++;
+        numShadowCastersDrawn++;
+    }
+    return complete;
+}
+
+// Bring the lit maps up to date with shadowCasters, redrawing only the views
+// that have changed (see the top of this file).  Leaves the framebuffer and
+// viewport as they were, but not the program or the VAO.  Returns the number
+// of draws.
+int updateShadowMaps() {
+    numShadowViewsDrawn = numShadowCastersDrawn = 0;
+    if (!useShadows) return 0;
+    shadowFrame++;
+    markMovedCasters();
+
+    int nDraws = 0;
+    GLint framebuffer, viewport[4];
+    bool stateSaved = false;
+    for (int m = 0; m < numShadowMaps; m++) {
+        shadowMap *map = &shadowMaps[m];
+        if (!map->lit) { // So it misses what moves, and starts again when it's lit
+            for (int v = 0; v < map->nViews; v++)
+                map->views[v].staticValid = map->views[v].valid = false;
+            continue;
+        }
+        setShadowViews(m);
+        for (int v = 0; v < map->nViews; v++) {
+            shadowView *view = &map->views[v];
+            for (size_t i = 0; i < casterStates.size() && view->staticValid; i++) {
+                GLubyte dirty = casterStates[i].dirty;
+                if (!dirty || !casterInView(view->f, i)) continue;
+                if (dirty & casterRestaticed) view->staticValid = false;
+                view->valid = false;
+            }
+            if (view->staticValid && view->valid) continue;
+
+            if (!stateSaved) {
+                glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+                glGetIntegerv(GL_VIEWPORT, viewport);
+                glUseProgram(shadowShader.id);
+                glEnable(GL_POLYGON_OFFSET_FILL);
+                glPolygonOffset(2.0, 4.0); // Keeps surfaces from shadowing themselves
+                stateSaved = true;
+            }
+            glViewport(0, 0, map->size, map->size);
+            numShadowViewsDrawn++;
+            if (!view->staticValid) {
+                glBindFramebuffer(GL_FRAMEBUFFER, view->staticFramebuffer);
+                glClear(GL_DEPTH_BUFFER_BIT);
+                view->staticValid = drawCasters(view, true, &nDraws);
+            }
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, view->staticFramebuffer);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, view->framebuffer);
+            glBlitFramebuffer(0, 0, map->size, map->size, 0, 0, map->size, map->size, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+            view->valid = drawCasters(view, false, &nDraws);
+        }
+    }
+
+    casterStates.resize(shadowCasters.size());
+    for (size_t i = 0; i < casterStates.size(); i++) {
+        casterState *state = &casterStates[i];
+        state->last = shadowCasters[i];
+        state->x = casterX[i];
+        state->y = casterY[i];
+        state->z = casterZ[i];
+        state->radius = casterRadius[i];
+    }
+
+    for (int m = 0; m < numShadowMaps; m++)
+        shadowMaps[m].lit = false; // Until aimShadowMap next frame
+
+    if (stateSaved) {
+        glDisable(GL_POLYGON_OFFSET_FILL);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    }
+    CheckError();
+    return nDraws;
+}
+
+// Fill in the Lights block's shadow matrices, from eye coordinates to each
+// map's, given the inverse of the view matrix.
+void setShadowMatrices(lightsBlock *lights, const mat4 &viewInverse) {
+    for (int m = 0; m < numShadowMaps; m++) {
+        mat4 fromEye = shadowMaps[m].fromWorld * viewInverse;
+        for (int col = 0; col < 4; col++)
+            for (int row = 0; row < 4; row++)
+                lights->shadowMatrices[m][col * 4 + row] = fromEye[row][col];
+    }
+    lights->shadowCubeRange[0] = shadowNear;
+    lights->shadowCubeRange[1] = shadowMaps[pointShadow].range;
+    lights->shadowCubeRange[2] = lights->shadowCubeRange[3] = 0.0;
+}
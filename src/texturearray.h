@@ -0,0 +1,110 @@
+// Texture array layout (texturearray.h)
+//
+// With --texture-array every texture goes into layers of one
+// GL_TEXTURE_2D_ARRAY, which stays bound for the whole frame, and each object
+// picks its texture with per-instance attributes instead of a bind.  Objects
+// with the same mesh and different textures can then share an instanced draw.
+//
+// Layers are all one size, the commonest size among the textures (1024 x 1024
+// with the standard set).  Textures of that size get a layer each.  Smaller
+// square power of two textures are packed as tiles into atlas layers, and
+// fStart.glsl wraps them by hand and keeps their mipmaps from blurring into
+// their neighbours.  Since each tile is at a multiple of its own size, every
+// one of its mip levels lands on whole texels of the layer's level.  Anything
+// else (not square, not a power of two, or bigger than a layer) keeps its own
+// texture object, drawn as before.
+//
+// The layout comes from the .bmp headers, so it's known before any textures
+// load.
+
+typedef struct {
+    int layer;    // Or -1 if the texture has its own texture object
+    GLuint x, y;  // The tile's corner in the layer, in texels at level 0
+    GLuint size;  // The tile's width and height; the layer size for a whole layer
+} textureArraySlot;
+
+typedef struct {
+    GLuint size;    // Width and height of every layer
+    GLuint nLevels;
+    int nLayers;
+    textureArraySlot slots[numTextures];
+} textureArrayLayout;
+
+static bool isPowerOfTwo(GLuint n) {
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+GLuint log2Size(GLuint size) {
+    GLuint n = 0;
+    while (size >> (n + 1) != 0) n++;
+    return n;
+}
+
+// Read just the width and height from a .bmp file's header.
+bool readBitmapSize(const char *fileName, GLuint *width, GLuint *height) {
+    GLubyte header[26];
+    FILE *fp = fopen(fileName, "rb");
+    if (fp == NULL) return false;
+    bool ok = fread(header, 1, sizeof(header), fp) == sizeof(header) && header[0] == 'B' && header[1] == 'M';
+    fclose(fp);
+    if (!ok) return false;
+
+    GLint w, h;
+    w = header[18] | header[19] << 8 | header[20] << 16 | header[21] << 24;
+    h = header[22] | header[23] << 8 | header[24] << 16 | header[25] << 24;
+    if (w <= 0 || h <= 0) return false; // As buildTextureBlob
+    *width = w;
+    *height = h;
+    return true;
+}
+
+// Place every texture in the array.  widths and heights are 0 for textures
+// that couldn't be read.
+void planTextureArray(const GLuint *widths, const GLuint *heights, textureArrayLayout *layout) {
+    // The commonest size becomes the layer size, the larger one on a tie
+    layout->size = 0;
+    int bestCount = 0;
+    for (int i = 0; i < numTextures; i++) {
+        if (widths[i] != heights[i] || !isPowerOfTwo(widths[i])) continue;
+        int count = 0;
+        for (int j = 0; j < numTextures; j++)
+            if (widths[j] == widths[i] && heights[j] == heights[i]) count++;
+        if (count > bestCount || (count == bestCount && widths[i] > layout->size)) {
+            bestCount = count;
+            layout->size = widths[i];
+        }
+    }
+    layout->nLevels = log2Size(std::max(layout->size, 1u)) + 1;
+
+    layout->nLayers = 0;
+    std::vector<int> tiles;
+    for (int i = 0; i < numTextures; i++) {
+        textureArraySlot *slot = &layout->slots[i];
+        slot->layer = -1;
+        slot->x = slot->y = 0;
+        slot->size = widths[i];
+        if (widths[i] != heights[i] || !isPowerOfTwo(widths[i]) || widths[i] > layout->size) continue;
+        if (widths[i] == layout->size) slot->layer = layout->nLayers++;
+        else tiles.push_back(i);
+    }
+
+    // Largest tiles first.  Then the area used so far is always a whole number
+    // of the current tile, and taking tiles in Morton order fills each atlas
+    // layer with no gaps.
+    std::stable_sort(tiles.begin(), tiles.end(), [widths](int a, int b) { return widths[a] > widths[b]; });
+    unsigned long long used = 0, layerArea = (unsigned long long) layout->size * layout->size;
+    for (size_t t = 0; t < tiles.size(); t++) {
+        textureArraySlot *slot = &layout->slots[tiles[t]];
+        unsigned long long tileArea = (unsigned long long) slot->size * slot->size;
+        unsigned long long index = used % layerArea / tileArea;
+        slot->layer = layout->nLayers + used / layerArea;
+        for (int bit = 0; bit < 32; bit++) {
+            slot->x |= (GLuint) ((index >> (2 * bit)) & 1) << bit;
+            slot->y |= (GLuint) ((index >> (2 * bit + 1)) & 1) << bit;
+        }
+        slot->x *= slot->size;
+        slot->y *= slot->size;
+        used += tileArea;
+    }
+    layout->nLayers += (used + layerArea - 1) / std::max(layerArea, 1ull);
+}
@@ -0,0 +1,250 @@
+// Baked texture cache (texturecache.h)
+//
+// Decoding a 24 bit BMP and then building its mipmaps with glGenerateMipmap
+// held up the display thread long enough to hitch whenever a new texture was
+// picked from the menu.  Instead each textureN.bmp is baked once into cacheDir
+// as a small KTX-like container: a header, then the whole mip chain, already
+// filtered (see mipmaps.h), as tightly packed RGBA8 rows that can go straight
+// to glTexSubImage2D.  Loading just maps the file (see meshcache.h) and uploads
+// each level into immutable glTexStorage2D storage.  A baked file is checked
+// against its source file the same way as for meshes.
+
+const char textureCacheMagic[4] = {'G', 'T', 'E', 'X'};
+const GLuint textureCacheVersion = 2; // Increase whenever the file layout or filtering changes
+const int maxTextureLevels = 16;      // Enough for 32768 x 32768
+
+// The start of every baked texture.  Levels are from largest to smallest,
+// with rows from the bottom of the image up, as OpenGL expects.
+typedef struct {
+    char magic[4];
+    GLuint version;
+    GLuint width, height;  // Of level 0
+    GLuint nLevels;        // Down to 1 x 1
+    GLuint filter;         // The mipFilter used to make levels 1 and up
+    unsigned long long sourceHash;  // FNV-1a hash of the .bmp file
+    unsigned long long sourceSize;
+    long long sourceModTime;
+    unsigned long long levelOffset[maxTextureLevels]; // From the start of the file
+} textureCacheHeader;
+
+GLuint mipLevelSize(GLuint size, GLuint level) {
+    return std::max(size >> level, 1u);
+}
+
+size_t mipLevelBytes(const textureCacheHeader *header, GLuint level) {
+    return (size_t) mipLevelSize(header->width, level) * mipLevelSize(header->height, level) * 4;
+}
+
+const GLubyte *textureCacheLevel(const textureCacheHeader *header, GLuint level) {
+    return (const GLubyte *) header + header->levelOffset[level];
+}
+
+size_t textureCacheFileSize(const textureCacheHeader *header) {
+    GLuint last = header->nLevels - 1;
+    return header->levelOffset[last] + mipLevelBytes(header, last);
+}
+
+mipFilter textureMipFilter = mipFilterBox; // Set with --mip-filter
+
+// These fill a fileName of 256 chars, and fail if the path won't fit.
+static void textureSourceFileName(int textureNumber, char *fileName) {
+    if (snprintf(fileName, 256, "%s/texture%d.bmp", dataDir, textureNumber) >= 256)
+        fail("Error - the models-textures path is too long:", dataDir);
+}
+
+static void textureCacheFileName(int textureNumber, char *fileName) {
+    if (snprintf(fileName, 256, "%s/texture%d.tex", cacheDir, textureNumber) >= 256)
+        fail("Error - the cache path is too long:", cacheDir);
+}
+
+//------Baking------------------------------------------------------------------
+
+// Decode a texture's BMP file and build its mip chain in blob.  Returns false
+// if the file can't be read or isn't an uncompressed 24 bit BMP.  levelMs is
+// as for buildMipChain.
+bool buildTextureBlob(int textureNumber, std::vector<GLubyte> &blob, double *levelMs = NULL) {
+    char sourceName[256];
+    textureSourceFileName(textureNumber, sourceName);
+
+    textureCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    if (!fileSizeAndModTime(sourceName, &header.sourceSize, &header.sourceModTime))
+        return false;
+
+    BITMAPINFO *info;
+    GLubyte *pixels = LoadDIBitmapRGBA(sourceName, &info);
+    if (pixels == NULL) return false;
+    int width = info->bmiHeader.biWidth, height = info->bmiHeader.biHeight;
+    free(info);
+    if (height <= 0) { // Top to bottom bitmaps aren't worth supporting
+        free(pixels);
+        return false;
+    }
+
+    memcpy(header.magic, textureCacheMagic, sizeof(header.magic));
+    header.version = textureCacheVersion;
+    header.filter = textureMipFilter;
+    header.width = width;
+    header.height = height;
+    header.sourceHash = hashFile(sourceName);
+    size_t offset = sizeof(textureCacheHeader);
+    while (header.nLevels < (GLuint) maxTextureLevels) {
+        header.levelOffset[header.nLevels] = offset;
+        offset += mipLevelBytes(&header, header.nLevels);
+        header.nLevels++;
+        if (mipLevelSize(header.width, header.nLevels - 1) == 1
+            && mipLevelSize(header.height, header.nLevels - 1) == 1)
+            break;
+    }
+    blob.resize(textureCacheFileSize(&header));
+    memcpy(blob.data(), &header, sizeof(header));
+
+    memcpy(blob.data() + header.levelOffset[0], pixels, mipLevelBytes(&header, 0));
+    free(pixels);
+
+    GLubyte *levels[maxTextureLevels];
+    for (GLuint level = 0; level < header.nLevels; level++)
+        levels[level] = blob.data() + header.levelOffset[level];
+    buildMipChain(header.width, header.height, header.nLevels, levels, textureMipFilter, levelMs);
+    return true;
+}
+
+// Bake a texture into the cache.  If the cache can't be written the result
+// is still returned in blob, so the caller can use it directly.
+bool bakeTexture(int textureNumber, std::vector<GLubyte> &blob, double *levelMs = NULL) {
+    if (!buildTextureBlob(textureNumber, blob, levelMs)) return false;
+
+    char cacheName[256];
+    textureCacheFileName(textureNumber, cacheName);
+    if (!writeFileAtomically(cacheName, blob.data(), blob.size()))
+        printf("Warning - couldn't write the texture cache file %s\n", cacheName);
+    return true;
+}
+
+// Map a texture's baked file, returning false if it is missing or out of date.
+bool mapBakedTexture(int textureNumber, mappedFile *mf) {
+    char cacheName[256], sourceName[256];
+    textureCacheFileName(textureNumber, cacheName);
+    textureSourceFileName(textureNumber, sourceName);
+
+    if (!mapFile(cacheName, mf)) return false;
+
+    const textureCacheHeader *header = (const textureCacheHeader *) mf->data;
+    unsigned long long sourceSize;
+    long long sourceModTime;
+    bool valid = mf->size >= sizeof(textureCacheHeader)
+                 && memcmp(header->magic, textureCacheMagic, sizeof(header->magic)) == 0
+                 && header->version == textureCacheVersion && header->filter == (GLuint) textureMipFilter
+                 && header->nLevels >= 1 && header->nLevels <= (GLuint) maxTextureLevels
+                 && mf->size == textureCacheFileSize(header)
+                 && fileSizeAndModTime(sourceName, &sourceSize, &sourceModTime)
+                 && sourceSize == header->sourceSize;
+
+    if (valid && sourceModTime != header->sourceModTime)
+        valid = hashFile(sourceName) == header->sourceHash;
+
+    if (!valid) unmapFile(mf);
+    return valid;
+}
+
+static void bakeTextureIfNeeded(int textureNumber) {
+    mappedFile mf;
+    if (mapBakedTexture(textureNumber, &mf)) {
+        unmapFile(&mf);
+        printf("texture%d: already baked\n", textureNumber);
+        return;
+    }
+
+    std::vector<GLubyte> blob;
+    double levelMs[maxTextureLevels];
+    if (!bakeTexture(textureNumber, blob, levelMs))
+        printf("texture%d: failed to load\n", textureNumber);
+    else {
+        const textureCacheHeader *header = (const textureCacheHeader *) blob.data();
+        double totalMs = 0.0;
+        char levelTimes[maxTextureLevels * 16] = "";
+        for (GLuint level = 0; level < header->nLevels; level++) {
+            totalMs += levelMs[level];
+            sprintf(levelTimes + strlen(levelTimes), " %.2f", levelMs[level]);
+        }
+        printf("texture%d: baked %u by %u, %u levels, %zu bytes, %s mipmaps in %.1f ms, by level:%s\n",
+               textureNumber, header->width, header->height, header->nLevels, blob.size(),
+               mipFilterNames[header->filter], totalMs, levelTimes);
+    }
+}
+
+// Bake every texture that isn't already in the cache (for --bake), using all
+// of the worker threads.
+void bakeAllTextures() {
+    for (int i = 0; i < numTextures; i++)
+        queueWork([i] { bakeTextureIfNeeded(i); });
+    waitForWorkers();
+}
+
+//------Previews----------------------------------------------------------------
+
+const GLuint previewSize = 16; // The largest level kept in a preview
+
+// Copy the levels of a baked texture that fit within maxSize x maxSize into
+// blob, laid out as a baked texture of their own, to draw with while the rest
+// uploads.  Returns false if level 0 already fits, so there's nothing smaller
+// worth having.
+bool copySmallestLevels(const textureCacheHeader *header, GLuint maxSize, std::vector<GLubyte> &blob) {
+    GLuint first = 0;
+    while (first + 1 < header->nLevels
+           && (mipLevelSize(header->width, first) > maxSize || mipLevelSize(header->height, first) > maxSize))
+        first++;
+    if (first == 0) return false;
+
+    textureCacheHeader small = *header;
+    small.width = mipLevelSize(header->width, first);
+    small.height = mipLevelSize(header->height, first);
+    small.nLevels = header->nLevels - first;
+    size_t shift = header->levelOffset[first] - sizeof(textureCacheHeader);
+    memset(small.levelOffset, 0, sizeof(small.levelOffset));
+    for (GLuint level = 0; level < small.nLevels; level++)
+        small.levelOffset[level] = header->levelOffset[first + level] - shift;
+
+    blob.resize(textureCacheFileSize(&small));
+    memcpy(blob.data(), &small, sizeof(small));
+    memcpy(blob.data() + sizeof(small), textureCacheLevel(header, first), blob.size() - sizeof(small));
+    return true;
+}
+
+//------Bitmap decoding benchmark-----------------------------------------------
+
+// Time decoding every texture with each of lib/bitmap's pixel conversion
+// kernels (for --bench-bitmaps), as RGB the way LoadDIBitmap returns it and as
+// RGBA for baking, taking the best of a few runs.
+void benchmarkBitmapDecoding() {
+    const int runs = 5;
+    double scalarTime[2] = {0.0, 0.0};
+    printf("%-8s %12s %12s %8s\n", "kernel", "RGB ms", "RGBA ms", "speedup");
+    for (int kernel = BITMAP_KERNEL_SCALAR; kernel <= BITMAP_KERNEL_AVX2; kernel++) {
+        if (BitmapUseKernel(kernel) != kernel) continue; // The CPU can't run it
+
+        double best[2] = {1e30, 1e30};
+        for (int rgba = 0; rgba < 2; rgba++)
+            for (int run = 0; run < runs; run++) {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                for (int i = 0; i < numTextures; i++) {
+                    char fileName[256];
+                    textureSourceFileName(i, fileName);
+                    BITMAPINFO *info;
+                    GLubyte *pixels = rgba ? LoadDIBitmapRGBA(fileName, &info) : LoadDIBitmap(fileName, &info);
+                    if (pixels == NULL) continue;
+                    free(pixels);
+                    free(info);
+                }
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                best[rgba] = std::min(best[rgba], elapsed.count());
+            }
+        if (kernel == BITMAP_KERNEL_SCALAR) {
+            scalarTime[0] = best[0];
+            scalarTime[1] = best[1];
+        }
+        printf("%-8s %12.2f %12.2f %7.2fx\n", BitmapKernelName(kernel), best[0], best[1],
+               (scalarTime[0] + scalarTime[1]) / (best[0] + best[1]));
+    }
+    BitmapUseKernel(BITMAP_KERNEL_AUTO);
+}
@@ -0,0 +1,150 @@
+// Worker threads for loading in the background (threadpool.h)
+//
+// Jobs are queued with queueWork and run on a small fixed pool of threads,
+// and parallelFor spreads a loop over them.
+// Anything that must happen on the GL thread afterwards (e.g., creating
+// buffers) is handed back through a completionQueue, which the display
+// function drains once per frame without ever blocking.
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// The pool state is deliberately never destroyed: the workers are detached, and
+// exit() may be called (e.g., from the menu) while they are still running.
+typedef struct {
+    std::mutex mutex;
+    std::condition_variable workAvailable, allDone;
+    std::deque<std::function<void()> > jobs;
+    int nBusy;
+    int nThreads;
+} workerPool;
+
+static workerPool *workers = NULL;
+
+static void workerThreadMain() {
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(workers->mutex);
+            workers->workAvailable.wait(lock, [] { return !workers->jobs.empty(); });
+            job = workers->jobs.front();
+            workers->jobs.pop_front();
+            workers->nBusy++;
+        }
+
+        job();
+
+        std::unique_lock<std::mutex> lock(workers->mutex);
+        if (--workers->nBusy == 0 && workers->jobs.empty())
+            workers->allDone.notify_all();
+    }
+}
+
+// Start the worker threads - one fewer than the number of cores, so the
+// display thread keeps a core to itself, but at least one and at most four.
+void startWorkerThreads() {
+    if (workers != NULL) return;
+    workers = new workerPool();
+    workers->nBusy = 0;
+
+    int nCores = std::thread::hardware_concurrency();
+    workers->nThreads = std::max(1, std::min(4, nCores - 1));
+    for (int i = 0; i < workers->nThreads; i++)
+        std::thread(workerThreadMain).detach();
+}
+
+void queueWork(std::function<void()> job) {
+    startWorkerThreads();
+    {
+        std::lock_guard<std::mutex> lock(workers->mutex);
+        workers->jobs.push_back(job);
+    }
+    workers->workAvailable.notify_one();
+}
+
+// Block until every queued job has finished (only used when baking).
+void waitForWorkers() {
+    if (workers == NULL) return;
+    std::unique_lock<std::mutex> lock(workers->mutex);
+    workers->allDone.wait(lock, [] { return workers->nBusy == 0 && workers->jobs.empty(); });
+}
+
+// Shared by the threads running a parallelFor.
+typedef struct {
+    std::atomic<int> next, nDone;
+    int n;
+    std::function<void(int)> body;
+    std::mutex mutex;
+    std::condition_variable allDone;
+} parallelForState;
+
+static void runParallelFor(parallelForState *state) {
+    for (;;) {
+        int i = state->next.fetch_add(1);
+        if (i >= state->n) return;
+        state->body(i);
+        if (state->nDone.fetch_add(1) + 1 == state->n) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->allDone.notify_all();
+        }
+    }
+}
+
+// Run body(i) for every i from 0 to n - 1, spread over the workers, and
+// return once they have all finished.  The calling thread takes its share
+// too, and only waits for calls that have already started, so this is safe
+// to use from a job on a worker thread even when every other worker is busy.
+void parallelFor(int n, std::function<void(int)> body) {
+    if (n <= 0) return;
+    startWorkerThreads();
+    std::shared_ptr<parallelForState> state = std::make_shared<parallelForState>();
+    state->next = 0;
+    state->nDone = 0;
+    state->n = n;
+    state->body = body;
+
+    int nHelpers = std::min(workers->nThreads, n - 1);
+    for (int i = 0; i < nHelpers; i++)
+        queueWork([state] { runParallelFor(state.get()); });
+    runParallelFor(state.get());
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->allDone.wait(lock, [&] { return state->nDone.load() == n; });
+}
+
+// A lock-free queue of finished jobs, pushed by any worker and drained by the
+// display thread.  T must have a "T *next" member.  Pushing is a single
+// compare-and-swap onto a list; draining swaps the whole list out at once
+// and reverses it so jobs come back in the order they finished.
+template<typename T>
+struct completionQueue {
+    std::atomic<T *> head;
+
+    completionQueue() : head(NULL) {}
+
+    void push(T *item) {
+        T *old = head.load(std::memory_order_relaxed);
+        do {
+            item->next = old;
+        } while (!head.compare_exchange_weak(old, item, std::memory_order_release,
+                                             std::memory_order_relaxed));
+    }
+
+    // Returns everything pushed so far as a list linked through next, oldest first.
+    T *takeAll() {
+        T *list = head.exchange(NULL, std::memory_order_acquire);
+        T *reversed = NULL;
+        while (list != NULL) {
+            T *next = list->next;
+            list->next = reversed;
+            reversed = list;
+            list = next;
+        }
+        return reversed;
+    }
+};
@@ -0,0 +1,64 @@
+// Object transforms (transforms.h)
+//
+// Each object keeps its model matrix from frame to frame, and it's only
+// rebuilt from the object's loc, scale and angles after something changes them
+// (see modelDirty in scene-start.cpp).  The model matrices are kept column
+// major, as the instance buffer takes them, in one array, and each frame the
+// model-view matrices of all the visible objects are made from them together:
+// view * model a column at a time, with SSE where it's available.
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define TRANSFORMS_SSE
+#endif
+
+typedef GLfloat columnMatrix[16]; // Column c is elements 4c to 4c + 3, as OpenGL takes them
+
+// a (which is by rows, like all mat4s) into columns.
+static void toColumns(const mat4 &a, GLfloat *columns) {
+    for (int col = 0; col < 4; col++)
+        for (int row = 0; row < 4; row++)
+            columns[col * 4 + row] = a[row][col];
+}
+
+// out[id] = view * models[id] for each of the n ids in which.
+void multiplyModelViews(const mat4 &view, const columnMatrix *models, const int *which, int n,
+                        columnMatrix *out) {
+    columnMatrix v;
+    toColumns(view, v);
+#ifdef TRANSFORMS_SSE
+    __m128 v0 = _mm_loadu_ps(v), v1 = _mm_loadu_ps(v + 4), v2 = _mm_loadu_ps(v + 8), v3 = _mm_loadu_ps(v + 12);
+    for (int i = 0; i < n; i++) {
+        const GLfloat *m = models[which[i]];
+        GLfloat *mv = out[which[i]];
+        // Each column of the result is the view's columns weighted by that column of the model
+        for (int col = 0; col < 16; col += 4) {
+            __m128 sum = _mm_mul_ps(v0, _mm_set1_ps(m[col]));
+            sum = _mm_add_ps(sum, _mm_mul_ps(v1, _mm_set1_ps(m[col + 1])));
+            sum = _mm_add_ps(sum, _mm_mul_ps(v2, _mm_set1_ps(m[col + 2])));
+            sum = _mm_add_ps(sum, _mm_mul_ps(v3, _mm_set1_ps(m[col + 3])));
+            _mm_storeu_ps(mv + col, sum);
+        }
+    }
+#else
+    for (int i = 0; i < n; i++) {
+        const GLfloat *m = models[which[i]];
+        GLfloat *mv = out[which[i]];
+        for (int col = 0; col < 16; col += 4)
+            for (int row = 0; row < 4; row++)
+                mv[col + row] = v[row] * m[col] + v[4 + row] * m[col + 1] + v[8 + row] * m[col + 2]
+                                + v[12 + row] * m[col + 3];
+    }
+#endif
+}
+
+// m = m * Translate(offset) * Scale(scale), for m in columns: only its columns
+// are scaled and the last moved.
+static void translateScaleColumns(GLfloat *m, const vec3 &offset, const vec3 &scale) {
+    for (int row = 0; row < 4; row++) {
+        m[12 + row] += m[row] * offset.x + m[4 + row] * offset.y + m[8 + row] * offset.z;
+        m[row] *= scale.x;
+        m[4 + row] *= scale.y;
+        m[8 + row] *= scale.z;
+    }
+}
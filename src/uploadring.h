@@ -0,0 +1,125 @@
+// Persistently mapped upload ring (uploadring.h)
+//
+// One large pixel unpack buffer, created with glBufferStorage and left mapped
+// for the life of the program, which the worker threads copy texture data
+// straight into.  The display thread then uploads from the buffer rather than
+// from client memory, so glTexSubImage2D returns at once and the driver can
+// copy the pixels to the texture asynchronously.  Space is handed out in order
+// around the ring.  Each upload is followed by a fence, and its space is only
+// reused once that fence has signalled.  Without OpenGL 4.4 or
+// ARB_buffer_storage the ring is empty and every allocation fails, so callers
+// upload from client memory as before.
+
+const size_t uploadRingSize = 32 << 20; // Room for a few 1024 x 1024 mip chains at once
+const size_t uploadRingAlignment = 256;
+
+typedef struct {
+    size_t size;   // Including any space skipped to wrap around to the start
+    bool released;
+} uploadRange;
+
+#ifndef __APPLE__
+typedef struct {
+    GLsync sync;
+    unsigned long long range;
+} uploadFence;
+#endif
+
+typedef struct {
+    GLuint buffer;
+    GLubyte *data; // The whole buffer, mapped, or NULL if the ring isn't available
+    size_t size;
+
+    std::mutex mutex; // Guards the allocation state below, since workers allocate
+    size_t head, used;
+    std::deque<uploadRange> ranges; // Oldest first
+    unsigned long long firstRange;  // The number of ranges.front()
+
+#ifndef __APPLE__
+    std::deque<uploadFence> fences; // Only touched by the display thread
+#endif
+} uploadRing;
+
+// Create the buffer and map it for good.  Leaves ring->data NULL if the
+// driver can't keep a buffer mapped while the GPU reads from it.
+void initUploadRing(uploadRing *ring, size_t size) {
+    ring->data = NULL;
+    ring->size = ring->head = ring->used = 0;
+    ring->firstRange = 0;
+#ifndef __APPLE__
+    if (!(GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)) return;
+
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &ring->buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->buffer);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+    ring->data = (GLubyte *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    CheckError();
+    if (ring->data != NULL) ring->size = size;
+#endif
+}
+
+// Reserve space for bytes, from any thread.  Returns where to write them and
+// sets *range to what to release them with, or returns NULL if there isn't
+// room until the GPU catches up (or there's no ring).
+GLubyte *allocateUpload(uploadRing *ring, size_t bytes, unsigned long long *range) {
+    bytes = (bytes + uploadRingAlignment - 1) & ~(uploadRingAlignment - 1);
+    std::lock_guard<std::mutex> lock(ring->mutex);
+
+    size_t offset = ring->head, skipped = 0;
+    if (offset + bytes > ring->size) { // Wrap around rather than split it
+        skipped = ring->size - offset;
+        offset = 0;
+    }
+    if (ring->used + skipped + bytes > ring->size) return NULL;
+
+    uploadRange r = {skipped + bytes, false};
+    ring->ranges.push_back(r);
+    ring->used += r.size;
+    ring->head = offset + bytes;
+    *range = ring->firstRange + ring->ranges.size() - 1;
+    return ring->data + offset;
+}
+
+// Give back a range.  Space is reused in order, so it only comes free once
+// every range allocated before it has been released too.
+void releaseUpload(uploadRing *ring, unsigned long long range) {
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    ring->ranges[range - ring->firstRange].released = true;
+    while (!ring->ranges.empty() && ring->ranges.front().released) {
+        ring->used -= ring->ranges.front().size;
+        ring->ranges.pop_front();
+        ring->firstRange++;
+    }
+    if (ring->used == 0) ring->head = 0;
+}
+
+// The offset of an allocation in the buffer, for the pointer argument of
+// glTexSubImage2D etc. while the buffer is bound to GL_PIXEL_UNPACK_BUFFER.
+size_t uploadOffset(const uploadRing *ring, const GLubyte *data) {
+    return data - ring->data;
+}
+
+// Call on the display thread after issuing the GL commands that read a range.
+void fenceUpload(uploadRing *ring, unsigned long long range) {
+#ifndef __APPLE__
+    uploadFence fence = {glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), range};
+    ring->fences.push_back(fence);
+#endif
+}
+
+// Release every range whose fence has signalled, without waiting.  Fences
+// signal in the order they were issued, so this stops at the first that hasn't.
+void reclaimUploads(uploadRing *ring) {
+#ifndef __APPLE__
+    while (!ring->fences.empty()) {
+        uploadFence fence = ring->fences.front();
+        GLenum status = glClientWaitSync(fence.sync, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) break;
+        glDeleteSync(fence.sync);
+        releaseUpload(ring, fence.range);
+        ring->fences.pop_front();
+    }
+#endif
+}
@@ -0,0 +1,96 @@
+// Compact vertex formats (vertexformat.h)
+//
+// Mesh vertices are stored interleaved and quantized, in one of two layouts:
+//   - snorm16 positions (16 bytes a vertex), scaled to fill -1..1 over the
+//     mesh's bounds and scaled back by the model matrix (see posScale), or
+//   - float positions (20 bytes a vertex), for meshes with detail too fine for
+//     16 bits across their whole size.
+// Both use octahedral-encoded snorm16 normals (decoded in vStart.glsl) and
+// half float texture coordinates.  Compare 36 bytes a vertex for plain floats.
+
+enum vertexFormat { snorm16Positions = 0, floatPositions = 1 };
+
+typedef struct {
+    GLshort position[4]; // The fourth component just pads to 8 bytes
+    GLshort normal[2];
+    GLushort texCoord[2];
+} packedVertex;
+
+typedef struct {
+    GLfloat position[3];
+    GLshort normal[2];
+    GLushort texCoord[2];
+} packedVertexFloat;
+
+size_t vertexSize(GLuint format) {
+    return format == floatPositions ? sizeof(packedVertexFloat) : sizeof(packedVertex);
+}
+
+// Depth passes read the positions alone, tightly packed in a buffer of their
+// own, so they don't fetch the rest of each vertex.  snorm16 positions keep
+// their padding, so each starts on 4 bytes.
+size_t positionSize(GLuint format) {
+    return format == floatPositions ? 3 * sizeof(GLfloat) : 4 * sizeof(GLshort);
+}
+
+// Copy the positions of n vertices in the given format to positions, packed.
+void copyPositions(GLuint format, const void *vertices, size_t n, GLubyte *positions) {
+    size_t stride = vertexSize(format), size = positionSize(format);
+    const GLubyte *from = (const GLubyte *) vertices
+                          + (format == floatPositions ? offsetof(packedVertexFloat, position)
+                                                      : offsetof(packedVertex, position));
+    for (size_t i = 0; i < n; i++)
+        memcpy(positions + i * size, from + i * stride, size);
+}
+
+// Map -1..1 to a normalized short, using the GL 4.2 convention (c / 32767).
+GLshort packSnorm16(float f) {
+    f = std::max(-1.0f, std::min(1.0f, f));
+    return (GLshort) floor(f * 32767.0 + 0.5);
+}
+
+// Convert a float to a half float, rounding to nearest.  Values too large for
+// a half become infinity, and tiny ones become denormals or zero.
+GLushort packHalf(float f) {
+    GLuint bits;
+    memcpy(&bits, &f, sizeof(bits));
+    GLuint sign = (bits >> 16) & 0x8000;
+    int exponent = (int) ((bits >> 23) & 0xff) - 127 + 15;
+    GLuint mantissa = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff) // Infinity or NaN
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if (exponent >= 31)
+        return sign | 0x7c00;
+    if (exponent <= 0) {
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000; // Make the implicit leading 1 explicit
+        int shift = 14 - exponent;
+        GLuint half = mantissa >> shift;
+        if ((mantissa >> (shift - 1)) & 1) half++;
+        return sign | half;
+    }
+
+    GLuint half = sign | (exponent << 10) | (mantissa >> 13);
+    if (mantissa & 0x1000) half++; // Round - a carry into the exponent is still correct
+    return half;
+}
+
+// Octahedral encoding: project the unit normal onto an octahedron, then fold
+// the lower half over the upper so it fits in a square.
+void packOctahedral(const vec3 &n, GLshort out[2]) {
+    float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+    if (l1 == 0.0) {
+        out[0] = out[1] = 0;
+        return;
+    }
+    float x = n.x / l1, y = n.y / l1;
+    if (n.z < 0.0) {
+        float foldedX = (1.0 - fabs(y)) * (x >= 0.0 ? 1.0 : -1.0);
+        float foldedY = (1.0 - fabs(x)) * (y >= 0.0 ? 1.0 : -1.0);
+        x = foldedX;
+        y = foldedY;
+    }
+    out[0] = packSnorm16(x);
+    out[1] = packSnorm16(y);
+}
@@ -0,0 +1,427 @@
+// Fast loader for text .x models (xparser.h)
+//
+// All the models in models-textures are text DirectX files with a single Mesh
+// and the same few templates, so rather than have Assimp tokenize them one
+// std::string at a time, this reads them in one pass straight from a memory
+// mapped file.  Nearly all of a file is the big vertex, normal and face
+// arrays, so the number parser works on up to 8 digits at once: SSE2 finds how
+// many digits there are and they are converted together in a 64 bit register.
+//
+// The output matches what Assimp gives with meshPostProcessFlags.  Assimp's .x
+// importer mirrors the z axis, the winding and v, and ConvertToLeftHanded
+// undoes all three, so everything comes out as written in the file (frame
+// transforms aren't applied either).  Faces with more than three corners are
+// split into fans, identical vertices are merged, and if there are several
+// materials only the faces of the first one used are kept, as Assimp puts the
+// rest in other meshes.  Anything else (binary files, several meshes, missing
+// normals, or anything that doesn't parse) returns false so that the caller
+// can fall back to Assimp.
+
+#include <unordered_map>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define XPARSER_SSE2
+#endif
+
+// A mesh as flat arrays, ready to be packed into vertex and index buffers.
+typedef struct {
+    std::vector<GLfloat> positions;  // x, y, z for each vertex
+    std::vector<GLfloat> normals;    // Likewise
+    std::vector<GLfloat> texCoords;  // u, v for each vertex, or empty if the model has none
+    std::vector<GLuint> indices;     // Three per triangle
+} meshData;
+
+//------Tokens and numbers------------------------------------------------------
+
+typedef struct {
+    const char *p, *end;
+} xCursor;
+
+// Skip whitespace and // or # comments.  Separators (commas and semicolons)
+// are skipped as well if wanted, which is how arrays are read.
+static void skipSpace(xCursor &c, bool separators) {
+    while (c.p < c.end) {
+        char ch = *c.p;
+        if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n' || (separators && (ch == ',' || ch == ';')))
+            c.p++;
+        else if (ch == '#' || (ch == '/' && c.p + 1 < c.end && c.p[1] == '/')) {
+            while (c.p < c.end && *c.p != '\n') c.p++;
+        } else
+            return;
+    }
+}
+
+static bool isNameChar(char ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_'
+           || ch == '-' || ch == '.';
+}
+
+// Read a template or object name.  Returns its length, 0 if there isn't one.
+static size_t readName(xCursor &c, const char **name) {
+    skipSpace(c, false);
+    *name = c.p;
+    while (c.p < c.end && isNameChar(*c.p)) c.p++;
+    return c.p - *name;
+}
+
+static bool nameIs(const char *name, size_t len, const char *what) {
+    return strlen(what) == len && memcmp(name, what, len) == 0;
+}
+
+static bool expectChar(xCursor &c, char ch) {
+    skipSpace(c, true);
+    if (c.p >= c.end || *c.p != ch) return false;
+    c.p++;
+    return true;
+}
+
+// Skip to just past the '}' matching a '{' that has already been read.
+static bool skipBlock(xCursor &c) {
+    int depth = 1;
+    while (depth > 0) {
+        skipSpace(c, true);
+        if (c.p >= c.end) return false;
+        char ch = *c.p++;
+        if (ch == '{') depth++;
+        else if (ch == '}') depth--;
+        else if (ch == '"')
+            while (c.p < c.end && *c.p++ != '"') {}
+    }
+    return true;
+}
+
+// How many ASCII digits start p, up to 8.  There must be 8 readable bytes.
+static inline int countDigits8(const char *p) {
+#ifdef XPARSER_SSE2
+    __m128i bytes = _mm_loadl_epi64((const __m128i *) p);
+    __m128i notDigit = _mm_or_si128(_mm_cmplt_epi8(bytes, _mm_set1_epi8('0')),
+                                    _mm_cmpgt_epi8(bytes, _mm_set1_epi8('9')));
+    unsigned mask = _mm_movemask_epi8(notDigit) | 0x100;
+    int n = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        n++;
+    }
+    return n;
+#else
+    int n = 0;
+    while (n < 8 && p[n] >= '0' && p[n] <= '9') n++;
+    return n;
+#endif
+}
+
+// Convert the n (1 to 8) digits at p together.  There must be 8 readable bytes.
+static inline GLuint parseDigits8(const char *p, int n) {
+    unsigned long long v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    GLuint value = 0;
+    for (int i = 0; i < n; i++) value = value * 10 + (p[i] - '0');
+    return value;
+#else
+    // Shift the digits to the top, filling in below with '0's, so it's as if
+    // there were exactly 8 digits with leading zeros
+    if (n < 8) v = v << (8 * (8 - n)) | 0x3030303030303030ULL >> (8 * n);
+    v -= 0x3030303030303030ULL;
+    v = v * 10 + (v >> 8);  // Pairs of digits
+    v = ((v & 0x000000FF000000FFULL) * 0x000F424000000064ULL
+         + ((v >> 16) & 0x000000FF000000FFULL) * 0x0000271000000001ULL) >> 32;
+    return (GLuint) v;
+#endif
+}
+
+static const unsigned long long powersOf10[9] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000,
+                                                 100000000};
+
+// Read a run of digits into value, adding how many there were to nDigits.
+static const char *readDigits(const char *p, const char *end, unsigned long long *value, int *nDigits) {
+    while (p + 8 <= end) {
+        int n = countDigits8(p);
+        if (n == 0) return p;
+        *value = *value * powersOf10[n] + parseDigits8(p, n);
+        *nDigits += n;
+        p += n;
+        if (n < 8) return p;
+    }
+    for (; p < end && *p >= '0' && *p <= '9'; p++, (*nDigits)++)
+        *value = *value * 10 + (*p - '0');
+    return p;
+}
+
+static bool readInt(xCursor &c, GLuint *value) {
+    skipSpace(c, true);
+    unsigned long long v = 0;
+    int nDigits = 0;
+    c.p = readDigits(c.p, c.end, &v, &nDigits);
+    if (nDigits == 0 || nDigits > 10 || v > 0xffffffffULL) return false;
+    *value = (GLuint) v;
+    return true;
+}
+
+static bool readFloat(xCursor &c, GLfloat *value) {
+    skipSpace(c, true);
+    const char *start = c.p, *p = c.p;
+    bool negative = p < c.end && *p == '-';
+    if (p < c.end && (*p == '-' || *p == '+')) p++;
+
+    unsigned long long mantissa = 0;
+    int nDigits = 0, exponent = 0;
+    p = readDigits(p, c.end, &mantissa, &nDigits);
+    if (p < c.end && *p == '.') {
+        const char *fraction = ++p;
+        p = readDigits(p, c.end, &mantissa, &nDigits);
+        exponent = -(int) (p - fraction);
+    }
+    if (nDigits == 0) return false;
+    if (p < c.end && (*p == 'e' || *p == 'E')) {
+        xCursor e = {p + 1, c.end};
+        bool negativeExp = e.p < e.end && *e.p == '-';
+        if (e.p < e.end && (*e.p == '-' || *e.p == '+')) e.p++;
+        unsigned long long exp = 0;
+        int nExpDigits = 0;
+        e.p = readDigits(e.p, e.end, &exp, &nExpDigits);
+        if (nExpDigits == 0 || nExpDigits > 4) return false;
+        exponent += negativeExp ? -(int) exp : (int) exp;
+        p = e.p;
+    }
+
+    double v;
+    if (nDigits > 18 || exponent < -22 || exponent > 22) {
+        // Too long to convert exactly here - rare enough not to matter.  The
+        // text isn't NUL terminated, so strtod gets a copy of the number.
+        char number[64];
+        if (p - start >= (ptrdiff_t) sizeof(number)) return false;
+        memcpy(number, start, p - start);
+        number[p - start] = '\0';
+        v = strtod(number, NULL);
+    } else {
+        static const double exact[23] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                         1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                         1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+        v = exponent < 0 ? mantissa / exact[-exponent] : mantissa * exact[exponent];
+        if (negative) v = -v;
+    }
+    *value = (GLfloat) v;
+    c.p = p;
+    return true;
+}
+
+//------The Mesh object----------------------------------------------------------
+
+// A Mesh's contents as they appear in the file, before welding.
+typedef struct {
+    std::vector<GLfloat> positions, normals, texCoords;
+    std::vector<GLuint> faceStart, faceIndices;     // Corners of face i start at faceIndices[faceStart[i]]
+    std::vector<GLuint> normalFaceIndices;          // Same layout, indexing normals
+    std::vector<GLuint> faceMaterials;              // Empty, or one per face
+} xMesh;
+
+// Whether n items of at least minBytes each could fit in what's left of the
+// file.  Counts are checked with this before anything is sized by them, so a
+// bad one fails the parse rather than wrapping or asking for a huge buffer.
+static bool countFits(const xCursor &c, GLuint n, size_t minBytes) {
+    return n <= (size_t) (c.end - c.p) / minBytes;
+}
+
+// Read n items of the given number of floats each (e.g., 3 for positions).
+static bool readFloats(xCursor &c, GLuint n, GLuint perItem, std::vector<GLfloat> &out) {
+    if (!countFits(c, n, 2 * perItem)) return false; // Each float is at least a digit and a separator
+    out.resize((size_t) n * perItem);
+    for (size_t i = 0; i < out.size(); i++)
+        if (!readFloat(c, &out[i])) return false;
+    return true;
+}
+
+// Read nFaces then each face as a corner count followed by that many indices.
+static bool readFaces(xCursor &c, std::vector<GLuint> &faceStart, std::vector<GLuint> &faceIndices) {
+    GLuint nFaces;
+    if (!readInt(c, &nFaces) || !countFits(c, nFaces, 4)) return false;
+    faceStart.resize((size_t) nFaces + 1);
+    faceIndices.clear();
+    faceIndices.reserve((size_t) nFaces * 3);
+    for (GLuint i = 0; i < nFaces; i++) {
+        GLuint nCorners, index;
+        if (!readInt(c, &nCorners) || nCorners < 3) return false;
+        faceStart[i] = faceIndices.size();
+        for (GLuint j = 0; j < nCorners; j++) {
+            if (!readInt(c, &index)) return false;
+            faceIndices.push_back(index);
+        }
+    }
+    faceStart[nFaces] = faceIndices.size();
+    return true;
+}
+
+// Read a data object's template name and optional object name, up to and
+// including its '{'.  Returns the length of the template name, 0 if it fails.
+static size_t readObjectStart(xCursor &c, const char **templateName) {
+    size_t len = readName(c, templateName);
+    const char *objectName;
+    readName(c, &objectName);
+    if (len == 0 || !expectChar(c, '{')) return 0;
+    return len;
+}
+
+// Read a Mesh object's contents, just after its '{', up to and including its '}'.
+static bool readXMesh(xCursor &c, xMesh &mesh) {
+    GLuint n;
+    if (!readInt(c, &n) || !readFloats(c, n, 3, mesh.positions)) return false;
+    if (!readFaces(c, mesh.faceStart, mesh.faceIndices)) return false;
+
+    for (;;) {
+        skipSpace(c, true);
+        if (c.p >= c.end) return false;
+        if (*c.p == '}') {
+            c.p++;
+            return true;
+        }
+        if (*c.p == '{') { // A reference to an object defined elsewhere
+            c.p++;
+            if (!skipBlock(c)) return false;
+            continue;
+        }
+
+        const char *name;
+        size_t len = readObjectStart(c, &name);
+        if (len == 0) return false;
+
+        if (nameIs(name, len, "MeshNormals")) {
+            std::vector<GLuint> normalFaceStart;
+            if (!readInt(c, &n) || !readFloats(c, n, 3, mesh.normals)
+                || !readFaces(c, normalFaceStart, mesh.normalFaceIndices)
+                || normalFaceStart != mesh.faceStart || !expectChar(c, '}'))
+                return false;
+        } else if (nameIs(name, len, "MeshTextureCoords") && mesh.texCoords.empty()) {
+            if (!readInt(c, &n) || !readFloats(c, n, 2, mesh.texCoords) || !expectChar(c, '}'))
+                return false;
+        } else if (nameIs(name, len, "MeshMaterialList")) {
+            // The materials themselves follow, but only the face to material map is needed
+            GLuint nMaterials, nFaceIndexes;
+            if (!readInt(c, &nMaterials) || !readInt(c, &nFaceIndexes) || !countFits(c, nFaceIndexes, 2))
+                return false;
+            mesh.faceMaterials.resize(nFaceIndexes);
+            for (GLuint i = 0; i < nFaceIndexes; i++)
+                if (!readInt(c, &mesh.faceMaterials[i])) return false;
+            if (!skipBlock(c)) return false;
+        } else if (!skipBlock(c))
+            return false;
+    }
+}
+
+//------Whole files---------------------------------------------------------------
+
+// Weld the corners of a mesh's faces into shared vertices and triangulate them.
+static bool buildMeshData(const xMesh &mesh, meshData &data) {
+    GLuint nVertices = mesh.positions.size() / 3, nNormals = mesh.normals.size() / 3;
+    GLuint nFaces = mesh.faceStart.size() - 1;
+    bool hasTexCoords = !mesh.texCoords.empty();
+    if (nNormals == 0 || (hasTexCoords && mesh.texCoords.size() != nVertices * 2)) return false;
+
+    // A single index means every face uses that material, otherwise there's one per face
+    GLuint keptMaterial = ~0u;
+    if (mesh.faceMaterials.size() > 1 && mesh.faceMaterials.size() != nFaces) return false;
+    for (size_t i = 0; i < mesh.faceMaterials.size(); i++)
+        keptMaterial = std::min(keptMaterial, mesh.faceMaterials[i]);
+
+    typedef struct {
+        GLfloat v[8]; // Position, normal and texture coordinates
+    } vertexKey;
+    struct hashVertexKey {
+        size_t operator()(const vertexKey &k) const {
+            size_t hash = 14695981039346656037ULL;
+            GLuint bits[8];
+            memcpy(bits, k.v, sizeof(bits));
+            for (int i = 0; i < 8; i++) hash = (hash ^ bits[i]) * 1099511628211ULL;
+            return hash;
+        }
+    };
+    struct sameVertexKey {
+        bool operator()(const vertexKey &a, const vertexKey &b) const {
+            return memcmp(a.v, b.v, sizeof(a.v)) == 0;
+        }
+    };
+    std::unordered_map<vertexKey, GLuint, hashVertexKey, sameVertexKey> vertexIds;
+    vertexIds.reserve(nVertices * 2);
+
+    data.positions.clear();
+    data.normals.clear();
+    data.texCoords.clear();
+    data.indices.clear();
+    data.indices.reserve(mesh.faceIndices.size() * 3 / 2);
+
+    std::vector<GLuint> corners;
+    for (GLuint f = 0; f < nFaces; f++) {
+        if (mesh.faceMaterials.size() > 1 && mesh.faceMaterials[f] != keptMaterial) continue;
+
+        corners.clear();
+        for (GLuint i = mesh.faceStart[f]; i < mesh.faceStart[f + 1]; i++) {
+            GLuint v = mesh.faceIndices[i], n = mesh.normalFaceIndices[i];
+            if (v >= nVertices || n >= nNormals) return false;
+
+            vertexKey key;
+            memcpy(key.v, &mesh.positions[v * 3], 3 * sizeof(GLfloat));
+            memcpy(key.v + 3, &mesh.normals[n * 3], 3 * sizeof(GLfloat));
+            key.v[6] = hasTexCoords ? mesh.texCoords[v * 2] : 0.0f;
+            key.v[7] = hasTexCoords ? mesh.texCoords[v * 2 + 1] : 0.0f;
+
+            std::pair<std::unordered_map<vertexKey, GLuint, hashVertexKey, sameVertexKey>::iterator, bool>
+                    found = vertexIds.insert(std::make_pair(key, (GLuint) vertexIds.size()));
+            if (found.second) {
+                data.positions.insert(data.positions.end(), key.v, key.v + 3);
+                data.normals.insert(data.normals.end(), key.v + 3, key.v + 6);
+                if (hasTexCoords) data.texCoords.insert(data.texCoords.end(), key.v + 6, key.v + 8);
+            }
+            corners.push_back(found.first->second);
+        }
+
+        for (size_t i = 1; i + 1 < corners.size(); i++) {
+            GLuint a = corners[0], b = corners[i], c = corners[i + 1];
+            if (a == b || b == c || a == c) continue; // Degenerate
+            data.indices.push_back(a);
+            data.indices.push_back(b);
+            data.indices.push_back(c);
+        }
+    }
+    return !data.indices.empty();
+}
+
+// Parse a whole .x file held in memory.  Returns false if it isn't in the
+// subset handled here, and the caller should use Assimp instead.
+bool parseXFile(const char *text, size_t size, meshData &data) {
+    // The header is e.g. "xof 0303txt 0032"
+    if (size < 16 || memcmp(text, "xof ", 4) != 0 || memcmp(text + 8, "txt ", 4) != 0) return false;
+    xCursor c = {text + 16, text + size};
+
+    xMesh mesh;
+    bool foundMesh = false;
+    int depth = 0; // How many Frames we're inside
+    for (;;) {
+        skipSpace(c, true);
+        if (c.p >= c.end) break;
+        if (*c.p == '}') {
+            if (--depth < 0) return false;
+            c.p++;
+            continue;
+        }
+        if (*c.p == '{') {
+            c.p++;
+            if (!skipBlock(c)) return false;
+            continue;
+        }
+
+        const char *name;
+        size_t len = readObjectStart(c, &name);
+        if (len == 0) return false;
+
+        if (nameIs(name, len, "Frame"))
+            depth++; // Its children are read as they come, and its transform ignored
+        else if (nameIs(name, len, "Mesh")) {
+            if (foundMesh || !readXMesh(c, mesh)) return false;
+            foundMesh = true;
+        } else if (!skipBlock(c)) // Templates, animations and anything else
+            return false;
+    }
+
+    return foundMesh && depth == 0 && buildMeshData(mesh, data);
+}